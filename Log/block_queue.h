@@ -1,11 +1,20 @@
 /*
 循环数组实现阻塞队列：back_ = (back_ + 1) % max_size_
+生产者和消费者分别在 not_full_ / not_empty_ 上等待，只有确实有线程在等待时才唤醒；
+元素以移动的方式放入和取出，PushBulk / PopAll / PopUpTo 一次加锁搬运一整批
 */
 
+#ifndef BLOCK_QUEUE_H
+#define BLOCK_QUEUE_H
+
 #include <stdlib.h>
+#include <errno.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/time.h>
 #include <iostream>
+#include <utility>
+#include <vector>
 
 template<typename T>
 class BlockQueue {
@@ -19,7 +28,8 @@ class BlockQueue {
 
     // 初始化锁资源和条件变量
     pthread_mutex_init(&this->lock_, NULL);
-    pthread_cond_init(&this->cond_, NULL);
+    pthread_cond_init(&this->not_empty_, NULL);
+    pthread_cond_init(&this->not_full_, NULL);
 
     // 初始化相关参数
     this->max_size_ = max_size;
@@ -27,6 +37,8 @@ class BlockQueue {
     this->size_ = 0;
     this->back_ = -1;
     this->front_ = -1;
+    this->consumers_waiting_ = 0;
+    this->producers_waiting_ = 0;
   }
 
   /// @brief 清空阻塞队列中的内容,不是真正上的清空，而是将相关参数初始化为
@@ -36,6 +48,10 @@ class BlockQueue {
     size_ = 0;
     front_ = -1;
     back_ = -1;
+    // 腾出了空间，等待空位的生产者都可以继续
+    if (producers_waiting_ > 0) {
+      pthread_cond_broadcast(&not_full_);
+    }
     pthread_mutex_unlock(&lock_);
   }
 
@@ -44,46 +60,93 @@ class BlockQueue {
    if (array_ != nullptr) {
     delete[] array_;
    }
-   ptherad_mutex_unlock(&lock_);
+   pthread_mutex_unlock(&lock_);
+   pthread_mutex_destroy(&lock_);
+   pthread_cond_destroy(&not_empty_);
+   pthread_cond_destroy(&not_full_);
   }
 
-  // 生产者添加一个任务
+  // 生产者添加一个任务，队列满时直接返回 false
   bool Push(const T& item) {
     pthread_mutex_lock(&lock_);
-    // 当前任务数量已经达到上限则通知消费者线程尽快拿取任务
-    // 为什么不是多加一个条件变量，等待消费者消费一个任务后的条件变量
     if (size_ >= max_size_) {
-      pthread_cond_broadcast(&cond_);
       pthread_mutex_unlock(&lock_);
       return false;
     }
+    PutLocked(item);
+    pthread_mutex_unlock(&lock_);
+    return true;
+  }
 
-    back_ = (back_ + 1) % max_size_;
-    array_[back_] = item;
+  // 移动版本，item 只有在成功放入时才被移走
+  bool Push(T&& item) {
+    pthread_mutex_lock(&lock_);
+    if (size_ >= max_size_) {
+      pthread_mutex_unlock(&lock_);
+      return false;
+    }
+    PutLocked(std::move(item));
+    pthread_mutex_unlock(&lock_);
+    return true;
+  }
 
-    ++size_;
-    // 通知所有等待条件变量的线程，若当前没有线程等待，则唤醒无意义
-    pthread_cond_broadcast(&cond_);
+  /// @brief 添加一个任务，队列满时最多等待 ms_timeout 毫秒
+  /// @return 成功返回 true，超时返回 false
+  bool Push(const T& item, int ms_timeout) {
+    pthread_mutex_lock(&lock_);
+    if (!WaitNotFull(ms_timeout)) {
+      pthread_mutex_unlock(&lock_);
+      return false;
+    }
+    PutLocked(item);
     pthread_mutex_unlock(&lock_);
     return true;
-  }  
+  }
 
-  // 消费者消费一个任务
-  bool Pop(T& item) {
+  bool Push(T&& item, int ms_timeout) {
     pthread_mutex_lock(&lock_);
-    // 当前没有任务，等待生产者生产一个任务
-    while (size_ <= 0) {
-      int ret = pthread_cond_wait(&cond_, &lock_);
-      if (ret != 0) {
-        pthread_mutex_unlock(&lock_);
-        return false;
+    if (!WaitNotFull(ms_timeout)) {
+      pthread_mutex_unlock(&lock_);
+      return false;
+    }
+    PutLocked(std::move(item));
+    pthread_mutex_unlock(&lock_);
+    return true;
+  }
+
+  /// @brief 一次加锁放入 [first, last) 中的任务，放不下的部分不放入
+  /// 传入 std::make_move_iterator 可以移动而不是拷贝
+  /// @return 实际放入的任务数量
+  template<typename Iterator>
+  int PushBulk(Iterator first, Iterator last) {
+    pthread_mutex_lock(&lock_);
+    int n = 0;
+    for (; first != last && size_ < max_size_; ++first, ++n) {
+      back_ = (back_ + 1) % max_size_;
+      array_[back_] = *first;
+      ++size_;
+    }
+    // 放入了几个任务就最多唤醒几个消费者
+    if (n > 0 && consumers_waiting_ > 0) {
+      if (n == 1) {
+        pthread_cond_signal(&not_empty_);
+      } else {
+        pthread_cond_broadcast(&not_empty_);
       }
     }
+    pthread_mutex_unlock(&lock_);
+    return n;
+  }
 
-    // 取出一个任务
-    front_ = (front_ + 1) % max_size_;
-    item = array_[front_];
-    --size_;
+  // 消费者消费一个任务，没有任务时一直等待
+  bool Pop(T& item) {
+    pthread_mutex_lock(&lock_);
+    // 当前没有任务，等待生产者生产一个任务
+    if (!WaitNotEmpty(-1)) {
+      pthread_mutex_unlock(&lock_);
+      return false;
+    }
+    TakeLocked(item);
     pthread_mutex_unlock(&lock_);
     return true;
   }
@@ -91,37 +154,54 @@ class BlockQueue {
   /// @brief 取出一个任务，如果没有任务可取则等待 ms_timeout 时间。
   /// @param item 存储任务的变量
   /// @param ms_timeout 超时时间
-  /// @return 成功返回 ture 
+  /// @return 成功返回 ture
   bool Pop(T& item, int ms_timeout) {
-    struct timespec t = {0, 0};
-    struct timeval now = {0, 0};
-    gettimeofday(&now, NULL);
     pthread_mutex_lock(&lock_);
-    if (size_ <= 0) {
-      t.tv_sec = now.tv_sec + ms_timeout / 1000; //s
-      t.tv_nsec = (ms_timeout % 1000) * 1000; // ns
-      // 阻塞 ms_timeout 时间
-      int ret = pthread_cond_timedwait(&cond_, &lock_, t);
-      if (ret != 0) {
-        pthread_mutex_unlock(&lock_);
-        return false;
-      }
-    }
-
-    // 阻塞 ms_timeout 时间后队列中仍然没有任务则直接返回失败
-    if (size_ <= 0) {
+    // 等到截止时间仍然没有任务则直接返回失败
+    if (!WaitNotEmpty(ms_timeout)) {
       pthread_mutex_unlock(&lock_);
       return false;
     }
-
-    // 正常取任务的逻辑
-    front_ = (front_ + 1) % max_size_;
-    item = array_[front_];
-    --size_;
+    TakeLocked(item);
     pthread_mutex_unlock(&lock_);
     return true;
   }
 
+  /// @brief 一次加锁取出最多 n 个任务，追加到 out 的末尾
+  /// @param ms_timeout 没有任务时的等待时间，-1 一直等待，0 不等待
+  /// @return 取出的任务数量，超时返回 0
+  int PopUpTo(std::vector<T>& out, int n, int ms_timeout = -1) {
+    pthread_mutex_lock(&lock_);
+    if (n <= 0 || !WaitNotEmpty(ms_timeout)) {
+      pthread_mutex_unlock(&lock_);
+      return 0;
+    }
+    int count = size_ < n ? size_ : n;
+    out.reserve(out.size() + count);
+    for (int i = 0; i < count; ++i) {
+      front_ = (front_ + 1) % max_size_;
+      out.push_back(std::move(array_[front_]));
+    }
+    size_ -= count;
+    // 腾出了几个空位就最多唤醒几个生产者
+    if (producers_waiting_ > 0) {
+      if (count == 1) {
+        pthread_cond_signal(&not_full_);
+      } else {
+        pthread_cond_broadcast(&not_full_);
+      }
+    }
+    pthread_mutex_unlock(&lock_);
+    return count;
+  }
+
+  /// @brief 一次加锁取出队列中的全部任务，追加到 out 的末尾
+  /// @param ms_timeout 没有任务时的等待时间，-1 一直等待，0 不等待
+  /// @return 取出的任务数量，超时返回 0
+  int PopAll(std::vector<T>& out, int ms_timeout = -1) {
+    return PopUpTo(out, max_size_, ms_timeout);
+  }
+
   // 一些常用接口
 
   /// @brief 判断队列是否满了
@@ -131,7 +211,7 @@ class BlockQueue {
     if (size_ >= max_size_) {
       pthread_mutex_unlock(&lock_);
       return true;
-    }    
+    }
     pthread_mutex_unlock(&lock_);
     return false;
   }
@@ -140,7 +220,7 @@ class BlockQueue {
     pthread_mutex_lock(&lock_);
     if (0 == size_) {
       pthread_mutex_unlock(&lock_);
-      return true; 
+      return true;
     }
 
     pthread_mutex_unlock(&lock_);
@@ -149,13 +229,95 @@ class BlockQueue {
 
 
  private:
+  // 放入一个任务并唤醒一个等待的消费者，调用者需持有 lock_ 且队列未满
+  template<typename U>
+  void PutLocked(U&& item) {
+    back_ = (back_ + 1) % max_size_;
+    array_[back_] = std::forward<U>(item);
+    ++size_;
+    // 只有一个新任务，唤醒一个消费者就够了，没有消费者在等待则不必唤醒
+    if (consumers_waiting_ > 0) {
+      pthread_cond_signal(&not_empty_);
+    }
+  }
+
+  // 取出一个任务并唤醒一个等待的生产者，调用者需持有 lock_ 且队列非空
+  void TakeLocked(T& item) {
+    front_ = (front_ + 1) % max_size_;
+    item = std::move(array_[front_]);
+    --size_;
+    if (producers_waiting_ > 0) {
+      pthread_cond_signal(&not_full_);
+    }
+  }
+
+  // 计算 ms_timeout 毫秒之后的绝对时间（CLOCK_REALTIME）
+  static struct timespec Deadline(int ms_timeout) {
+    struct timespec t = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &t);
+    long long ns = t.tv_nsec + (long long)(ms_timeout % 1000) * 1000000;
+    t.tv_sec += ms_timeout / 1000 + ns / 1000000000;
+    t.tv_nsec = ns % 1000000000;
+    return t;
+  }
+
+  // 等待队列非空，-1 一直等待，调用者需持有 lock_
+  // 截止时间只计算一次，被提前唤醒（或虚假唤醒）后继续等到同一个截止时间
+  bool WaitNotEmpty(int ms_timeout) {
+    if (size_ > 0) {
+      return true;
+    }
+    if (ms_timeout == 0) {
+      return false;
+    }
+    struct timespec deadline = Deadline(ms_timeout);
+    ++consumers_waiting_;
+    while (size_ <= 0) {
+      int ret = ms_timeout < 0
+                    ? pthread_cond_wait(&not_empty_, &lock_)
+                    : pthread_cond_timedwait(&not_empty_, &lock_, &deadline);
+      if (ret != 0) {
+        break;
+      }
+    }
+    --consumers_waiting_;
+    return size_ > 0;
+  }
+
+  // 等待队列未满，-1 一直等待，调用者需持有 lock_
+  bool WaitNotFull(int ms_timeout) {
+    if (size_ < max_size_) {
+      return true;
+    }
+    if (ms_timeout == 0) {
+      return false;
+    }
+    struct timespec deadline = Deadline(ms_timeout);
+    ++producers_waiting_;
+    while (size_ >= max_size_) {
+      int ret = ms_timeout < 0
+                    ? pthread_cond_wait(&not_full_, &lock_)
+                    : pthread_cond_timedwait(&not_full_, &lock_, &deadline);
+      if (ret != 0) {
+        break;
+      }
+    }
+    --producers_waiting_;
+    return size_ < max_size_;
+  }
+
   T* array_;
   int max_size_; // 阻塞队列中可以容纳的最大的任务的数量
   int size_; // 当前阻塞队列中任务的数量
   int front_; // 队头
   int back_; // 队尾
+  int consumers_waiting_; // 在 not_empty_ 上等待的消费者数量
+  int producers_waiting_; // 在 not_full_ 上等待的生产者数量
 
 
   pthread_mutex_t lock_; // 锁
-  pthread_cond_t cond_; // 条件变量
-};
\ No newline at end of file
+  pthread_cond_t not_empty_; // 队列非空，唤醒消费者
+  pthread_cond_t not_full_; // 队列未满，唤醒生产者
+};
+
+#endif
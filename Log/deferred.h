@@ -0,0 +1,150 @@
+/*
+延迟格式化日志的记录格式和参数编码
+调用线程只记录格式串指针、时间戳和参数的原始字节，格式化由写日志线程完成
+每个参数的编码方式在编译期由参数类型决定（LogArgTraits），运行时只有 memcpy
+*/
+
+#ifndef LOG_DEFERRED_H
+#define LOG_DEFERRED_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <type_traits>
+
+// 线程批次中的记录种类
+enum LogRecordKind {
+  kLogRecordText = 0, // 已经格式化好的若干行文本
+  kLogRecordDeferred = 1, // 延迟格式化的单行日志
+};
+
+// 线程批次中每条记录的头部，后面紧跟 len 字节的内容
+struct LogRecordHead {
+  uint32_t len; // 内容的字节数
+  uint32_t kind; // LogRecordKind
+};
+
+// 延迟格式化记录的内容头部，后面紧跟各个参数的编码
+struct LogDeferredHead {
+  const char* format; // 格式串，必须是静态存储期的字符串
+  const uint8_t* tags; // 各个参数的类型标签，编译期生成的静态数组
+  int64_t sec; // 时间戳 秒
+  int32_t nsec; // 时间戳 纳秒
+  int16_t level; // 日志级别
+  uint16_t nargs; // 参数个数
+};
+
+// 参数的类型标签，决定了参数如何编码和解码
+enum LogArgTag {
+  kLogArgInt = 1, // int32_t
+  kLogArgUInt, // uint32_t
+  kLogArgLong, // int64_t
+  kLogArgULong, // uint64_t
+  kLogArgDouble, // double
+  kLogArgString, // uint32_t 长度 + 字符串内容（不含 '\0'）
+  kLogArgPointer, // const void*
+};
+
+// 按参数类型选择编码方式，不支持的类型在编译期报错
+template <typename T, typename Enable = void>
+struct LogArgTraits;
+
+// 整数和枚举：按大小和符号分成四类，与 printf 的默认参数提升一致
+template <typename T>
+struct LogArgTraits<T, typename std::enable_if<std::is_integral<T>::value ||
+                                               std::is_enum<T>::value>::type> {
+  static const bool kWide = sizeof(T) > 4;
+  static const bool kSigned = std::is_signed<T>::value ||
+                              (std::is_enum<T>::value) || sizeof(T) < 4;
+  static const uint8_t kTag = kWide ? (kSigned ? kLogArgLong : kLogArgULong)
+                                    : (kSigned ? kLogArgInt : kLogArgUInt);
+  static size_t Size(T) { return kWide ? 8 : 4; }
+  static char* Encode(char* p, T v) {
+    if (kWide) {
+      uint64_t u = (uint64_t)v;
+      memcpy(p, &u, 8);
+      return p + 8;
+    }
+    uint32_t u = (uint32_t)v;
+    memcpy(p, &u, 4);
+    return p + 4;
+  }
+};
+
+// 浮点数：float 按 printf 的规则提升为 double
+template <typename T>
+struct LogArgTraits<T, typename std::enable_if<
+                           std::is_floating_point<T>::value>::type> {
+  static const uint8_t kTag = kLogArgDouble;
+  static size_t Size(T) { return sizeof(double); }
+  static char* Encode(char* p, T v) {
+    double d = (double)v;
+    memcpy(p, &d, sizeof(d));
+    return p + sizeof(d);
+  }
+};
+
+// 字符串：调用时就要拷贝内容，因为写日志线程格式化时原来的内存可能已经失效
+template <>
+struct LogArgTraits<const char*> {
+  static const uint8_t kTag = kLogArgString;
+  static size_t Size(const char* v) {
+    return sizeof(uint32_t) + (v == NULL ? 6 : strlen(v));
+  }
+  static char* Encode(char* p, const char* v) {
+    if (v == NULL) {
+      v = "(null)";
+    }
+    uint32_t len = strlen(v);
+    memcpy(p, &len, sizeof(len));
+    memcpy(p + sizeof(len), v, len);
+    return p + sizeof(len) + len;
+  }
+};
+
+template <>
+struct LogArgTraits<char*> : LogArgTraits<const char*> {};
+
+// 其它指针只记录地址，对应 %p
+template <typename T>
+struct LogArgTraits<T*> {
+  static const uint8_t kTag = kLogArgPointer;
+  static size_t Size(const T*) { return sizeof(const void*); }
+  static char* Encode(char* p, const T* v) {
+    const void* ptr = v;
+    memcpy(p, &ptr, sizeof(ptr));
+    return p + sizeof(ptr);
+  }
+};
+
+// 数组（例如字符数组）按指针处理
+template <typename T>
+struct LogArgTraitsOf : LogArgTraits<typename std::decay<T>::type> {};
+
+// 所有参数编码后的总字节数
+inline size_t LogArgsSize() { return 0; }
+
+template <typename T, typename... Rest>
+inline size_t LogArgsSize(const T& v, const Rest&... rest) {
+  return LogArgTraitsOf<T>::Size(v) + LogArgsSize(rest...);
+}
+
+// 依次编码所有参数，返回编码结束的位置
+inline char* LogEncodeArgs(char* p) { return p; }
+
+template <typename T, typename... Rest>
+inline char* LogEncodeArgs(char* p, const T& v, const Rest&... rest) {
+  return LogEncodeArgs(LogArgTraitsOf<T>::Encode(p, v), rest...);
+}
+
+// 每组参数类型对应一个静态的标签数组，记录中只保存它的地址
+template <typename... Args>
+struct LogArgTags {
+  static const uint8_t kTags[sizeof...(Args) + 1];
+};
+
+template <typename... Args>
+const uint8_t LogArgTags<Args...>::kTags[sizeof...(Args) + 1] = {
+    LogArgTraitsOf<Args>::kTag..., 0};
+
+#endif
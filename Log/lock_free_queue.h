@@ -0,0 +1,314 @@
+/*
+无锁有界多生产者/多消费者队列，与 BlockQueue 的 Push/Pop/isFull/isEmpty 接口相同
+数组的每个格子带一个序号 seq（Vyukov 的有界 MPMC 队列）：
+  seq == pos      格子空闲，第 pos 次写入的生产者可以占用
+  seq == pos + 1  格子已写好，第 pos 次读取的消费者可以取走
+生产者和消费者各自通过 CAS 推进 enqueue_pos_ / dequeue_pos_，两者分别独占一个缓存行。
+Pop 在队列为空（带超时的 Push 在队列满）时怎么等待由模板参数 WaitStrategy 决定：
+  BusySpinWait   一直自旋，延迟最低，占满一个核
+  SpinYieldWait  先自旋，之后每次检查前 sched_yield
+  SpinFutexWait  先自旋，之后在 futex 上睡眠，由另一方唤醒
+*/
+
+#ifndef LOCK_FREE_QUEUE_H
+#define LOCK_FREE_QUEUE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+#include <utility>
+
+// 自旋等待时提示 CPU 降低功耗、让出流水线给同一物理核上的另一个超线程
+inline void LockFreeCpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield" ::: "memory");
+#endif
+}
+
+// CLOCK_MONOTONIC 的纳秒数，用于计算等待的截止时间
+inline long long LockFreeNowNs() {
+  struct timespec ts = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 一直自旋，适合生产者和消费者各自独占一个核的低延迟流水线
+struct BusySpinWait {
+  /// @brief 等待 ready() 返回 true
+  /// @param deadline_ns 截止时间（LockFreeNowNs），-1 表示一直等待
+  /// @return ready() 返回 true 时返回 true，超时返回 false
+  template<typename Ready>
+  bool Wait(Ready ready, long long deadline_ns) {
+    for (unsigned i = 1;; ++i) {
+      if (ready()) {
+        return true;
+      }
+      // 每自旋一段时间才看一次时钟
+      if (deadline_ns >= 0 && i % kClockInterval == 0 &&
+          LockFreeNowNs() >= deadline_ns) {
+        return ready();
+      }
+      LockFreeCpuRelax();
+    }
+  }
+
+  // 另一方的状态发生了变化，自旋等待不需要通知
+  void Notify() {}
+
+  static const unsigned kClockInterval = 256;
+};
+
+// 先自旋 kSpins 次，之后每次检查前让出 CPU
+struct SpinYieldWait {
+  template<typename Ready>
+  bool Wait(Ready ready, long long deadline_ns) {
+    for (unsigned i = 1;; ++i) {
+      if (ready()) {
+        return true;
+      }
+      if (i <= kSpins) {
+        LockFreeCpuRelax();
+        continue;
+      }
+      if (deadline_ns >= 0 && LockFreeNowNs() >= deadline_ns) {
+        return ready();
+      }
+      sched_yield();
+    }
+  }
+
+  void Notify() {}
+
+  static const unsigned kSpins = 128;
+};
+
+// 先自旋 kSpins 次，之后在 epoch_ 上 futex 睡眠
+// 通知方只有在确实有线程睡眠时才进入内核，平时只多一次原子读
+class SpinFutexWait {
+ public:
+  SpinFutexWait() : epoch_(0), waiters_(0) {}
+
+  template<typename Ready>
+  bool Wait(Ready ready, long long deadline_ns) {
+    for (unsigned i = 0; i < kSpins; ++i) {
+      if (ready()) {
+        return true;
+      }
+      LockFreeCpuRelax();
+    }
+
+    for (;;) {
+      // 先登记为等待者并记下 epoch_，再检查一次条件：
+      // 通知方要么看到等待者并推进 epoch_（futex 立即返回），要么在此之前
+      // 已经改变了状态（这里的检查能看到）
+      waiters_.fetch_add(1, std::memory_order_seq_cst);
+      uint32_t epoch = epoch_.load(std::memory_order_seq_cst);
+      if (ready()) {
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+      }
+
+      struct timespec rel = {0, 0};
+      struct timespec* timeout = NULL;
+      if (deadline_ns >= 0) {
+        long long left = deadline_ns - LockFreeNowNs();
+        if (left <= 0) {
+          waiters_.fetch_sub(1, std::memory_order_relaxed);
+          return ready();
+        }
+        rel.tv_sec = left / 1000000000;
+        rel.tv_nsec = left % 1000000000;
+        timeout = &rel;
+      }
+      syscall(SYS_futex, (uint32_t*)&epoch_, FUTEX_WAIT_PRIVATE, epoch,
+              timeout, NULL, 0);
+      waiters_.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+
+  void Notify() {
+    // 与 Wait 中的 "登记等待者 -> 检查条件" 配对，保证不会丢失唤醒
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters_.load(std::memory_order_relaxed) > 0) {
+      epoch_.fetch_add(1, std::memory_order_seq_cst);
+      syscall(SYS_futex, (uint32_t*)&epoch_, FUTEX_WAKE_PRIVATE, 1, NULL,
+              NULL, 0);
+    }
+  }
+
+  static const unsigned kSpins = 256;
+
+ private:
+  std::atomic<uint32_t> epoch_; // 每次有线程需要唤醒时加一，futex 的等待字
+  std::atomic<int> waiters_; // 正在（或即将）睡眠的线程数量
+};
+
+template<typename T, typename WaitStrategy = SpinFutexWait>
+class LockFreeQueue {
+ public:
+  /// @brief 构造函数，预先分配所有格子
+  /// @param max_size 队列容量，向上取整为 2 的幂
+  LockFreeQueue(int max_size = 1000) {
+    if (max_size <= 0) {
+      exit(-1);
+    }
+
+    // 容量取 2 的幂，下标计算用 & mask_ 代替 %
+    capacity_ = 1;
+    while (capacity_ < (size_t)max_size) {
+      capacity_ <<= 1;
+    }
+    mask_ = capacity_ - 1;
+    cells_ = new Cell[capacity_];
+    for (size_t i = 0; i < capacity_; ++i) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+    enqueue_pos_.store(0, std::memory_order_relaxed);
+    dequeue_pos_.store(0, std::memory_order_relaxed);
+  }
+
+  ~LockFreeQueue() {
+    delete[] cells_;
+  }
+
+  LockFreeQueue(const LockFreeQueue& other) = delete;
+  LockFreeQueue& operator=(const LockFreeQueue& other) = delete;
+
+  // 生产者添加一个任务，队列满时直接返回 false
+  bool Push(const T& item) {
+    return TryPush(item);
+  }
+
+  // 移动版本，item 只有在成功放入时才被移走
+  bool Push(T&& item) {
+    return TryPush(std::move(item));
+  }
+
+  /// @brief 添加一个任务，队列满时按等待策略最多等待 ms_timeout 毫秒
+  /// @return 成功返回 true，超时返回 false
+  bool Push(const T& item, int ms_timeout) {
+    return not_full_.Wait([&] { return TryPush(item); },
+                          Deadline(ms_timeout));
+  }
+
+  bool Push(T&& item, int ms_timeout) {
+    return not_full_.Wait([&] { return TryPush(std::move(item)); },
+                          Deadline(ms_timeout));
+  }
+
+  // 消费者消费一个任务，没有任务时按等待策略一直等待
+  bool Pop(T& item) {
+    return not_empty_.Wait([&] { return TryPop(item); }, -1);
+  }
+
+  /// @brief 取出一个任务，如果没有任务可取则等待 ms_timeout 时间。
+  /// @return 成功返回 true
+  bool Pop(T& item, int ms_timeout) {
+    return not_empty_.Wait([&] { return TryPop(item); },
+                           Deadline(ms_timeout));
+  }
+
+  /// @brief 不等待地放入一个任务
+  template<typename U>
+  bool TryPush(U&& item) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell* cell = &cells_[pos & mask_];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        // 格子空闲，尝试占用
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          cell->data = std::forward<U>(item);
+          cell->seq.store(pos + 1, std::memory_order_release);
+          not_empty_.Notify();
+          return true;
+        }
+      } else if (diff < 0) {
+        // 格子还没被消费者取走，队列已满
+        return false;
+      } else {
+        // 被其他生产者抢先了，重新读取写位置
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /// @brief 不等待地取出一个任务
+  bool TryPop(T& item) {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell* cell = &cells_[pos & mask_];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          item = std::move(cell->data);
+          // 格子在第 pos + capacity_ 次写入时再次可用
+          cell->seq.store(pos + capacity_, std::memory_order_release);
+          not_full_.Notify();
+          return true;
+        }
+      } else if (diff < 0) {
+        // 格子还没写好，队列为空
+        return false;
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // 一些常用接口，结果只是一个瞬时值
+
+  bool isFull() const {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    return cells_[pos & mask_].seq.load(std::memory_order_acquire) != pos;
+  }
+
+  bool isEmpty() const {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    return cells_[pos & mask_].seq.load(std::memory_order_acquire) != pos + 1;
+  }
+
+  int capacity() const { return (int)capacity_; }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> seq; // 格子序号
+    T data;
+  };
+
+  static long long Deadline(int ms_timeout) {
+    return ms_timeout < 0 ? -1
+                          : LockFreeNowNs() + (long long)ms_timeout * 1000000;
+  }
+
+  static const size_t kCacheLine = 64;
+
+  // 写位置和读位置分别独占一个缓存行，生产者和消费者互不干扰
+  // 用填充而不是 alignas，new 出来的队列不依赖 C++17 的对齐 operator new
+  char pad0_[kCacheLine];
+  Cell* cells_;
+  size_t capacity_; // 格子数量，2 的幂
+  size_t mask_; // capacity_ - 1
+  char pad1_[kCacheLine];
+  std::atomic<size_t> enqueue_pos_;
+  char pad2_[kCacheLine - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> dequeue_pos_;
+  char pad3_[kCacheLine - sizeof(std::atomic<size_t>)];
+  WaitStrategy not_empty_; // 消费者在这里等待任务
+  char pad4_[kCacheLine];
+  WaitStrategy not_full_; // 带超时的 Push 在这里等待空位
+  char pad5_[kCacheLine];
+};
+
+#endif
@@ -1,36 +1,96 @@
 #include "log.h"
+#include <ctype.h>
+#include <dirent.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
 Log::Log() {
-  count_ = 0;
+  shards_ = NULL;
+  shard_count_ = 0;
   is_async_ = false; // 默认为同步写日志
+  is_stop_.store(false, std::memory_order_relaxed);
+  dropped_lines_.store(0, std::memory_order_relaxed);
+  blocked_lines_.store(0, std::memory_order_relaxed);
+  high_watermark_slots_ = 0;
+  kv_format_ = kLogKVLogfmt;
+  flush_started_ = false;
+  flush_stop_ = false;
+  pthread_mutex_init(&flush_lock_, NULL);
+  pthread_cond_init(&flush_cond_, NULL);
+  pthread_mutex_init(&buffers_lock_, NULL);
+  level_.store(0, std::memory_order_relaxed);
+  sites_ = NULL;
+  pthread_mutex_init(&sites_lock_, NULL);
+  pthread_key_create(&buffer_key_, ReleaseThreadBuffer);
 }
 
-Log::Log() {
-  if (fp_ != NULL) {
-    fclose(fp_);
+Log::~Log() {
+  // 先停止后台刷新线程，之后由这里负责交出剩余的日志
+  if (flush_started_) {
+    pthread_mutex_lock(&flush_lock_);
+    flush_stop_ = true;
+    pthread_cond_signal(&flush_cond_);
+    pthread_mutex_unlock(&flush_lock_);
+    pthread_join(flush_tid_, NULL);
   }
-}
 
-bool Log::Init(const char* file_name, int log_buf_size,
-               int close_log, int split_line, int max_queue_size) {
-  // 如果设置了 max_queue_size, 则为异步写日志
-  if (max_queue_size >= 1) {
-    // 创建写日志线程
-    is_async_ = true;
-    log_queue_ = new BlockQueue<string>(max_queue_size);
-    pthread_t tid;
-    pthread_create(&tid, NULL, threadFlushLog, NULL);
-    pthread_detach(tid); // 当线程结束后自动释放线程资源，不需要主线程手动回收
+  // 仍然存活的线程（例如主线程）的暂存区不会走 pthread_key 的回调，在这里交出
+  pthread_mutex_lock(&buffers_lock_);
+  for (auto tb : thread_buffers_) {
+    pthread_mutex_lock(&tb->lock);
+    HandOff(tb);
+    pthread_mutex_unlock(&tb->lock);
   }
+  pthread_mutex_unlock(&buffers_lock_);
 
+  // 通知各分片的写日志线程把环形缓冲区中剩余的日志写完再退出
+  is_stop_.store(true, std::memory_order_release);
+  for (int i = 0; i < shard_count_; ++i) {
+    LogShard* shard = &shards_[i];
+    if (shard->queue != NULL) {
+      // 写日志线程可能正在空队列上等待，不必等到超时
+      shard->queue->WakeConsumer();
+      pthread_join(shard->write_tid, NULL);
+      delete shard->queue;
+    }
+    // 截断到实际写入的大小并关闭日志文件
+    shard->file.Close();
+    delete[] shard->deferred_buf;
+    pthread_mutex_destroy(&shard->lock);
+  }
+  delete[] shards_;
+  // 最后停止压缩器，还没压缩完的文件保留原样
+  compressor_.Stop();
+
+  pthread_key_delete(buffer_key_);
+  for (auto tb : thread_buffers_) {
+    pthread_mutex_destroy(&tb->lock);
+    delete[] tb->line;
+    delete[] tb->batch;
+    delete tb;
+  }
+  pthread_mutex_destroy(&buffers_lock_);
+  pthread_mutex_destroy(&sites_lock_);
+  pthread_mutex_destroy(&flush_lock_);
+  pthread_cond_destroy(&flush_cond_);
+}
+
+bool Log::Init(const char* file_name, int close_log, int log_buf_size,
+               int split_line, int max_queue_size,
+               const LogFlushPolicy& flush_policy,
+               const LogQueuePolicy& queue_policy,
+               const LogCompressPolicy& compress_policy, int shards) {
   // 给相关参数赋值
   log_buf_size_ = log_buf_size;
   split_lines_ = split_line;
   close_log_ = close_log;
-  buf_ = new char[log_buf_size_];
-  memset(buf_, '\0', log_buf_size_);
+  flush_policy_ = flush_policy;
+  queue_policy_ = queue_policy;
+  // 如果设置了 max_queue_size, 则为异步写日志
+  is_async_ = max_queue_size >= 1;
+  shard_count_ = shards < 1 ? 1 : shards;
 
   // 创建一个时间结构体，用户获取时间
   time_t t = time(NULL);
@@ -41,133 +101,914 @@ bool Log::Init(const char* file_name, int log_buf_size,
   // 开始创建日志文件，日志文件名格式：YYYY_MM_DD_filename 的形式
   // 分离出日志文件名 找到 file_name 中最后一个 / 所在的位置右侧即是日志名
   const char* p = strrchr(file_name, '/');
-  char log_full_name[256] = {0}; // 存储日志文件名称
   if (p == NULL) { // 在file_name中没有 '/',file_name 只是一个简单的文件名而包含路径
     // 那就在当前目录中创建日志文件即log_buff_name中不需要写入路径信息
-    // tm_mdy 表示当前是一个月中的某一天
-    // tm_wday 表示当前是这一周的某一天
-    // tm_yday 表示当前是一年中的某一天
-    snprintf(log_full_name, 255, "%d_%02d_%02d_%s", my_tm.tm_year + 1900, 
-            my_tm.tm_mon + 1, my_tm.tm_mday, file_name);
+    dir_name_[0] = '\0';
+    strcpy(log_name_, file_name); // 日志名
   } else {
     // 如果 file_name 中包含路径，先将路径分离出来
     strncpy(dir_name_, file_name, p - file_name + 1); // 路径名
+    dir_name_[p - file_name + 1] = '\0';
     strcpy(log_name_, p + 1); // 日志名
-    // 完整的文件名 路径+创建时间+日志名
-    snprintf(log_full_name, 255, "%s%d_%02d_%02d_%s", my_tm.tm_year + 1900, 
-            my_tm.tm_mon + 1, my_tm.tm_mday, file_name, log_name_); 
+  }
+  // tm_mdy 表示当前是一个月中的某一天
+  // 按每个 int 字段最长 11 个字符留出空间，避免格式化结果被截断
+  char date[40] = {0};
+  snprintf(date, sizeof(date), "%d_%02d_%02d_", my_tm.tm_year + 1900,
+           my_tm.tm_mon + 1, my_tm.tm_mday);
+
+  // 压缩器要在日志段的后台线程启动之前设置好
+  bool compress = compress_policy.enabled &&
+      compressor_.Start(compress_policy.level, compress_policy.bytes_per_sec);
+
+  // 每个分片以追加的形式打开自己的日志文件，如果没有则创建文件
+  // 同时启动后台线程预先创建下一个日志段
+  shards_ = new LogShard[shard_count_];
+  for (int i = 0; i < shard_count_; ++i) {
+    LogShard* shard = &shards_[i];
+    shard->index = i;
+    shard->queue = NULL;
+    shard->deferred_buf = new char[log_buf_size_];
+    shard->count = 0;
+    // 记录当前是哪一天
+    shard->today = my_tm.tm_mday + 1;
+    shard->sync_requested.store(false, std::memory_order_relaxed);
+    pthread_mutex_init(&shard->lock, NULL);
+  }
+  for (int i = 0; i < shard_count_; ++i) {
+    LogShard* shard = &shards_[i];
+    char log_full_name[256] = {0}; // 存储日志文件名称
+    ShardFileName(shard, date, 0, log_full_name, sizeof(log_full_name));
+    if (compress) {
+      shard->file.SetCompressor(&compressor_);
+    }
+    if (!shard->file.Open(log_full_name)) {
+      return false;
+    }
+  }
+  if (compress) {
+    SubmitLeftoverSegments();
   }
 
-  // 记录当前是哪一天
-  toady_ = my_tm.tm_mday + 1;
+  // 日志文件都打开之后再创建各分片的写日志线程
+  if (is_async_) {
+    for (int i = 0; i < shard_count_; ++i) {
+      LogShard* shard = &shards_[i];
+      // 每个槽位能放下一个线程的整个批次
+      shard->queue = new LogRingBuffer(max_queue_size, BatchCapacity());
+      high_watermark_slots_ =
+          shard->queue->capacity() * queue_policy_.high_watermark / 100;
+      // 析构时需要等它把队列取空，所以不分离
+      pthread_create(&shard->write_tid, NULL, threadFlushLog, shard);
+    }
+  }
 
-  // 以追加的形式打开日志文件，如果没有则创建文件
-  fp_ = fopen(log_full_name, "a");
-  // 创建失败
-  if (fp_ == NULL) {
-    return false;
+  // 有定时刷新或定时 fsync 时才需要后台刷新线程
+  if (flush_policy_.interval_ms > 0 || flush_policy_.fsync_interval_ms > 0) {
+    if (pthread_create(&flush_tid_, NULL, threadFlusher, NULL) == 0) {
+      flush_started_ = true;
+    }
   }
 
   return true;
 }
 
-// 写日志
-void Log::WriteLog(int level, const char* format, ...) {
-  struct timeval now = {0, 0};
-  gettimeofday(&now, NULL);
-  // 获取当前时间对应的秒数
-  time_t t = now.tv_sec;
-  // 将时间戳转换为本地时间
-  struct tm* sys_tm = localtime(&t);
-  struct tm my_tm = *sys_tm;
-  char type[16] = {0};
+// 日志级别对应的标签
+static const char* LevelTag(int level) {
+  const char* type = NULL;
   switch(level) {
     case 0 : {
-      strcpy(type, "[debug]:");
+      type = "[debug]:";
       break;
     }
     case 1 : {
-      strcpy(type, "[info]:");
+      type = "[info]:";
       break;
     }
     case 2 : {
-      strcpy(type, "[warn]:");
+      type = "[warn]:";
       break;
     }
     case 3 : {
-      strcpy(type, "[erro]:");
+      type = "[erro]:";
       break;
     }
     default: {
-      strcpy(type, "[info]:");
+      type = "[info]:";
     }
   }
+  return type;
+}
+
+// 写日志
+void Log::WriteLog(int level, const char* format, ...) {
+  // 只取一次时间，秒以上的部分直接拷贝缓存好的前缀，同一秒内不再调用 localtime
+  struct timespec now = {0, 0};
+  LogTimeCache::Now(&now);
+  const char* type = LevelTag(level);
+
+  // 格式化和暂存都在本线程的暂存区中完成，只有交出批次时才会触碰共享状态
+  LogThreadBuffer* tb = GetThreadBuffer();
+  // 被背压策略丢弃的行连格式化都不需要
+  if (!Admit(tb, level)) {
+    return;
+  }
+
+  // 声明可以接收可变数量参数的类型 va_lst;
+  va_list va_lst;
+  // 初始化 va_list 对象，第二参数为最后一个非可变参数类型的参数名
+  va_start(va_lst, format);
+
+  // 暂存区的锁只有写日志线程回收陈旧批次时才会竞争，平时几乎没有开销
+  pthread_mutex_lock(&tb->lock);
+  int len = FormatLine(tb->line, log_buf_size_, now, type, format, va_lst);
+  AppendText(tb, tb->line, len);
+  ++tb->batch_lines;
+  ApplyFlushPolicy(tb, level);
+  pthread_mutex_unlock(&tb->lock);
+
+  // 清除 va_list 对象
+  va_end(va_lst);
+}
+
+LogThreadBuffer* Log::GetThreadBuffer() {
+  LogThreadBuffer* tb = (LogThreadBuffer*)pthread_getspecific(buffer_key_);
+  if (tb != NULL) {
+    return tb;
+  }
+
+  // 本线程第一次写日志，创建暂存区并登记，以便写日志线程和析构函数能找到它
+  tb = new LogThreadBuffer;
+  tb->line = new char[log_buf_size_];
+  tb->batch_cap = BatchCapacity();
+  tb->batch = new char[tb->batch_cap];
+  tb->batch_len = 0;
+  tb->text_head = -1;
+  tb->batch_lines = 0;
+  tb->sample_count = 0;
+  // 按线程 id 映射到分片，同一个线程的日志总在同一个文件中，保持先后顺序
+  tb->shard = &shards_[(unsigned long)syscall(SYS_gettid) % shard_count_];
+  pthread_mutex_init(&tb->lock, NULL);
+
+  pthread_mutex_lock(&buffers_lock_);
+  thread_buffers_.push_back(tb);
+  pthread_mutex_unlock(&buffers_lock_);
+  pthread_setspecific(buffer_key_, tb);
+  return tb;
+}
+
+void Log::ReleaseThreadBuffer(void* arg) {
+  LogThreadBuffer* tb = (LogThreadBuffer*)arg;
+  Log* log = Log::GetInstance();
+
+  // 交出剩余的日志
+  pthread_mutex_lock(&tb->lock);
+  log->HandOff(tb);
+  pthread_mutex_unlock(&tb->lock);
+
+  pthread_mutex_lock(&log->buffers_lock_);
+  log->thread_buffers_.remove(tb);
+  pthread_mutex_unlock(&log->buffers_lock_);
+
+  pthread_mutex_destroy(&tb->lock);
+  delete[] tb->line;
+  delete[] tb->batch;
+  delete tb;
+}
+
+void Log::HandOff(LogThreadBuffer* tb) {
+  if (tb->batch_len == 0) {
+    return;
+  }
 
-  // 每写入一条 log， 对 m_count++
-  pthread_mutex_lock(&lock_);
-  count_++;
+  LogShard* shard = tb->shard;
+  if (is_async_) {
+    // 异步模式：整批拷贝进一个槽位，由写日志线程写入文件
+    // 队列满时不再退回到同步写文件，而是按背压策略等待或丢弃
+    uint64_t ticket = 0;
+    char* slot = shard->queue->Reserve(&ticket);
+    if (slot == NULL) {
+      slot = ReserveOnFull(tb, &ticket);
+    }
+    if (slot != NULL) {
+      memcpy(slot, tb->batch, tb->batch_len);
+      shard->queue->Commit(ticket, tb->batch_len);
+    } else {
+      dropped_lines_.fetch_add(tb->batch_lines, std::memory_order_relaxed);
+    }
+  } else {
+    // 同步模式，在分片的锁内直接写入文件
+    pthread_mutex_lock(&shard->lock);
+    WriteBatch(shard, tb->batch, tb->batch_len);
+    SyncIfRequested(shard);
+    pthread_mutex_unlock(&shard->lock);
+  }
+  tb->batch_len = 0;
+  tb->batch_lines = 0;
+  tb->text_head = -1;
+}
+
+void Log::TryHandOff(LogThreadBuffer* tb) {
+  if (!is_async_ || tb->batch_len == 0) {
+    HandOff(tb);
+    return;
+  }
+
+  uint64_t ticket = 0;
+  char* slot = tb->shard->queue->Reserve(&ticket);
+  if (slot == NULL) {
+    return;
+  }
+  memcpy(slot, tb->batch, tb->batch_len);
+  tb->shard->queue->Commit(ticket, tb->batch_len);
+  tb->batch_len = 0;
+  tb->batch_lines = 0;
+  tb->text_head = -1;
+}
+
+bool Log::Admit(LogThreadBuffer* tb, int level) {
+  // 只有异步队列超过高水位时才需要判断，平时只是一次比较
+  if (!is_async_ || tb->shard->queue->Size() < high_watermark_slots_) {
+    return true;
+  }
+
+  bool admit = true;
+  if (queue_policy_.overflow == kLogDropLowLevel) {
+    // DEBUG 和 INFO 先被丢弃，把剩余的空间留给 WARN 和 ERROR
+    admit = level >= 2;
+  } else if (queue_policy_.overflow == kLogSample && level < 3) {
+    admit = queue_policy_.sample_rate <= 1 ||
+            tb->sample_count++ % queue_policy_.sample_rate == 0;
+  }
+  if (!admit) {
+    dropped_lines_.fetch_add(1, std::memory_order_relaxed);
+  }
+  return admit;
+}
+
+char* Log::ReserveOnFull(LogThreadBuffer* tb, uint64_t* ticket) {
+  if (queue_policy_.overflow == kLogDropNewest ||
+      queue_policy_.overflow == kLogSample) {
+    return NULL;
+  }
+
+  // 阻塞等待写日志线程释放槽位，超过 block_timeout_ms 仍然没有空位则丢弃
+  blocked_lines_.fetch_add(tb->batch_lines, std::memory_order_relaxed);
+  struct timespec deadline =
+      LogRingBuffer::Deadline(queue_policy_.block_timeout_ms);
+  for (;;) {
+    char* slot = tb->shard->queue->Reserve(ticket);
+    if (slot != NULL) {
+      return slot;
+    }
+    struct timeval now = {0, 0};
+    gettimeofday(&now, NULL);
+    if (now.tv_sec > deadline.tv_sec ||
+        (now.tv_sec == deadline.tv_sec &&
+         now.tv_usec * 1000 >= deadline.tv_nsec)) {
+      return NULL;
+    }
+    tb->shard->queue->WaitWritable(deadline);
+  }
+}
+
+LogStats Log::GetStats() const {
+  LogStats stats;
+  stats.dropped_lines = dropped_lines_.load(std::memory_order_relaxed);
+  stats.blocked_lines = blocked_lines_.load(std::memory_order_relaxed);
+  stats.compress = compressor_.GetStats();
+  return stats;
+}
+
+void Log::SetLevel(int level) {
+  pthread_mutex_lock(&sites_lock_);
+  level_.store(level, std::memory_order_relaxed);
+  RefreshCallSites();
+  pthread_mutex_unlock(&sites_lock_);
+}
+
+void Log::SetCallSiteEnabled(const char* file, int line, bool enabled) {
+  LogSiteOverride o;
+  snprintf(o.file, sizeof(o.file), "%s", file);
+  o.line = line;
+  o.enabled = enabled;
+
+  pthread_mutex_lock(&sites_lock_);
+  site_overrides_.push_back(o);
+  RefreshCallSites();
+  pthread_mutex_unlock(&sites_lock_);
+}
+
+void Log::ClearCallSiteOverrides() {
+  pthread_mutex_lock(&sites_lock_);
+  site_overrides_.clear();
+  RefreshCallSites();
+  pthread_mutex_unlock(&sites_lock_);
+}
+
+bool Log::RegisterCallSite(LogCallSite* site) {
+  pthread_mutex_lock(&sites_lock_);
+  // 多个线程可能同时第一次执行同一条语句，只登记一次
+  if (site->state_.load(std::memory_order_relaxed) == LogCallSite::kUnknown) {
+    site->next_ = sites_;
+    sites_ = site;
+    site->state_.store(CallSiteEnabled(site) ? LogCallSite::kOn
+                                             : LogCallSite::kOff,
+                       std::memory_order_relaxed);
+  }
+  bool enabled =
+      site->state_.load(std::memory_order_relaxed) == LogCallSite::kOn;
+  pthread_mutex_unlock(&sites_lock_);
+  return enabled;
+}
+
+bool Log::CallSiteEnabled(const LogCallSite* site) const {
+  bool enabled = site->level() >= level_.load(std::memory_order_relaxed);
+  // 后设置的优先，行号匹配的设置和整个文件的设置按先后顺序覆盖
+  size_t file_len = strlen(site->file());
+  for (const LogSiteOverride& o : site_overrides_) {
+    size_t len = strlen(o.file);
+    if (len > file_len || strcmp(site->file() + file_len - len, o.file) != 0) {
+      continue;
+    }
+    // 只匹配完整的文件名，"conn.cpp" 不应该匹配 "http_conn.cpp"
+    if (len < file_len && site->file()[file_len - len - 1] != '/') {
+      continue;
+    }
+    if (o.line == 0 || o.line == site->line()) {
+      enabled = o.enabled;
+    }
+  }
+  return enabled;
+}
+
+void Log::RefreshCallSites() {
+  for (LogCallSite* site = sites_; site != NULL; site = site->next_) {
+    site->state_.store(CallSiteEnabled(site) ? LogCallSite::kOn
+                                             : LogCallSite::kOff,
+                       std::memory_order_relaxed);
+  }
+}
+
+void Log::AppendText(LogThreadBuffer* tb, const char* line, int len) {
+  // 紧跟在一条文本记录后面时直接续写，不需要新的记录头
+  if (tb->text_head >= 0 && tb->batch_len + len <= tb->batch_cap) {
+    LogRecordHead head;
+    memcpy(&head, tb->batch + tb->text_head, sizeof(head));
+    head.len += len;
+    memcpy(tb->batch + tb->text_head, &head, sizeof(head));
+    memcpy(tb->batch + tb->batch_len, line, len);
+    tb->batch_len += len;
+    return;
+  }
+
+  char* p = AppendRecord(tb, kLogRecordText, len);
+  memcpy(p, line, len);
+  // AppendRecord 可能交出过批次，记录头的位置要重新计算
+  tb->text_head = p - tb->batch - sizeof(LogRecordHead);
+}
+
+char* Log::AppendRecord(LogThreadBuffer* tb, LogRecordKind kind, int size) {
+  // 本地批次放不下这条记录了，先把整个批次交出去
+  if (tb->batch_len + (int)sizeof(LogRecordHead) + size > tb->batch_cap) {
+    HandOff(tb);
+  }
 
-  // 如果当前日期与记录日期不同或当个日志文件达到了设定的行数，需要重新床创建一个日志文件
-  if (toady_ != my_tm.tm_mday + 1 || count_ % split_lines_ == 0) {
+  LogRecordHead head;
+  head.len = size;
+  head.kind = kind;
+  memcpy(tb->batch + tb->batch_len, &head, sizeof(head));
+  char* p = tb->batch + tb->batch_len + sizeof(head);
+  tb->batch_len += sizeof(head) + size;
+  // 其它种类的记录会打断连续的文本行
+  tb->text_head = -1;
+  return p;
+}
+
+// 跳过 [.数字] 和 [~数字] 组成的后缀，返回后缀之后的位置
+static const char* SkipSegmentSuffix(const char* p) {
+  while ((*p == '.' || *p == '~') && isdigit((unsigned char)p[1])) {
+    ++p;
+    while (isdigit((unsigned char)*p)) {
+      ++p;
+    }
+  }
+  return p;
+}
+
+void Log::SubmitLeftoverSegments() {
+  DIR* dir = opendir(dir_name_[0] == '\0' ? "." : dir_name_);
+  if (dir == NULL) {
+    return;
+  }
+  size_t name_len = strlen(log_name_);
+  struct dirent* ent;
+  while ((ent = readdir(dir)) != NULL) {
+    // 文件名形如 日期 + 日志名 [+ .分片号] [+ .第几个文件] [+ ~N]
+    // .gz、.gz.tmp 以及其他程序的文件都不匹配
+    int year = 0, mon = 0, mday = 0, n = 0;
+    if (sscanf(ent->d_name, "%d_%d_%d_%n", &year, &mon, &mday, &n) != 3 ||
+        n == 0 || strncmp(ent->d_name + n, log_name_, name_len) != 0 ||
+        *SkipSegmentSuffix(ent->d_name + n + name_len) != '\0') {
+      continue;
+    }
+
+    char path[sizeof(dir_name_) + sizeof(ent->d_name)];
+    snprintf(path, sizeof(path), "%s%s", dir_name_, ent->d_name);
+    bool in_use = false;
+    for (int i = 0; i < shard_count_ && !in_use; ++i) {
+      in_use = strcmp(shards_[i].file.path(), path) == 0;
+    }
+    if (!in_use) {
+      compressor_.Submit(path);
+    }
+  }
+  closedir(dir);
+}
+
+void Log::ShardFileName(const LogShard* shard, const char* date,
+                        long long part, char* buf, int size) const {
+  int n = snprintf(buf, size, "%s%s%s", dir_name_, date, log_name_);
+  // 只有一个分片时文件名和不分片时一样
+  if (shard_count_ > 1 && n < size) {
+    n += snprintf(buf + n, size - n, ".%d", shard->index);
+  }
+  if (part > 0 && n < size) {
+    snprintf(buf + n, size - n, ".%lld", part);
+  }
+}
+
+void Log::WriteBatch(LogShard* shard, const char* data, int len) {
+  if (!shard->file.isOpen()) {
+    return;
+  }
+
+  // 统计这一批的行数，文本记录数换行符，每条延迟记录是一行
+  int lines = 0;
+  const char* end = data + len;
+  LogRecordHead head;
+  for (const char* rec = data; rec < end; rec += sizeof(head) + head.len) {
+    memcpy(&head, rec, sizeof(head));
+    if (head.kind == kLogRecordDeferred) {
+      ++lines;
+      continue;
+    }
+    const char* text_end = rec + sizeof(head) + head.len;
+    for (const char* p = rec + sizeof(head);
+         (p = (const char*)memchr(p, '\n', text_end - p)); ++p) {
+      ++lines;
+    }
+  }
+
+  // 日期变化的判断与日志行共用同一个时间前缀缓存
+  struct timespec now = {0, 0};
+  LogTimeCache::Now(&now);
+  char prefix[LOG_TIME_PREFIX_LEN];
+  int mday = time_cache_.Get(now.tv_sec, prefix);
+
+  // 如果当前日期与记录日期不同或这一批写完后超过了单个文件的行数，
+  // 需要重新创建一个日志文件，切换以批次为单位进行
+  if (shard->today != mday + 1 ||
+      (shard->count + lines) / split_lines_ != shard->count / split_lines_) {
     char new_log_name[256] = {0};
-    // 先把当前缓冲可能有的数据刷新到日志文件中
-    fflush(fp_);
-    // 关闭日志文件
-    fclose(fp_);
-
-    char data[16] = {0};
-    snprintf(data, 16, "%d_%02d_%02d_", my_tm.tm_year + 1900, my_tm.tm_mon + 1,
-             my_tm.tm_mday);    
+    char date[16] = {0};
+    LogTimeCache::FileDate(prefix, date);
     // 是新的一天的日志
-    if (toady_ != my_tm.tm_mday + 1) {
-      snprintf(new_log_name, 255, "%s%s%s", dir_name_, data, log_name_);
+    if (shard->today != mday + 1) {
+      ShardFileName(shard, date, 0, new_log_name, sizeof(new_log_name));
       // 记录新的一天
-      toady_ = my_tm.tm_mday + 1;
-      count_ = 0;
+      shard->today = mday + 1;
+      shard->count = 0;
     } else {
       // 如果不是新的一天则是：日志记录条数达到上限，则将其分文件存储
-      snprintf(new_log_name, 255, "%s%s%s.%lld", dir_name_, data, log_name_, 
-              count_ / split_lines_);
+      ShardFileName(shard, date, (shard->count + lines) / split_lines_,
+                    new_log_name, sizeof(new_log_name));
+    }
+    // 下一个日志段已经由后台线程准备好，这里只是交换指针，
+    // 旧日志段的截断和关闭都在后台完成
+    if (!shard->file.Rotate(new_log_name)) {
+      return;
     }
-    fp_ = fopen(new_log_name, "a");
   }
-  pthread_mutex_unlock(&lock_);
+  shard->count += lines;
 
-  // 声明可以接收可变数量参数的类型 va_lst;
-  va_list va_lst;
-  // 初始化 va_list 对象，第二参数为最后一个非可变参数类型的参数名
-  va_start(va_lst, format);
+  // 文本记录直接写入，延迟记录在这里完成格式化
+  for (const char* rec = data; rec < end; rec += sizeof(head) + head.len) {
+    memcpy(&head, rec, sizeof(head));
+    if (head.kind == kLogRecordDeferred) {
+      int n = FormatDeferred(rec + sizeof(head), head.len,
+                             shard->deferred_buf, log_buf_size_);
+      shard->file.Append(shard->deferred_buf, n);
+    } else {
+      shard->file.Append(rec + sizeof(head), head.len);
+    }
+  }
+}
 
-  string single_log_str;
+void Log::ApplyFlushPolicy(LogThreadBuffer* tb, int level) {
+  // 先登记 fsync 请求再交出，写入这一批的一方会顺带完成 fsync
+  if (level >= flush_policy_.fsync_level) {
+    tb->shard->sync_requested.store(true, std::memory_order_release);
+  }
+  if (level >= flush_policy_.immediate_level ||
+      (flush_policy_.bytes > 0 && tb->batch_len >= flush_policy_.bytes)) {
+    HandOff(tb);
+  }
+}
 
-  pthread_mutex_lock(&lock_);
+void Log::SyncIfRequested(LogShard* shard) {
+  if (shard->sync_requested.load(std::memory_order_acquire) &&
+      shard->sync_requested.exchange(false, std::memory_order_acq_rel)) {
+    shard->file.Sync();
+  }
+}
 
-  int n = snprintf(buf_, 48, "%d-%02d--%02d %02d:%02d:%02d.%06ld %s",
-                   my_tm.tm_yday + 1900, my_tm.tm_mon + 1, my_tm.tm_mday,
-                   my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec, now.tv_sec, type);
+void Log::CollectIdleBatches() {
+  pthread_mutex_lock(&buffers_lock_);
+  for (auto tb : thread_buffers_) {
+    // 线程正在写日志就跳过，它的批次很快会被自己交出
+    if (pthread_mutex_trylock(&tb->lock) != 0) {
+      continue;
+    }
+    // 持有 buffers_lock_ 时不能等待队列的空位，否则新线程登记和线程退出都被阻塞
+    TryHandOff(tb);
+    pthread_mutex_unlock(&tb->lock);
+  }
+  pthread_mutex_unlock(&buffers_lock_);
+}
+
+// 写入时间戳 "YYYY-MM-DD HH:MM:SS.uuuuuu"，只有微秒字段是逐行生成的
+int Log::FormatTimestamp(char* buf, const struct timespec& now) {
+  time_cache_.Get(now.tv_sec, buf);
+  int n = LOG_TIME_PREFIX_LEN;
+  buf[n++] = '.';
+  long usec = now.tv_nsec / 1000;
+  for (int i = 5; i >= 0; --i) {
+    buf[n + i] = '0' + usec % 10;
+    usec /= 10;
+  }
+  return n + 6;
+}
+
+// 写入时间前缀和级别标签，返回写入的字节数
+// 时间前缀格式为 "YYYY-MM-DD HH:MM:SS.uuuuuu "
+int Log::FormatPrefix(char* buf, const struct timespec& now,
+                      const char* type) {
+  int n = FormatTimestamp(buf, now);
+  buf[n++] = ' ';
+  int type_len = strlen(type);
+  memcpy(buf + n, type, type_len);
+  return n + type_len;
+}
+
+// 将一行日志（时间前缀 + 级别 + 正文 + 换行）格式化到 buf 中，返回写入的字节数
+// 正文过长时截断，保证结果总是以换行结尾
+int Log::FormatLine(char* buf, int size, const struct timespec& now,
+                    const char* type, const char* format, va_list va_lst) {
+  int n = FormatPrefix(buf, now, type);
   
+  // 类似于 snprintf, 将 va_list 对象中的数据按照 format 格式写入 buf 中
+  int m = vsnprintf(buf + n, size - n - 1, format, va_lst);
+  if (m < 0) {
+    m = 0;
+  } else if (m > size - n - 2) {
+    m = size - n - 2;
+  }
+  buf[n + m] = '\n';
+  buf[n + m + 1] = '\0';
+  return n + m + 1;
+}
+
+void Log::BeginKV(LogKVWriter* w, const struct timespec& now, int level,
+                  const char* msg) {
+  // 与键值对一样，放不下的字段整个回退，之后的键值对也不再写入
+  if (w->format() == kLogKVJson) {
+    static const char* const kLevelNames[] = {"debug", "info", "warn", "error"};
+    w->Char('{');
+    char* mark = w->cursor();
+    w->Raw("\"ts\":\"", 6);
+    char ts[32];
+    w->Raw(ts, FormatTimestamp(ts, now));
+    w->Raw("\",\"level\":\"", 11);
+    w->Raw(level >= 0 && level <= 3 ? kLevelNames[level] : "info");
+    w->Char('"');
+    if (w->full()) {
+      w->Rollback(mark);
+      return;
+    }
+    mark = w->cursor();
+    w->Raw(",\"msg\":", 7);
+    LogPutValue(w, msg);
+    if (w->full()) {
+      w->Rollback(mark);
+    }
+    return;
+  }
+  // logfmt 与普通日志共用时间前缀，日志行仍然以时间戳开头
+  w->Skip(FormatPrefix(w->cursor(), now, LevelTag(level)));
+  char* mark = w->cursor();
+  w->Raw("msg=", 4);
+  LogPutValue(w, msg);
+  if (w->full()) {
+    w->Rollback(mark);
+  }
+}
 
-  // 类似于 snprintf, 将 va_list 对象中的数据按照 format 格式写入 buf_ 中
-  int m = vsnprintf(buf_ + n, log_buf_size_ - n - 1, format, va_lst);
-  buf_[n + m] = '\n';
-  buf_[n + m + 1] = '\0';
-  single_log_str = buf_;
+int Log::EndKV(LogKVWriter* w) {
+  // 构造 LogKVWriter 时留出了 '}'、换行和 '\0' 的位置，放不下的字段已经整个
+  // 回退，所以截断时 JSON 仍然是完整的对象，logfmt 中也不会有半个值
+  char* end = w->cursor();
+  int n = w->length();
+  if (w->format() == kLogKVJson) {
+    end[0] = '}';
+    ++end;
+    ++n;
+  }
+  end[0] = '\n';
+  end[1] = '\0';
+  return n + 1;
+}
 
-  pthread_mutex_unlock(&lock_);
-  if (is_async_ && !log_queue_->isFull()) {
-    log_queue_->Push(single_log_str);
-  } else {
-    pthread_mutex_lock(&lock_);
-    fputs(single_log_str.c_str(), fp_);
-    pthread_mutex_unlock(&lock_);
+// 解码后的单个参数
+struct LogArgValue {
+  int tag;
+  long long i; // 有符号整数
+  unsigned long long u; // 无符号整数
+  double d; // 浮点数
+  const char* s; // 字符串，不以 '\0' 结尾
+  int slen; // 字符串长度
+  const void* p; // 指针
+};
+
+// 按照类型标签从 arg 处解码一个参数，返回下一个参数的位置
+static const char* DecodeArg(int tag, const char* arg, LogArgValue* v) {
+  memset(v, 0, sizeof(*v));
+  v->tag = tag;
+  switch (tag) {
+    case kLogArgInt: {
+      int32_t x;
+      memcpy(&x, arg, 4);
+      v->i = x;
+      v->u = (uint32_t)x;
+      v->d = x;
+      return arg + 4;
+    }
+    case kLogArgUInt: {
+      uint32_t x;
+      memcpy(&x, arg, 4);
+      v->i = x;
+      v->u = x;
+      v->d = x;
+      return arg + 4;
+    }
+    case kLogArgLong: {
+      int64_t x;
+      memcpy(&x, arg, 8);
+      v->i = x;
+      v->u = (uint64_t)x;
+      v->d = (double)x;
+      return arg + 8;
+    }
+    case kLogArgULong: {
+      uint64_t x;
+      memcpy(&x, arg, 8);
+      v->i = (int64_t)x;
+      v->u = x;
+      v->d = (double)x;
+      return arg + 8;
+    }
+    case kLogArgDouble: {
+      memcpy(&v->d, arg, sizeof(double));
+      v->i = (long long)v->d;
+      v->u = (unsigned long long)v->i;
+      return arg + sizeof(double);
+    }
+    case kLogArgString: {
+      uint32_t len;
+      memcpy(&len, arg, sizeof(len));
+      v->s = arg + sizeof(len);
+      v->slen = len;
+      return arg + sizeof(len) + len;
+    }
+    case kLogArgPointer: {
+      memcpy(&v->p, arg, sizeof(v->p));
+      v->i = (intptr_t)v->p;
+      v->u = (uintptr_t)v->p;
+      return arg + sizeof(v->p);
+    }
+    default:
+      return arg;
   }
+}
 
-  // 清除 va_list 对象
-  va_end(va_lst);
+// 逐个解析格式串中的转换说明，用解码出的参数调用 snprintf
+// 参数的实际类型以编码时的类型为准，长度修饰符会被替换成与之匹配的形式
+int Log::FormatDeferred(const char* record, int len, char* buf, int size) {
+  LogDeferredHead head;
+  memcpy(&head, record, sizeof(head));
+  const char* arg = record + sizeof(head);
+  const char* end = record + len;
+  int next = 0; // 下一个参数的下标
+
+  struct timespec now = {0, 0};
+  now.tv_sec = head.sec;
+  now.tv_nsec = head.nsec;
+  int n = FormatPrefix(buf, now, LevelTag(head.level));
+  int limit = size - 2; // 留出换行和 '\0' 的位置
+
+  const char* f = head.format;
+  while (*f != '\0' && n < limit) {
+    if (*f != '%') {
+      buf[n++] = *f++;
+      continue;
+    }
+    if (f[1] == '%') {
+      buf[n++] = '%';
+      f += 2;
+      continue;
+    }
+
+    // 复制标志、宽度和精度，'*' 从参数中取值
+    char spec[48];
+    int sn = 0;
+    int precision = -1;
+    LogArgValue v;
+    spec[sn++] = *f++;
+    while (*f != '\0' && strchr("-+ #0", *f) && sn < 8) {
+      spec[sn++] = *f++;
+    }
+    if (*f == '*') {
+      if (next < head.nargs) {
+        arg = DecodeArg(head.tags[next++], arg, &v);
+        sn += snprintf(spec + sn, 12, "%d", (int)v.i);
+      }
+      ++f;
+    } else {
+      while (*f >= '0' && *f <= '9' && sn < 20) {
+        spec[sn++] = *f++;
+      }
+    }
+    if (*f == '.') {
+      ++f;
+      precision = 0;
+      if (*f == '*') {
+        if (next < head.nargs) {
+          arg = DecodeArg(head.tags[next++], arg, &v);
+          precision = (int)v.i;
+        }
+        ++f;
+      } else {
+        while (*f >= '0' && *f <= '9') {
+          precision = precision * 10 + (*f++ - '0');
+        }
+      }
+    }
+    // 原有的长度修饰符全部跳过
+    while (*f != '\0' && strchr("hlLqjzt", *f)) {
+      ++f;
+    }
+    char conv = *f;
+    if (conv == '\0') {
+      break;
+    }
+    ++f;
+    if (next >= head.nargs || arg >= end) {
+      // 参数不够，按 printf 的惯例这是未定义行为，这里直接忽略该转换说明
+      continue;
+    }
+    arg = DecodeArg(head.tags[next++], arg, &v);
+
+    int rest = size - 1 - n;
+    int m = 0;
+    if (precision >= 0 && conv != 's') {
+      sn += snprintf(spec + sn, 12, ".%d", precision);
+    }
+    switch (conv) {
+      case 'd':
+      case 'i': {
+        memcpy(spec + sn, "lld", 4);
+        m = snprintf(buf + n, rest, spec, v.i);
+        break;
+      }
+      case 'u':
+      case 'o':
+      case 'x':
+      case 'X': {
+        spec[sn++] = 'l';
+        spec[sn++] = 'l';
+        spec[sn++] = conv;
+        spec[sn] = '\0';
+        m = snprintf(buf + n, rest, spec, v.u);
+        break;
+      }
+      case 'c': {
+        memcpy(spec + sn, "c", 2);
+        m = snprintf(buf + n, rest, spec, (int)v.i);
+        break;
+      }
+      case 'f':
+      case 'F':
+      case 'e':
+      case 'E':
+      case 'g':
+      case 'G':
+      case 'a':
+      case 'A': {
+        spec[sn++] = conv;
+        spec[sn] = '\0';
+        m = snprintf(buf + n, rest, spec, v.d);
+        break;
+      }
+      case 's': {
+        // 字符串没有 '\0' 结尾，用精度限制输出长度
+        int slen = v.tag == kLogArgString ? v.slen : 0;
+        if (precision >= 0 && precision < slen) {
+          slen = precision;
+        }
+        memcpy(spec + sn, ".*s", 4);
+        m = snprintf(buf + n, rest, spec, slen,
+                     v.tag == kLogArgString ? v.s : "");
+        break;
+      }
+      case 'p': {
+        memcpy(spec + sn, "p", 2);
+        m = snprintf(buf + n, rest, spec, v.p);
+        break;
+      }
+      default:
+        break;
+    }
+    if (m > 0) {
+      n += m < rest ? m : rest - 1;
+    }
+  }
+
+  if (n > limit) {
+    n = limit;
+  }
+  buf[n] = '\n';
+  buf[n + 1] = '\0';
+  return n + 1;
+}
+
+void* Log::flusherWork() {
+  struct timespec last_flush = {0, 0};
+  struct timespec last_sync = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &last_flush);
+  last_sync = last_flush;
+
+  // 唤醒间隔取两个定时器中较短的一个
+  int wait_ms = flush_policy_.interval_ms;
+  if (wait_ms <= 0 || (flush_policy_.fsync_interval_ms > 0 &&
+                       flush_policy_.fsync_interval_ms < wait_ms)) {
+    wait_ms = flush_policy_.fsync_interval_ms;
+  }
+
+  pthread_mutex_lock(&flush_lock_);
+  while (!flush_stop_) {
+    struct timespec t = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &t);
+    long long ns = t.tv_nsec + (long long)wait_ms * 1000000;
+    t.tv_sec += ns / 1000000000;
+    t.tv_nsec = ns % 1000000000;
+    pthread_cond_timedwait(&flush_cond_, &flush_lock_, &t);
+    if (flush_stop_) {
+      break;
+    }
+    pthread_mutex_unlock(&flush_lock_);
+
+    struct timespec now = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // 一次收走所有线程暂存的日志，多个线程的刷新合并成一批
+    if (flush_policy_.interval_ms > 0 &&
+        (now.tv_sec - last_flush.tv_sec) * 1000 +
+        (now.tv_nsec - last_flush.tv_nsec) / 1000000 >=
+        flush_policy_.interval_ms) {
+      CollectIdleBatches();
+      last_flush = now;
+    }
+    if (flush_policy_.fsync_interval_ms > 0 &&
+        (now.tv_sec - last_sync.tv_sec) * 1000 +
+        (now.tv_nsec - last_sync.tv_nsec) / 1000000 >=
+        flush_policy_.fsync_interval_ms) {
+      for (int i = 0; i < shard_count_; ++i) {
+        pthread_mutex_lock(&shards_[i].lock);
+        shards_[i].file.Sync();
+        pthread_mutex_unlock(&shards_[i].lock);
+      }
+      last_sync = now;
+    }
+
+    pthread_mutex_lock(&flush_lock_);
+  }
+  pthread_mutex_unlock(&flush_lock_);
+  return NULL;
 }
 
 void Log::Flush(void) {
-  pthread_mutex_lock(&lock_);
-  fflush(fp_);
-  pthread_mutex_unlock(&lock_);
+  LogThreadBuffer* tb = GetThreadBuffer();
+  pthread_mutex_lock(&tb->lock);
+  HandOff(tb);
+  pthread_mutex_unlock(&tb->lock);
+  // 日志段通过 mmap 写入，写入后即对其它进程可见，不需要再刷新用户态缓冲区
 }
\ No newline at end of file
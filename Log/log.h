@@ -1,10 +1,159 @@
-#include "block_queue.h"
+#include "ring_buffer.h"
+#include "time_cache.h"
+#include "deferred.h"
+#include "structured.h"
+#include "log_segment.h"
 #include <stdio.h>
 #include <stdarg.h>
 #include <pthread.h>
+#include <sys/time.h>
+#include <atomic>
 #include <iostream>
+#include <list>
 
 using std::string;
+using std::list;
+
+// 日志分片：每个分片有自己的环形缓冲区、写日志线程和日志文件，
+// 线程按线程 id 映射到固定的分片，不同分片的写入互不干扰
+struct LogShard {
+  int index; // 分片编号
+  LogRingBuffer* queue; // 异步模式下的多生产者单消费者环形缓冲区
+  pthread_t write_tid; // 异步模式下的写日志线程
+  LogSegmentWriter file; // 本分片的日志文件
+  char* deferred_buf; // 格式化延迟记录的缓冲区
+  long long count; // 本分片当天写入的行数
+  int today; // 记录当前是哪一天
+  std::atomic<bool> sync_requested; // 有高级别日志请求尽快 fsync
+  pthread_mutex_t lock; // 保护日志文件和行数统计
+};
+
+// 每个线程独占的日志暂存区
+// 线程先在 line 中格式化单行日志，再追加到本地批次 batch 中，
+// 只有批次满了、Flush 或者刷新策略要求时才把整个批次交给写日志的一方
+// batch 由若干条记录组成（见 deferred.h），连续的文本行合并在同一条记录中
+struct LogThreadBuffer {
+  char* line; // 单行日志格式化缓冲区
+  char* batch; // 已经格式化好的若干行日志
+  int batch_len; // batch 中已使用的字节数
+  int batch_cap; // batch 的容量
+  int text_head; // 最后一条文本记录的头部在 batch 中的偏移，-1 表示没有
+  int batch_lines; // batch 中的日志行数，用于统计丢弃/阻塞的行数
+  unsigned int sample_count; // 采样策略下本线程的行计数
+  LogShard* shard; // 本线程的日志写入的分片
+  pthread_mutex_t lock; // 只在写日志线程回收陈旧批次时才会发生竞争
+};
+
+// 日志的刷新（group commit）策略，各项可以组合使用，为 0 表示不启用
+// "交出" 指把线程暂存的日志交给写日志的一方写入日志文件，"fsync" 指落盘
+struct LogFlushPolicy {
+  LogFlushPolicy() : interval_ms(1000), bytes(0), immediate_level(3),
+                     fsync_interval_ms(0), fsync_level(4) {}
+
+  int interval_ms; // 后台刷新线程每隔多少毫秒把所有线程暂存的日志交出
+  int bytes; // 单个线程暂存超过多少字节就交出，为 0 时批次满了才交出
+  int immediate_level; // 不低于该级别的日志立即交出，默认 ERROR
+  int fsync_interval_ms; // 后台刷新线程每隔多少毫秒 fsync 一次
+  int fsync_level; // 不低于该级别的日志写入后尽快 fsync，默认不启用
+};
+
+// 异步队列满（或接近满）时的处理策略
+enum LogOverflowPolicy {
+  kLogBlock = 0, // 阻塞等待空槽位，超时后丢弃这一批
+  kLogDropNewest, // 立即丢弃新交出的一批
+  kLogDropLowLevel, // 超过高水位后直接丢弃 DEBUG/INFO，队列满时同 kLogBlock
+  kLogSample, // 超过高水位后每 sample_rate 行只保留一行（ERROR 不受影响），
+              // 队列满时同 kLogDropNewest
+};
+
+// 异步队列的背压策略
+struct LogQueuePolicy {
+  LogQueuePolicy() : overflow(kLogBlock), block_timeout_ms(100),
+                     high_watermark(75), sample_rate(10) {}
+
+  LogOverflowPolicy overflow; // 队列满时的处理策略
+  int block_timeout_ms; // 阻塞等待的最长时间
+  int high_watermark; // 高水位，占队列容量的百分比
+  int sample_rate; // 采样策略下每多少行保留一行
+};
+
+// 切换下来的日志文件的后台压缩策略
+struct LogCompressPolicy {
+  LogCompressPolicy() : enabled(false), level(6), bytes_per_sec(8 << 20) {}
+
+  bool enabled; // 是否压缩，压缩完成后原文件被删除
+  int level; // zlib 压缩级别 1~9
+  size_t bytes_per_sec; // 压缩线程每秒最多读写的字节数，0 表示不限速
+};
+
+// 编译期的最低日志级别，低于它的 LOG_* 语句整个被编译器消除
+// 例如发布版本编译时加上 -DLOG_MIN_LEVEL=1 去掉所有 DEBUG 日志
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+// 编译期的级别开关，LOG_* 宏用它包住整条语句
+template <int kLevel>
+struct LogLevelEnabled {
+  static constexpr bool value = kLevel >= LOG_MIN_LEVEL;
+};
+
+// C++17 起用 if constexpr：关闭的级别不生成代码，调用点的静态变量、
+// 格式串和参数都不会进入目标文件，-O0 也一样
+// 更早的标准退化为普通的 if，只能依靠优化器消除
+#if __cplusplus >= 201703L
+#define LOG_IF_CONSTEXPR if constexpr
+#else
+#define LOG_IF_CONSTEXPR if
+#endif
+
+// 一条 LOG_* 语句（调用点），以静态变量的形式存在于每条语句内
+// 构造函数是 constexpr 的，静态变量在编译期完成初始化，没有 guard 检查
+// 第一次执行时向 Log 登记并算出是否启用，之后每次只需读一次 state_，
+// SetLevel/SetCallSiteEnabled 修改阈值时会重新计算所有已登记调用点的 state_
+class LogCallSite {
+ public:
+  constexpr LogCallSite(int level, const char* file, int line)
+      : state_(kUnknown), level_(level), file_(file), line_(line),
+        next_(nullptr) {}
+
+  LogCallSite(const LogCallSite& other) = delete;
+  LogCallSite& operator=(const LogCallSite& other) = delete;
+
+  /// @brief 这条语句当前是否需要写日志
+  inline bool Enabled();
+
+  int level() const { return level_; }
+  const char* file() const { return file_; }
+  int line() const { return line_; }
+
+ private:
+  friend class Log;
+
+  static const int kUnknown = -1; // 还没有登记
+  static const int kOff = 0;
+  static const int kOn = 1;
+
+  std::atomic<int> state_; // kUnknown/kOff/kOn
+  int level_; // 日志级别
+  const char* file_; // __FILE__
+  int line_; // __LINE__
+  LogCallSite* next_; // 已登记调用点组成的链表，由 Log::sites_lock_ 保护
+};
+
+// 按文件（和行号）单独打开或关闭某些调用点，优先于级别阈值
+struct LogSiteOverride {
+  char file[128]; // 文件名，与 __FILE__ 的结尾匹配
+  int line; // 行号，0 表示整个文件
+  bool enabled;
+};
+
+// 日志系统的运行统计
+struct LogStats {
+  unsigned long long dropped_lines; // 因为队列满或背压策略被丢弃的行数
+  unsigned long long blocked_lines; // 交出时需要等待空槽位的行数
+  LogCompressStats compress; // 后台压缩的文件数、字节数和压缩比
+};
 
 class Log {
   public:
@@ -16,26 +165,134 @@ class Log {
     return &instance;
   }
 
-  // 异步写日志线程的工作函数
+  // 异步写日志线程的工作函数，arg 是它负责的分片
   static void* threadFlushLog(void* arg) {
     // 调用异步写日志函数
-    Log::GetInstance()->asyncWriteLog();
+    return Log::GetInstance()->asyncWriteLog((LogShard*)arg);
+  }
+
+  // 后台刷新线程的工作函数
+  static void* threadFlusher(void*) {
+    return Log::GetInstance()->flusherWork();
   }
 
   /// @brief 初始化函数
   /// @param file_name  日志文件名
-  /// @param log_buf_size 单行日志缓冲区大小
+  /// @param log_buf_size 单行日志缓冲区大小，同时也是线程批次和环形缓冲区单个
+  /// 槽位的大小
   /// @param split_lines 单个日志文件的最大行数
-  /// @param max_queue_size 阻塞队列的大小
+  /// @param max_queue_size 环形缓冲区的槽位数，大于 0 时异步写日志
+  /// @param flush_policy 刷新策略，决定暂存的日志多久交出、多久落盘
+  /// @param queue_policy 异步队列的背压策略
+  /// @param compress_policy 切换下来的日志文件是否在后台压缩
+  /// @param shards 分片数，每个分片有自己的队列、写日志线程和日志文件
+  /// <date>_<name>.<shard>，为 1 时文件名与不分片时相同
   bool Init(const char* file_name, int close_log, int log_buf_size = 8192, 
-            int split_lines = 5000000, int max_queue_size = 0);
+            int split_lines = 5000000, int max_queue_size = 0,
+            const LogFlushPolicy& flush_policy = LogFlushPolicy(),
+            const LogQueuePolicy& queue_policy = LogQueuePolicy(),
+            const LogCompressPolicy& compress_policy = LogCompressPolicy(),
+            int shards = 1);
 
   // 将单行日志写入日志文件
   void WriteLog(int level, const char* format, ...);
 
-  // 刷新流缓冲区
+  /// @brief 延迟格式化写日志：只记录格式串指针、时间戳和参数的原始字节，
+  /// 由写日志线程完成格式化。同步模式下退化为 WriteLog
+  /// @param level 日志级别
+  /// @param format 格式串，必须是静态存储期的字符串（一般是字面量）
+  /// @param args 参数，支持整数、枚举、浮点数、字符串和指针
+  template <typename... Args>
+  void WriteDeferred(int level, const char* format, const Args&... args) {
+    size_t size = sizeof(LogDeferredHead) + LogArgsSize(args...);
+    // 同步模式下没有写日志线程，超长的记录放不进一个批次，都直接格式化
+    if (!is_async_ ||
+        size + sizeof(LogRecordHead) > (size_t)log_buf_size_) {
+      WriteLog(level, format, args...);
+      return;
+    }
+
+    LogThreadBuffer* tb = GetThreadBuffer();
+    if (!Admit(tb, level)) {
+      return;
+    }
+
+    LogDeferredHead head;
+    struct timespec now = {0, 0};
+    LogTimeCache::Now(&now);
+    head.format = format;
+    head.tags = LogArgTags<Args...>::kTags;
+    head.sec = now.tv_sec;
+    head.nsec = now.tv_nsec;
+    head.level = level;
+    head.nargs = sizeof...(Args);
+
+    pthread_mutex_lock(&tb->lock);
+    char* p = AppendRecord(tb, kLogRecordDeferred, size);
+    memcpy(p, &head, sizeof(head));
+    LogEncodeArgs(p + sizeof(head), args...);
+    ++tb->batch_lines;
+    ApplyFlushPolicy(tb, level);
+    pthread_mutex_unlock(&tb->lock);
+  }
+
+  /// @brief 结构化写日志，直接编码成 JSON lines 或 logfmt，格式由 SetKVFormat 决定
+  /// @param level 日志级别
+  /// @param msg 事件名
+  /// @param args 成对的 key, value，key 必须是字符串，value 支持整数、枚举、
+  /// 浮点数、bool、字符串和 std::string
+  template <typename... Args>
+  void WriteKV(int level, const char* msg, const Args&... args) {
+    static_assert(sizeof...(Args) % 2 == 0,
+                  "LOG_*_KV expects key, value pairs");
+    struct timespec now = {0, 0};
+    LogTimeCache::Now(&now);
+
+    LogThreadBuffer* tb = GetThreadBuffer();
+    if (!Admit(tb, level)) {
+      return;
+    }
+
+    // 与 WriteLog 一样在本线程的单行缓冲区中编码，留出结尾的 '}'、换行和 '\0'
+    pthread_mutex_lock(&tb->lock);
+    LogKVWriter w(tb->line, log_buf_size_ - 3, kv_format_);
+    BeginKV(&w, now, level, msg);
+    LogPutKV(&w, args...);
+    int len = EndKV(&w);
+    AppendText(tb, tb->line, len);
+    ++tb->batch_lines;
+    ApplyFlushPolicy(tb, level);
+    pthread_mutex_unlock(&tb->lock);
+  }
+
+  /// @brief 设置结构化日志的输出格式，默认 logfmt
+  void SetKVFormat(LogKVFormat format) { kv_format_ = format; }
+
+  // 将当前线程暂存的日志交给写日志的一方
+  // LOG_* 宏不再逐行调用，交出的时机由 LogFlushPolicy 决定
   void Flush(void);
 
+  /// @brief 取得丢弃/阻塞的行数等统计，可用于告警
+  LogStats GetStats() const;
+
+  /// @brief 设置运行时的最低日志级别，低于它的日志不再写入
+  /// 编译期 LOG_MIN_LEVEL 去掉的语句不受影响
+  void SetLevel(int level);
+
+  int GetLevel() const { return level_.load(std::memory_order_relaxed); }
+
+  /// @brief 单独打开或关闭某个文件（某一行）中的日志语句，不受级别阈值影响
+  /// @param file 文件名，与 __FILE__ 的结尾匹配，例如 "http_conn.cpp"
+  /// @param line 行号，0 表示整个文件
+  /// @param enabled 打开还是关闭
+  void SetCallSiteEnabled(const char* file, int line, bool enabled);
+
+  /// @brief 清除所有 SetCallSiteEnabled 的设置，回到只按级别阈值过滤
+  void ClearCallSiteOverrides();
+
+  /// @brief 调用点第一次执行时登记，算出并返回它是否启用
+  bool RegisterCallSite(LogCallSite* site);
+
 
  private:
   // 将构造函数、析构函数私有化
@@ -45,48 +302,208 @@ class Log {
   Log(const Log& other) = delete;
   Log& operator=(const Log& other) = delete;
 
-  // 异步写日志
-  void* asyncWriteLog() {
-    string single_log;
-    // 从阻塞队列中取出一个日志，写入文件
-    while (log_queue_->Pop(single_log)) {
-      pthread_mutex_lock(&lock_);
-      fputs(single_log.c_str(), fp_);
-      pthread_mutex_unlock(&lock_);
+  // 写入时间戳 "YYYY-MM-DD HH:MM:SS.uuuuuu"，返回写入的字节数
+  int FormatTimestamp(char* buf, const struct timespec& now);
+
+  // 写入时间前缀和级别标签，返回写入的字节数
+  int FormatPrefix(char* buf, const struct timespec& now, const char* type);
+
+  // 结构化日志的开头：logfmt 为普通的时间前缀和 msg，JSON 为 ts、level 和 msg
+  void BeginKV(LogKVWriter* w, const struct timespec& now, int level,
+               const char* msg);
+
+  // 结构化日志的结尾，补上 JSON 的 '}' 和换行，返回整行的字节数
+  int EndKV(LogKVWriter* w);
+
+  // 格式化一整行日志到 buf 中，返回写入的字节数（包括结尾的换行）
+  int FormatLine(char* buf, int size, const struct timespec& now,
+                 const char* type, const char* format, va_list va_lst);
+
+  // 批次（以及异步队列每个槽位）的容量：除了一整行日志，还要放下它的记录头
+  int BatchCapacity() const {
+    return log_buf_size_ + (int)sizeof(LogRecordHead);
+  }
+
+  // 取得当前线程的暂存区，第一次调用时创建并登记
+  LogThreadBuffer* GetThreadBuffer();
+
+  // 在暂存区中追加一行文本，与前面的文本行合并成一条记录，调用者需持有 tb->lock
+  void AppendText(LogThreadBuffer* tb, const char* line, int len);
+
+  // 在暂存区中追加一条 size 字节的记录，返回记录内容的起始地址
+  // 批次放不下时先交出批次，调用者需持有 tb->lock
+  char* AppendRecord(LogThreadBuffer* tb, LogRecordKind kind, int size);
+
+  // 在写日志线程中格式化一条延迟记录，返回写入 buf 的字节数
+  int FormatDeferred(const char* record, int len, char* buf, int size);
+
+  // 线程退出时由 pthread_key 的析构回调调用，交出剩余日志并释放暂存区
+  static void ReleaseThreadBuffer(void* arg);
+
+  // 将暂存区中的批次交给本线程所在分片写日志的一方，调用者需持有 tb->lock
+  // 异步模式下整批拷贝进一个环形缓冲区槽位，否则在分片的锁内直接写文件
+  void HandOff(LogThreadBuffer* tb);
+
+  // 与 HandOff 相同，但异步队列满时不按背压策略等待，批次留在暂存区下次再交出
+  // 用于持有 buffers_lock_ 的场合，调用者需持有 tb->lock
+  void TryHandOff(LogThreadBuffer* tb);
+
+  // 异步队列超过高水位时按背压策略决定这一行是否还要写
+  bool Admit(LogThreadBuffer* tb, int level);
+
+  // 环形缓冲区满时按背压策略再次尝试预留槽位，返回 NULL 表示丢弃这一批
+  char* ReserveOnFull(LogThreadBuffer* tb, uint64_t* ticket);
+
+  // 把一批日志写入分片的日志文件，必要时先切换日志文件
+  // 调用者需持有 shard->lock
+  void WriteBatch(LogShard* shard, const char* data, int len);
+
+  // 把日志目录中以前切换下来、还没有压缩的日志段交给压缩器
+  // 例如上次退出时压缩器队列中还没处理的文件，正在写的日志文件除外
+  void SubmitLeftoverSegments();
+
+  // 分片的日志文件名：路径 + 日期 + 日志名 [+ .分片号] [+ .第几个文件]
+  void ShardFileName(const LogShard* shard, const char* date, long long part,
+                     char* buf, int size) const;
+
+  // 追加一条日志后按刷新策略决定是否立即交出批次，调用者需持有 tb->lock
+  void ApplyFlushPolicy(LogThreadBuffer* tb, int level);
+
+  // 有 fsync 请求时把分片的日志文件落盘，调用者需持有 shard->lock
+  void SyncIfRequested(LogShard* shard);
+
+  // 把各个线程暂存的批次收走，正在写日志的线程和异步队列已满的分片会被跳过
+  void CollectIdleBatches();
+
+  // 后台刷新线程：定时收走各线程暂存的日志，定时 fsync
+  void* flusherWork();
+
+  // 按当前阈值和单独设置算出调用点是否启用，调用者需持有 sites_lock_
+  bool CallSiteEnabled(const LogCallSite* site) const;
+
+  // 重新计算所有已登记调用点的状态，调用者需持有 sites_lock_
+  void RefreshCallSites();
+
+  // 异步写日志，每个分片一个线程
+  // 每次取出一段连续的已提交槽位，只加一次锁就全部写入文件
+  void* asyncWriteLog(LogShard* shard) {
+    LogRingBuffer* queue = shard->queue;
+    for (;;) {
+      int n = queue->Readable(kMaxDrainSlots);
+      if (n == 0) {
+        // 队列已经取空，且日志系统正在关闭则退出
+        if (is_stop_.load(std::memory_order_acquire) &&
+            queue->Readable(1) == 0) {
+          break;
+        }
+        queue->WaitReadable(kDrainWaitMs);
+        continue;
+      }
+
+      pthread_mutex_lock(&shard->lock);
+      for (int i = 0; i < n; ++i) {
+        int len = 0;
+        const char* batch = queue->SlotAt(i, &len);
+        WriteBatch(shard, batch, len);
+      }
+      // 请求 fsync 的日志已经写入，这一组批次合并成一次 fsync
+      SyncIfRequested(shard);
+      pthread_mutex_unlock(&shard->lock);
+      queue->Release(n);
     }
+    return NULL;
   }
 
+  // 写日志线程一次最多取出的槽位数
+  static const int kMaxDrainSlots = 256;
+  // 队列为空时写日志线程单次等待的时间(ms)
+  static const int kDrainWaitMs = 100;
+
 
   char dir_name_[128]; // 路径名
   char log_name_[128]; // log文件名
   int split_lines_; // 单个日志文件的最大行数
   int log_buf_size_; // 单行日志缓冲区的大小
-  long long count_; // 日志记录的总数
-  int toady_; // 记录当前是哪一天
-  FILE* fp_; // 文件指针
-  char* buf_; // 单行日志缓冲区
+  LogTimeCache time_cache_; // 每秒刷新一次的时间前缀，日志行和日期切换共用
+  LogShard* shards_; // 所有分片，每个分片的日志文件都是预分配 + mmap 写入
+  int shard_count_; // 分片数
+  LogCompressor compressor_; // 切换下来的日志文件的后台压缩器，各分片共用
   int close_log_; // 是否关闭日志系统
-  BlockQueue<string>* log_queue_; // 阻塞队列
   bool is_async_; // 同步异步标志，同步flase, 异步true
-  pthread_mutex_t lock_; // 保护临界资源的锁
+  std::atomic<bool> is_stop_; // 日志系统正在关闭，写日志线程取空队列后退出
+
+  LogQueuePolicy queue_policy_; // 背压策略
+  int high_watermark_slots_; // 高水位对应的（单个分片的）槽位数
+  std::atomic<unsigned long long> dropped_lines_; // 被丢弃的行数
+  std::atomic<unsigned long long> blocked_lines_; // 交出时等待过的行数
+
+  LogFlushPolicy flush_policy_; // 刷新策略
+  LogKVFormat kv_format_; // 结构化日志的输出格式
+  pthread_t flush_tid_; // 后台刷新线程
+  bool flush_started_; // 后台刷新线程是否已经启动
+  bool flush_stop_; // 通知后台刷新线程退出
+  pthread_mutex_t flush_lock_; // 保护 flush_stop_
+  pthread_cond_t flush_cond_; // 用于唤醒后台刷新线程
+
+  pthread_key_t buffer_key_; // 线程暂存区的 key，线程退出时回收暂存区
+  list<LogThreadBuffer*> thread_buffers_; // 所有线程的暂存区
+  pthread_mutex_t buffers_lock_; // 保护 thread_buffers_，只在线程创建/退出时使用
+
+  std::atomic<int> level_; // 运行时的最低日志级别
+  LogCallSite* sites_; // 已登记的调用点
+  list<LogSiteOverride> site_overrides_; // 按文件/行号的单独设置
+  pthread_mutex_t sites_lock_; // 保护 sites_ 和 site_overrides_
 };
 
-#define LOG_DEBUG(format, ...)\ 
-        if(0 == close_log_) {\
-        Log::GetInstance()->WriteLog(0, format, ##__VA_ARGS__);\
-        Log::GetInstance()->Flush();}
+inline bool LogCallSite::Enabled() {
+  int state = state_.load(std::memory_order_relaxed);
+  if (state != kUnknown) {
+    return state == kOn;
+  }
+  return Log::GetInstance()->RegisterCallSite(this);
+}
 
-#define LOG_INFO(format, ...)\ 
+// 刷新由 LogFlushPolicy 决定，不再逐行调用 Flush
+// 低于 LOG_MIN_LEVEL 的语句在编译期被消除；其余语句各自带一个静态的调用点，
+// 被 SetLevel/SetCallSiteEnabled 关闭时只多一次分支判断，参数不会被求值
+// 整个语句包在 do { } while (0) 中，可以放在不带花括号的 if / else 分支里
+#define LOG_CALL(level, method, format, ...)\
+        do {\
+        LOG_IF_CONSTEXPR(LogLevelEnabled<level>::value) {\
         if(0 == close_log_) {\
-        Log::GetInstance()->WriteLog(1, format, ##__VA_ARGS__);\
-        Log::GetInstance()->Flush();}
+        static LogCallSite log_call_site_(level, __FILE__, __LINE__);\
+        if(log_call_site_.Enabled()) {\
+        Log::GetInstance()->method(level, format, ##__VA_ARGS__);}}}\
+        } while (0)
 
-#define LOG_WARN(format, ...)\ 
-        if(0 == close_log_) {\
-        Log::GetInstance()->WriteLog(2, format, ##__VA_ARGS__);\
-        Log::GetInstance()->Flush();}
+#define LOG_DEBUG(format, ...) LOG_CALL(0, WriteLog, format, ##__VA_ARGS__)
 
-#define LOG_ERROR(format, ...)\ 
-        if(0 == close_log_) {\
-        Log::GetInstance()->WriteLog(3, format, ##__VA_ARGS__);\
-        Log::GetInstance()->Flush();}
\ No newline at end of file
+#define LOG_INFO(format, ...) LOG_CALL(1, WriteLog, format, ##__VA_ARGS__)
+
+#define LOG_WARN(format, ...) LOG_CALL(2, WriteLog, format, ##__VA_ARGS__)
+
+#define LOG_ERROR(format, ...) LOG_CALL(3, WriteLog, format, ##__VA_ARGS__)
+
+// 结构化版本，例如 LOG_INFO_KV("req", "user", uid, "lat_us", lat)
+// 第一个参数是事件名，之后是成对的 key, value
+#define LOG_DEBUG_KV(msg, ...) LOG_CALL(0, WriteKV, msg, ##__VA_ARGS__)
+
+#define LOG_INFO_KV(msg, ...) LOG_CALL(1, WriteKV, msg, ##__VA_ARGS__)
+
+#define LOG_WARN_KV(msg, ...) LOG_CALL(2, WriteKV, msg, ##__VA_ARGS__)
+
+#define LOG_ERROR_KV(msg, ...) LOG_CALL(3, WriteKV, msg, ##__VA_ARGS__)
+
+// 延迟格式化版本，调用线程只拷贝参数，格式化在写日志线程中进行
+// 格式串必须是字面量，其中的字符串参数会在调用时被拷贝
+#define LOG_DEBUG_DEFER(format, ...)\
+        LOG_CALL(0, WriteDeferred, "" format, ##__VA_ARGS__)
+
+#define LOG_INFO_DEFER(format, ...)\
+        LOG_CALL(1, WriteDeferred, "" format, ##__VA_ARGS__)
+
+#define LOG_WARN_DEFER(format, ...)\
+        LOG_CALL(2, WriteDeferred, "" format, ##__VA_ARGS__)
+
+#define LOG_ERROR_DEFER(format, ...)\
+        LOG_CALL(3, WriteDeferred, "" format, ##__VA_ARGS__)
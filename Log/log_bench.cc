@@ -0,0 +1,344 @@
+/*
+日志系统的基准测试
+用 1~N 个生产者线程调用 WriteLog，分别测试同步模式和不同队列大小的异步模式，
+以及每行之后是否调用 Flush（旧版 LOG_* 宏的行为）。
+同样的配置也会跑一遍旧版的 BlockQueue<string> + fputs 实现作为基准，
+新的日志后端需要在这组测试上不差于它。
+
+Log 是单例，每组配置 fork 一个子进程单独运行，结果以 JSON lines 输出到标准输出：
+  backend   log 或 legacy
+  mode      sync 或 async
+  queue     异步队列大小，同步模式为 0
+  producers 生产者线程数
+  flush     每行之后是否调用 Flush
+  lines_per_sec / mb_per_sec  从开始写到日志全部落到文件（包括关闭时取空队列）
+  call_lines_per_sec          只算生产者调用的时间，即调用方看到的吞吐
+  p50_ns / p99_ns / p999_ns   单次调用（包括 Flush）的耗时
+  dropped   被背压策略丢弃的行数
+
+用法：log_bench [-n 每个线程的行数] [-t 最大线程数] [-q 队列大小,...] [-d 目录]
+编译：g++ -O2 -o log_bench log_bench.cc log.cc log_segment.cc log_compressor.cc
+      -lpthread -lz
+*/
+
+#include "log.h"
+#include "block_queue.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <vector>
+
+using std::vector;
+
+// 一组测试配置
+struct BenchConfig {
+  bool legacy; // 是否测试旧版实现
+  int queue; // 异步队列大小，0 表示同步
+  int producers; // 生产者线程数
+  bool flush; // 每行之后是否 Flush
+  int lines; // 每个线程写的行数
+  char dir[256]; // 本组配置的日志目录
+};
+
+static long long NowNs() {
+  struct timespec ts = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 旧版的日志实现：每行格式化成 std::string，异步时经 BlockQueue<string>
+// 交给写日志线程 fputs，队列满或同步时在锁内直接 fputs
+class LegacyLog {
+ public:
+  bool Init(const char* path, int queue) {
+    fp_ = fopen(path, "a");
+    if (fp_ == NULL) {
+      return false;
+    }
+    pthread_mutex_init(&lock_, NULL);
+    queue_ = NULL;
+    if (queue > 0) {
+      queue_ = new BlockQueue<string>(queue);
+      pthread_create(&tid_, NULL, Worker, this);
+    }
+    return true;
+  }
+
+  void WriteLog(int level, const char* format, ...) {
+    struct timeval now = {0, 0};
+    gettimeofday(&now, NULL);
+    time_t t = now.tv_sec;
+    struct tm my_tm;
+    localtime_r(&t, &my_tm);
+
+    char buf[8192];
+    int n = snprintf(buf, 48, "%d-%02d-%02d %02d:%02d:%02d.%06ld %s",
+                     my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday,
+                     my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec,
+                     (long)now.tv_usec, level == 0 ? "[debug]:" : "[info]:");
+    va_list va_lst;
+    va_start(va_lst, format);
+    int m = vsnprintf(buf + n, sizeof(buf) - n - 1, format, va_lst);
+    va_end(va_lst);
+    buf[n + m] = '\n';
+    buf[n + m + 1] = '\0';
+
+    // 与旧版一样先整体拷贝进锁内的 string，再交出
+    pthread_mutex_lock(&lock_);
+    string line = buf;
+    pthread_mutex_unlock(&lock_);
+    if (queue_ != NULL && !queue_->isFull()) {
+      queue_->Push(line);
+    } else {
+      pthread_mutex_lock(&lock_);
+      fputs(line.c_str(), fp_);
+      pthread_mutex_unlock(&lock_);
+    }
+  }
+
+  void Flush() {
+    pthread_mutex_lock(&lock_);
+    fflush(fp_);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  // 等写日志线程把队列取空后关闭文件
+  void Close() {
+    if (queue_ != NULL) {
+      // 空串作为结束标记，队列满时重试
+      while (!queue_->Push(string())) {
+        usleep(100);
+      }
+      pthread_join(tid_, NULL);
+      delete queue_;
+    }
+    fclose(fp_);
+  }
+
+ private:
+  static void* Worker(void* arg) {
+    LegacyLog* log = (LegacyLog*)arg;
+    string line;
+    while (log->queue_->Pop(line) && !line.empty()) {
+      pthread_mutex_lock(&log->lock_);
+      fputs(line.c_str(), log->fp_);
+      pthread_mutex_unlock(&log->lock_);
+    }
+    return NULL;
+  }
+
+  FILE* fp_;
+  BlockQueue<string>* queue_;
+  pthread_t tid_;
+  pthread_mutex_t lock_;
+};
+
+static LegacyLog g_legacy;
+
+// 子进程中的测试状态，atexit 回调在 Log 析构（取空队列、关闭文件）之后输出结果
+static BenchConfig g_config;
+static vector<vector<long long> > g_samples;
+static long long g_start_ns;
+static long long g_call_ns;
+static unsigned long long g_dropped;
+static bool g_ran; // 初始化成功并跑完了测试
+
+static void* Producer(void* arg) {
+  long id = (long)arg;
+  vector<long long>& samples = g_samples[id];
+  const BenchConfig& c = g_config;
+  for (int i = 0; i < c.lines; ++i) {
+    long long t0 = NowNs();
+    if (c.legacy) {
+      g_legacy.WriteLog(1, "producer %ld line %d value %f user %s", id, i,
+                        i * 0.5, "bench");
+      if (c.flush) {
+        g_legacy.Flush();
+      }
+    } else {
+      Log::GetInstance()->WriteLog(1, "producer %ld line %d value %f user %s",
+                                   id, i, i * 0.5, "bench");
+      if (c.flush) {
+        Log::GetInstance()->Flush();
+      }
+    }
+    samples[i] = NowNs() - t0;
+  }
+  // 不论是否逐行 Flush，最后都把本线程暂存的日志交出
+  if (!c.legacy) {
+    Log::GetInstance()->Flush();
+  }
+  return NULL;
+}
+
+// 目录中所有文件的总字节数，测完后删除这些文件
+static unsigned long long DirBytes(const char* dir, bool remove) {
+  unsigned long long bytes = 0;
+  DIR* d = opendir(dir);
+  if (d == NULL) {
+    return 0;
+  }
+  struct dirent* e;
+  while ((e = readdir(d)) != NULL) {
+    char path[600];
+    snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+      bytes += st.st_size;
+      if (remove) {
+        unlink(path);
+      }
+    }
+  }
+  closedir(d);
+  if (remove) {
+    rmdir(dir);
+  }
+  return bytes;
+}
+
+static long long Percentile(vector<long long>& all, double p) {
+  if (all.empty()) {
+    return 0;
+  }
+  size_t k = (size_t)(p * (all.size() - 1));
+  std::nth_element(all.begin(), all.begin() + k, all.end());
+  return all[k];
+}
+
+static void Report() {
+  const BenchConfig& c = g_config;
+  if (!g_ran) {
+    return;
+  }
+  if (c.legacy) {
+    g_legacy.Close();
+  }
+  long long total_ns = NowNs() - g_start_ns;
+  unsigned long long bytes = DirBytes(c.dir, true);
+  double lines = (double)c.lines * c.producers;
+
+  vector<long long> all;
+  all.reserve((size_t)lines);
+  for (size_t i = 0; i < g_samples.size(); ++i) {
+    all.insert(all.end(), g_samples[i].begin(), g_samples[i].end());
+  }
+  long long p50 = Percentile(all, 0.5);
+  long long p99 = Percentile(all, 0.99);
+  long long p999 = Percentile(all, 0.999);
+
+  printf("{\"backend\":\"%s\",\"mode\":\"%s\",\"queue\":%d,\"producers\":%d,"
+         "\"flush\":%d,\"lines\":%.0f,\"lines_per_sec\":%.0f,"
+         "\"mb_per_sec\":%.2f,\"call_lines_per_sec\":%.0f,\"p50_ns\":%lld,"
+         "\"p99_ns\":%lld,\"p999_ns\":%lld,\"dropped\":%llu}\n",
+         c.legacy ? "legacy" : "log", c.queue > 0 ? "async" : "sync",
+         c.queue, c.producers, c.flush ? 1 : 0, lines,
+         lines * 1e9 / total_ns, bytes / 1048576.0 * 1e9 / total_ns,
+         lines * 1e9 / g_call_ns, p50, p99, p999, g_dropped);
+  fflush(stdout);
+}
+
+// 在子进程中运行一组配置
+static int RunConfig(const BenchConfig& c) {
+  g_config = c;
+  mkdir(c.dir, 0755);
+  char path[300];
+  snprintf(path, sizeof(path), "%s/bench.log", c.dir);
+
+  // 先于 Log 单例注册，退出时在 Log 析构之后才调用
+  atexit(Report);
+  if (c.legacy) {
+    if (!g_legacy.Init(path, c.queue)) {
+      return 1;
+    }
+  } else {
+    // 旧版宏逐行 Flush，对比时关闭定时刷新，交出时机完全由调用方决定
+    LogFlushPolicy flush_policy;
+    if (c.flush) {
+      flush_policy.interval_ms = 0;
+    }
+    if (!Log::GetInstance()->Init(path, 0, 8192, 5000000, c.queue,
+                                  flush_policy)) {
+      return 1;
+    }
+  }
+
+  g_samples.assign(c.producers, vector<long long>(c.lines));
+  vector<pthread_t> tids(c.producers);
+  g_start_ns = NowNs();
+  for (long i = 0; i < c.producers; ++i) {
+    pthread_create(&tids[i], NULL, Producer, (void*)i);
+  }
+  for (int i = 0; i < c.producers; ++i) {
+    pthread_join(tids[i], NULL);
+  }
+  g_call_ns = NowNs() - g_start_ns;
+  if (!c.legacy) {
+    g_dropped = Log::GetInstance()->GetStats().dropped_lines;
+  }
+  g_ran = true;
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  int lines = 100000;
+  int max_threads = 8;
+  vector<int> queues;
+  const char* dir = "/tmp";
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-n") == 0) {
+      lines = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-t") == 0) {
+      max_threads = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-q") == 0) {
+      for (char* p = strtok(argv[i + 1], ","); p; p = strtok(NULL, ",")) {
+        queues.push_back(atoi(p));
+      }
+    } else if (strcmp(argv[i], "-d") == 0) {
+      dir = argv[i + 1];
+    }
+  }
+  if (queues.empty()) {
+    queues.push_back(64);
+    queues.push_back(1024);
+    queues.push_back(16384);
+  }
+  // 0 表示同步模式
+  queues.insert(queues.begin(), 0);
+
+  int id = 0;
+  for (int legacy = 0; legacy < 2; ++legacy) {
+    for (size_t q = 0; q < queues.size(); ++q) {
+      for (int flush = 0; flush < 2; ++flush) {
+        for (int producers = 1; producers <= max_threads; producers *= 2) {
+          BenchConfig c;
+          c.legacy = legacy == 1;
+          c.queue = queues[q];
+          c.producers = producers;
+          c.flush = flush == 1;
+          c.lines = lines;
+          snprintf(c.dir, sizeof(c.dir), "%s/log_bench.%d.%d", dir,
+                   (int)getpid(), id++);
+
+          pid_t pid = fork();
+          if (pid == 0) {
+            exit(RunConfig(c));
+          }
+          int status = 0;
+          waitpid(pid, &status, 0);
+          if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "config %s queue=%d producers=%d flush=%d failed\n",
+                    c.legacy ? "legacy" : "log", c.queue, c.producers,
+                    c.flush ? 1 : 0);
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,254 @@
+#include "log_compressor.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+
+// ioprio_set 没有 glibc 封装，常量取自 linux/ioprio.h
+#define LOG_IOPRIO_WHO_PROCESS 1
+#define LOG_IOPRIO_CLASS_IDLE 3
+#define LOG_IOPRIO_CLASS_SHIFT 13
+
+LogCompressor::LogCompressor() {
+  level_ = Z_DEFAULT_COMPRESSION;
+  bytes_per_sec_ = 0;
+  tokens_ = 0;
+  refill_time_.tv_sec = 0;
+  refill_time_.tv_nsec = 0;
+  in_buf_ = new char[kChunkSize];
+  out_buf_ = new char[kChunkSize];
+  stop_ = false;
+  started_ = false;
+  files_done_.store(0, std::memory_order_relaxed);
+  raw_bytes_.store(0, std::memory_order_relaxed);
+  compressed_bytes_.store(0, std::memory_order_relaxed);
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&cond_, NULL);
+}
+
+LogCompressor::~LogCompressor() {
+  Stop();
+  delete[] in_buf_;
+  delete[] out_buf_;
+  pthread_mutex_destroy(&lock_);
+  pthread_cond_destroy(&cond_);
+}
+
+bool LogCompressor::Start(int level, size_t bytes_per_sec) {
+  if (started_) {
+    return true;
+  }
+  level_ = level;
+  bytes_per_sec_ = bytes_per_sec;
+  // 一开始就给满一秒的额度
+  tokens_ = (double)bytes_per_sec_;
+  clock_gettime(CLOCK_MONOTONIC, &refill_time_);
+  stop_ = false;
+  if (pthread_create(&tid_, NULL, Worker, this) != 0) {
+    return false;
+  }
+  started_ = true;
+  return true;
+}
+
+void LogCompressor::Submit(const char* path) {
+  pthread_mutex_lock(&lock_);
+  files_.push_back(path);
+  pthread_cond_signal(&cond_);
+  pthread_mutex_unlock(&lock_);
+}
+
+void LogCompressor::Stop() {
+  if (!started_) {
+    return;
+  }
+  pthread_mutex_lock(&lock_);
+  stop_ = true;
+  pthread_cond_signal(&cond_);
+  pthread_mutex_unlock(&lock_);
+  pthread_join(tid_, NULL);
+  started_ = false;
+}
+
+LogCompressStats LogCompressor::GetStats() const {
+  LogCompressStats stats;
+  stats.files = files_done_.load(std::memory_order_relaxed);
+  stats.raw_bytes = raw_bytes_.load(std::memory_order_relaxed);
+  stats.compressed_bytes = compressed_bytes_.load(std::memory_order_relaxed);
+  stats.ratio = stats.raw_bytes == 0
+                    ? 0
+                    : (double)stats.compressed_bytes / stats.raw_bytes;
+  return stats;
+}
+
+void* LogCompressor::Worker(void* arg) {
+  ((LogCompressor*)arg)->RunWorker();
+  return NULL;
+}
+
+void LogCompressor::RunWorker() {
+  // 只降低本线程的优先级：Linux 上 nice 值和 I/O 优先级都是按线程设置的
+  pid_t tid = syscall(SYS_gettid);
+  setpriority(PRIO_PROCESS, tid, 19);
+  syscall(SYS_ioprio_set, LOG_IOPRIO_WHO_PROCESS, tid,
+          LOG_IOPRIO_CLASS_IDLE << LOG_IOPRIO_CLASS_SHIFT);
+
+  pthread_mutex_lock(&lock_);
+  while (!stop_) {
+    if (files_.empty()) {
+      pthread_cond_wait(&cond_, &lock_);
+      continue;
+    }
+    string path = files_.front();
+    files_.pop_front();
+    pthread_mutex_unlock(&lock_);
+    Compress(path.c_str());
+    pthread_mutex_lock(&lock_);
+  }
+  pthread_mutex_unlock(&lock_);
+}
+
+bool LogCompressor::Compress(const char* path) {
+  int in = open(path, O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    perror("log compress open");
+    return false;
+  }
+
+  char tmp_path[300];
+  char gz_path[300];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.gz.tmp", path);
+  snprintf(gz_path, sizeof(gz_path), "%s.gz", path);
+  int out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out < 0) {
+    perror("log compress create");
+    close(in);
+    return false;
+  }
+
+  // windowBits 加 16 表示输出 gzip 格式而不是 zlib 格式
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, level_, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    close(in);
+    close(out);
+    unlink(tmp_path);
+    return false;
+  }
+
+  unsigned long long raw = 0;
+  unsigned long long compressed = 0;
+  bool ok = true;
+  int flush = Z_NO_FLUSH;
+  while (ok && flush != Z_FINISH) {
+    if (!Throttle(kChunkSize)) {
+      ok = false;
+      break;
+    }
+    ssize_t n = read(in, in_buf_, kChunkSize);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("log compress read");
+      ok = false;
+      break;
+    }
+    // 读过的部分不会再用到，不要让它挤占写日志需要的页缓存
+    posix_fadvise(in, raw, n, POSIX_FADV_DONTNEED);
+    raw += n;
+    flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+    zs.next_in = (Bytef*)in_buf_;
+    zs.avail_in = n;
+
+    // 把这一块输入全部压缩完，输出缓冲区满了就写出去
+    do {
+      zs.next_out = (Bytef*)out_buf_;
+      zs.avail_out = kChunkSize;
+      deflate(&zs, flush);
+      size_t have = kChunkSize - zs.avail_out;
+      if (have > 0) {
+        if (!Throttle(have) || write(out, out_buf_, have) != (ssize_t)have) {
+          ok = false;
+          break;
+        }
+        compressed += have;
+      }
+    } while (zs.avail_out == 0);
+  }
+  deflateEnd(&zs);
+  close(in);
+
+  // .gz 落盘之后才能删除原文件，否则掉电可能两个都丢
+  if (ok && fdatasync(out) != 0) {
+    ok = false;
+  }
+  close(out);
+  if (!ok) {
+    unlink(tmp_path);
+    return false;
+  }
+  // 与 LogSegmentWriter 切换日志段一样用 link 发布，同名的 .gz 已经存在时
+  // （例如同一天重启后又切换到同一个文件名）改用 path~N.gz，不覆盖已有的压缩文件
+  for (int i = 1; link(tmp_path, gz_path) != 0; ++i) {
+    if (errno != EEXIST || i > 1000) {
+      perror("log compress link");
+      unlink(tmp_path);
+      return false;
+    }
+    snprintf(gz_path, sizeof(gz_path), "%s~%d.gz", path, i);
+  }
+  unlink(tmp_path);
+  unlink(path);
+
+  files_done_.fetch_add(1, std::memory_order_relaxed);
+  raw_bytes_.fetch_add(raw, std::memory_order_relaxed);
+  compressed_bytes_.fetch_add(compressed, std::memory_order_relaxed);
+  return true;
+}
+
+bool LogCompressor::Throttle(size_t n) {
+  pthread_mutex_lock(&lock_);
+  for (;;) {
+    if (stop_) {
+      pthread_mutex_unlock(&lock_);
+      return false;
+    }
+    if (bytes_per_sec_ == 0) {
+      break;
+    }
+
+    // 按经过的时间补充令牌，最多积攒一秒的额度
+    struct timespec now = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - refill_time_.tv_sec) +
+                     (now.tv_nsec - refill_time_.tv_nsec) / 1e9;
+    refill_time_ = now;
+    tokens_ += elapsed * bytes_per_sec_;
+    if (tokens_ > (double)bytes_per_sec_) {
+      tokens_ = (double)bytes_per_sec_;
+    }
+    // 额度允许透支一次，下一次等待时补回，这样 n 大于限速也不会卡死
+    if (tokens_ > 0) {
+      tokens_ -= n;
+      break;
+    }
+
+    // 等到令牌补回到 0，期间 Stop 可以唤醒
+    double wait = -tokens_ / bytes_per_sec_;
+    struct timespec t = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &t);
+    long long ns = t.tv_nsec + (long long)(wait * 1e9) + 1;
+    t.tv_sec += ns / 1000000000;
+    t.tv_nsec = ns % 1000000000;
+    pthread_cond_timedwait(&cond_, &lock_, &t);
+  }
+  pthread_mutex_unlock(&lock_);
+  return true;
+}
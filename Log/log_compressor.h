@@ -0,0 +1,84 @@
+/*
+切换下来的日志段的后台压缩器
+日志段切换后由 LogSegmentWriter 交给这里，后台线程以最低的 CPU 和 I/O 优先级
+用 zlib 流式压缩成 .gz 文件，完成后删除原文件。
+读写都经过令牌桶限速，不会和写日志线程争抢磁盘带宽。
+*/
+
+#ifndef LOG_COMPRESSOR_H
+#define LOG_COMPRESSOR_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <atomic>
+#include <list>
+#include <string>
+
+using std::list;
+using std::string;
+
+// 压缩统计
+struct LogCompressStats {
+  unsigned long long files; // 压缩完成的文件数
+  unsigned long long raw_bytes; // 压缩前的字节数
+  unsigned long long compressed_bytes; // 压缩后的字节数
+  double ratio; // compressed_bytes / raw_bytes，还没有压缩过文件时为 0
+};
+
+class LogCompressor {
+ public:
+  LogCompressor();
+  ~LogCompressor();
+
+  LogCompressor(const LogCompressor& other) = delete;
+  LogCompressor& operator=(const LogCompressor& other) = delete;
+
+  /// @brief 启动后台压缩线程
+  /// @param level zlib 压缩级别 1~9
+  /// @param bytes_per_sec 每秒最多读写的字节数（读和写分别计数），0 表示不限速
+  /// @return 成功返回 true
+  bool Start(int level, size_t bytes_per_sec);
+
+  /// @brief 提交一个已经关闭的日志文件，压缩完成后原文件被删除
+  void Submit(const char* path);
+
+  /// @brief 停止后台线程。正在压缩的文件放弃压缩，它和还没处理的文件都保留原样，
+  /// 由 Log::Init 下次启动时重新提交
+  void Stop();
+
+  bool isStarted() const { return started_; }
+
+  LogCompressStats GetStats() const;
+
+  static const int kChunkSize = 64 << 10; // 每次读写的字节数
+
+ private:
+  static void* Worker(void* arg);
+  void RunWorker();
+
+  // 把 path 压缩成 path.gz（已经存在时改用 path~N.gz），成功后删除 path
+  bool Compress(const char* path);
+
+  // 从令牌桶中取 n 个字节的额度，不够时等待，Stop 时返回 false
+  bool Throttle(size_t n);
+
+  int level_; // zlib 压缩级别
+  size_t bytes_per_sec_; // 限速
+  double tokens_; // 令牌桶中剩余的字节数
+  struct timespec refill_time_; // 上次补充令牌的时间
+  char* in_buf_; // 读原文件的缓冲区
+  char* out_buf_; // 压缩输出的缓冲区
+
+  list<string> files_; // 等待压缩的文件
+  bool stop_; // 通知后台线程退出
+  bool started_;
+  pthread_t tid_;
+  pthread_mutex_t lock_; // 保护 files_ 和 stop_
+  pthread_cond_t cond_;
+
+  std::atomic<unsigned long long> files_done_;
+  std::atomic<unsigned long long> raw_bytes_;
+  std::atomic<unsigned long long> compressed_bytes_;
+};
+
+#endif
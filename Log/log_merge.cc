@@ -0,0 +1,156 @@
+/*
+离线合并分片日志的小工具
+把多个分片的日志文件按每行开头的时间戳做多路归并，输出一个按时间排序的日志
+输入可以是原始的日志文件，也可以是后台压缩得到的 .gz 文件
+同一个分片中来自不同线程的批次会交错，文件内部只是大致有序，所以每个文件
+预读一个窗口的行一起排序，窗口要大于乱序的距离（约为一个刷新间隔内的行数）
+
+用法：log_merge [-o 输出文件] [-w 每个文件预读的行数] 分片文件...
+编译：g++ -O2 -o log_merge log_merge.cc -lz
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <queue>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// 时间戳 "YYYY-MM-DD HH:MM:SS.uuuuuu" 的长度，按字典序比较即按时间比较
+static const size_t kStampLen = 26;
+
+// 每个文件默认预读的行数
+static const size_t kDefaultWindow = 100000;
+
+// 一个输入文件
+struct MergeInput {
+  gzFile fp; // gzread 对没有压缩的文件会直接透传
+  string line; // 刚读到的一行，包括结尾的换行
+  string stamp; // 上一行的时间戳
+  int index; // 第几个输入文件
+  size_t pending; // 已经预读但还没有输出的行数
+  bool eof;
+};
+
+// 读取下一行，文件结束返回 false
+static bool ReadLine(MergeInput* in) {
+  char buf[4096];
+  in->line.clear();
+  while (gzgets(in->fp, buf, sizeof(buf)) != NULL) {
+    in->line += buf;
+    if (!in->line.empty() && in->line[in->line.size() - 1] == '\n') {
+      return true;
+    }
+  }
+  // 最后一行可能没有换行
+  if (!in->line.empty()) {
+    in->line += '\n';
+    return true;
+  }
+  return false;
+}
+
+// 预读的一行
+struct HeapItem {
+  string stamp; // 时间戳
+  string line;
+  int index; // 所属的输入文件
+  unsigned long long seq; // 读入的顺序，时间戳相同时按读入顺序输出
+};
+
+// priority_queue 是大顶堆，比较取反得到最早的一行
+struct HeapLater {
+  bool operator()(const HeapItem& a, const HeapItem& b) const {
+    int c = a.stamp.compare(b.stamp);
+    return c > 0 || (c == 0 && a.seq > b.seq);
+  }
+};
+
+typedef std::priority_queue<HeapItem, vector<HeapItem>, HeapLater> MergeHeap;
+
+// 从 in 中预读一行放进堆里，文件结束返回 false
+// 不是以时间戳开头的行（例如被截断的行）沿用前一行的时间戳，紧跟在它后面输出
+static bool Fill(MergeInput* in, MergeHeap* heap, unsigned long long* seq) {
+  if (in->eof || !ReadLine(in)) {
+    in->eof = true;
+    return false;
+  }
+  const string& line = in->line;
+  if (line.size() >= kStampLen && line[4] == '-' && line[10] == ' ' &&
+      line[19] == '.') {
+    in->stamp.assign(line, 0, kStampLen);
+  }
+  heap->push(HeapItem{in->stamp, line, in->index, (*seq)++});
+  ++in->pending;
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  const char* out_path = NULL;
+  size_t window = kDefaultWindow;
+  vector<const char*> paths;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      out_path = argv[++i];
+    } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+      window = strtoul(argv[++i], NULL, 10);
+      if (window == 0) {
+        window = 1;
+      }
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+  if (paths.empty()) {
+    fprintf(stderr, "usage: %s [-o output] [-w window] shard_file...\n",
+            argv[0]);
+    return 1;
+  }
+
+  FILE* out = stdout;
+  if (out_path != NULL) {
+    out = fopen(out_path, "w");
+    if (out == NULL) {
+      perror(out_path);
+      return 1;
+    }
+  }
+
+  vector<MergeInput> inputs(paths.size());
+  MergeHeap heap;
+  unsigned long long seq = 0;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    inputs[i].fp = gzopen(paths[i], "rb");
+    inputs[i].index = i;
+    inputs[i].pending = 0;
+    inputs[i].eof = false;
+    if (inputs[i].fp == NULL) {
+      perror(paths[i]);
+      return 1;
+    }
+    while (inputs[i].pending < window && Fill(&inputs[i], &heap, &seq)) {
+    }
+  }
+
+  // 每次输出所有预读的行中最早的一行，再从它所在的文件补读一行
+  while (!heap.empty()) {
+    const HeapItem& item = heap.top();
+    fwrite(item.line.data(), 1, item.line.size(), out);
+    MergeInput* in = &inputs[item.index];
+    heap.pop();
+    --in->pending;
+    Fill(in, &heap, &seq);
+  }
+
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    gzclose(inputs[i].fp);
+  }
+  if (out != stdout) {
+    fclose(out);
+  }
+  return 0;
+}
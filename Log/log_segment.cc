@@ -0,0 +1,327 @@
+#include "log_segment.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+LogSegmentWriter::LogSegmentWriter() {
+  cur_.fd = -1;
+  spare_.fd = -1;
+  spare_ready_ = false;
+  spare_path_[0] = '\0';
+  segment_size_ = kDefaultSegmentSize;
+  window_size_ = kDefaultWindowSize;
+  compressor_ = NULL;
+  stop_ = false;
+  worker_started_ = false;
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&cond_, NULL);
+}
+
+LogSegmentWriter::~LogSegmentWriter() {
+  Close();
+  pthread_mutex_destroy(&lock_);
+  pthread_cond_destroy(&cond_);
+}
+
+bool LogSegmentWriter::Open(const char* path, size_t segment_size,
+                            size_t window_size) {
+  long page = sysconf(_SC_PAGESIZE);
+  segment_size_ = segment_size;
+  // 窗口大小取页大小的整数倍
+  window_size_ = (window_size + page - 1) / page * page;
+
+  if (!CreateSegment(&cur_, path, false)) {
+    return false;
+  }
+
+  // 预备日志段与日志文件在同一个目录下，这样建立硬链接不会跨文件系统
+  const char* p = strrchr(path, '/');
+  if (p == NULL) {
+    snprintf(spare_path_, sizeof(spare_path_), ".%s.next", path);
+  } else {
+    snprintf(spare_path_, sizeof(spare_path_), "%.*s.%s.next",
+             (int)(p - path + 1), path, p + 1);
+  }
+
+  // 启动后台线程，它会立即开始准备下一个日志段
+  stop_ = false;
+  if (pthread_create(&worker_tid_, NULL, Worker, this) == 0) {
+    worker_started_ = true;
+  }
+  return true;
+}
+
+bool LogSegmentWriter::Append(const char* data, size_t len) {
+  if (cur_.fd < 0) {
+    return false;
+  }
+  while (len > 0) {
+    size_t pos = cur_.offset - cur_.window_off;
+    // 窗口写满了，滑动到下一个窗口
+    if (pos >= window_size_) {
+      if (!SlideWindow(&cur_)) {
+        return false;
+      }
+      pos = cur_.offset - cur_.window_off;
+    }
+    size_t n = window_size_ - pos;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(cur_.window + pos, data, n);
+    cur_.offset += n;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool LogSegmentWriter::Rotate(const char* path) {
+  Job close_job;
+  close_job.unlink = false;
+  close_job.seg = cur_;
+
+  pthread_mutex_lock(&lock_);
+  // 预备日志段已经就绪：在这里同步建立正式的文件名，这样 cur_.path 以及之后
+  // 交给压缩器的都是实际的名字；删除临时文件名和关闭旧日志段交给后台线程
+  // 建立链接失败时预备日志段留着，退回到下面的同步创建
+  char target[256];
+  if (spare_ready_ &&
+      LinkNoReplace(spare_path_, path, target, sizeof(target))) {
+    cur_ = spare_;
+    spare_ready_ = false;
+    snprintf(cur_.path, sizeof(cur_.path), "%s", target);
+
+    Job unlink_job;
+    unlink_job.unlink = true;
+    snprintf(unlink_job.from, sizeof(unlink_job.from), "%s", spare_path_);
+    jobs_.push_back(unlink_job);
+    jobs_.push_back(close_job);
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&lock_);
+    return true;
+  }
+  pthread_mutex_unlock(&lock_);
+
+  // 后台线程还没准备好（或者没有启动），只能同步创建，同样不覆盖已有的文件
+  RetireSegment(&close_job.seg);
+  cur_.fd = -1;
+  return CreateSegment(&cur_, path, true);
+}
+
+void LogSegmentWriter::Sync() {
+  if (cur_.fd < 0) {
+    return;
+  }
+  size_t dirty = cur_.offset - cur_.window_off;
+  if (dirty > 0) {
+    msync(cur_.window, dirty, MS_SYNC);
+  }
+  fdatasync(cur_.fd);
+}
+
+void LogSegmentWriter::Close() {
+  if (worker_started_) {
+    pthread_mutex_lock(&lock_);
+    stop_ = true;
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&lock_);
+    // 后台线程退出前会处理完所有已提交的工作
+    pthread_join(worker_tid_, NULL);
+    worker_started_ = false;
+  }
+
+  if (spare_ready_) {
+    FinalizeSegment(&spare_);
+    unlink(spare_path_);
+    spare_ready_ = false;
+  }
+  if (cur_.fd >= 0) {
+    FinalizeSegment(&cur_);
+    cur_.fd = -1;
+  }
+}
+
+bool LogSegmentWriter::CreateSegment(Segment* seg, const char* path,
+                                     bool no_replace) {
+  char target[256];
+  snprintf(target, sizeof(target), "%s", path);
+  int flags = O_RDWR | O_CREAT | O_CLOEXEC | (no_replace ? O_EXCL : 0);
+  int fd = open(target, flags, 0644);
+  for (int i = 1; fd < 0 && no_replace && errno == EEXIST && i <= 1000; ++i) {
+    snprintf(target, sizeof(target), "%s~%d", path, i);
+    fd = open(target, flags, 0644);
+  }
+  if (fd < 0) {
+    return false;
+  }
+
+  // 与原来以追加方式打开文件的行为一致，已有的内容保留
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+  // 上次异常退出时没有截断，文件末尾还留着预分配的 0，先截掉再追加
+  size_t size = DataEnd(fd, st.st_size);
+  if (size < (size_t)st.st_size && ftruncate(fd, size) != 0) {
+    close(fd);
+    return false;
+  }
+
+  seg->fd = fd;
+  snprintf(seg->path, sizeof(seg->path), "%s", target);
+  seg->offset = size;
+  seg->alloc = size;
+  seg->window = NULL;
+  seg->window_off = 0;
+  if (!SlideWindow(seg)) {
+    close(fd);
+    seg->fd = -1;
+    return false;
+  }
+  return true;
+}
+
+size_t LogSegmentWriter::DataEnd(int fd, size_t size) {
+  char buf[16 << 10];
+  while (size > 0) {
+    size_t n = size < sizeof(buf) ? size : sizeof(buf);
+    if (pread(fd, buf, n, size - n) != (ssize_t)n) {
+      break;
+    }
+    // 从后往前找最后一个非 0 字节
+    for (size_t i = n; i > 0; --i) {
+      if (buf[i - 1] != '\0') {
+        return size - n + i;
+      }
+    }
+    size -= n;
+  }
+  return size;
+}
+
+bool LogSegmentWriter::SlideWindow(Segment* seg) {
+  long page = sysconf(_SC_PAGESIZE);
+  size_t window_off = seg->offset / page * page;
+  size_t window_end = window_off + window_size_;
+
+  // 映射范围超出了预分配的大小，一次再多预分配一个段的空间
+  if (window_end > seg->alloc) {
+    size_t alloc = seg->alloc + segment_size_;
+    if (alloc < window_end) {
+      alloc = window_end;
+    }
+    // 文件系统不支持 fallocate 时退化为稀疏文件
+    if (fallocate(seg->fd, 0, 0, alloc) != 0 &&
+        ftruncate(seg->fd, alloc) != 0) {
+      return false;
+    }
+    seg->alloc = alloc;
+  }
+
+  if (seg->window != NULL) {
+    munmap(seg->window, window_size_);
+    seg->window = NULL;
+  }
+  void* addr = mmap(NULL, window_size_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    seg->fd, window_off);
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+  seg->window = (char*)addr;
+  seg->window_off = window_off;
+  return true;
+}
+
+void LogSegmentWriter::FinalizeSegment(Segment* seg) {
+  if (seg->fd < 0) {
+    return;
+  }
+  if (seg->window != NULL) {
+    munmap(seg->window, window_size_);
+    seg->window = NULL;
+  }
+  // 去掉预分配但没有用到的部分
+  if (ftruncate(seg->fd, seg->offset) != 0) {
+    perror("log segment ftruncate");
+  }
+  close(seg->fd);
+  seg->fd = -1;
+}
+
+void LogSegmentWriter::RetireSegment(Segment* seg) {
+  FinalizeSegment(seg);
+  // 压缩器要读的是截断后的完整文件，所以在关闭之后才提交
+  if (compressor_ != NULL) {
+    compressor_->Submit(seg->path);
+  }
+}
+
+bool LogSegmentWriter::LinkNoReplace(const char* from, const char* to,
+                                     char* target, int size) {
+  // link 在目标存在时失败，不会像 rename 那样覆盖已有的日志
+  snprintf(target, size, "%s", to);
+  for (int i = 1; link(from, target) != 0; ++i) {
+    if (errno != EEXIST || i > 1000) {
+      perror("log segment link");
+      return false;
+    }
+    snprintf(target, size, "%s~%d", to, i);
+  }
+  return true;
+}
+
+void* LogSegmentWriter::Worker(void* arg) {
+  ((LogSegmentWriter*)arg)->RunWorker();
+  return NULL;
+}
+
+void LogSegmentWriter::RunWorker() {
+  pthread_mutex_lock(&lock_);
+  for (;;) {
+    // 按提交顺序处理工作，删除临时文件名必须在创建新的预备日志段之前完成
+    while (!jobs_.empty()) {
+      Job job = jobs_.front();
+      jobs_.pop_front();
+      pthread_mutex_unlock(&lock_);
+      if (job.unlink) {
+        unlink(job.from);
+      } else {
+        RetireSegment(&job.seg);
+      }
+      pthread_mutex_lock(&lock_);
+    }
+
+    if (!spare_ready_ && !stop_) {
+      // 文件可能是上次异常退出时遗留的，先删掉
+      pthread_mutex_unlock(&lock_);
+      unlink(spare_path_);
+      Segment seg;
+      bool ok = CreateSegment(&seg, spare_path_, false);
+      pthread_mutex_lock(&lock_);
+      if (ok) {
+        spare_ = seg;
+        spare_ready_ = true;
+      } else {
+        // 创建失败（例如磁盘满），过一段时间再重试，期间切换日志时同步创建
+        struct timespec t = {0, 0};
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += kRetrySeconds;
+        pthread_cond_timedwait(&cond_, &lock_, &t);
+      }
+      continue;
+    }
+
+    if (stop_) {
+      break;
+    }
+    pthread_cond_wait(&cond_, &lock_);
+  }
+  pthread_mutex_unlock(&lock_);
+}
@@ -0,0 +1,126 @@
+/*
+基于内存映射的日志段写入器
+每个日志段在创建时用 fallocate 预先分配空间，通过 mmap 映射的窗口直接写入，
+写满一个窗口才滑动到下一个窗口。后台线程提前创建好下一个日志段，
+切换日志文件时只需建立一个硬链接并交换两个指针，旧日志段的截断、关闭和
+临时文件名的删除都交给后台线程。
+*/
+
+#ifndef LOG_SEGMENT_H
+#define LOG_SEGMENT_H
+
+#include "log_compressor.h"
+#include <stddef.h>
+#include <pthread.h>
+#include <list>
+
+using std::list;
+
+class LogSegmentWriter {
+ public:
+  LogSegmentWriter();
+  ~LogSegmentWriter();
+
+  LogSegmentWriter(const LogSegmentWriter& other) = delete;
+  LogSegmentWriter& operator=(const LogSegmentWriter& other) = delete;
+
+  /// @brief 打开第一个日志段，文件已存在时追加在原有内容之后，并启动后台线程。
+  /// 上次异常退出时遗留在文件末尾的预分配空间会先被截掉
+  /// @param path 日志文件名
+  /// @param segment_size 每次预分配的字节数
+  /// @param window_size 映射窗口的字节数，必须是页大小的整数倍
+  /// @return 成功返回 true
+  bool Open(const char* path, size_t segment_size = kDefaultSegmentSize,
+            size_t window_size = kDefaultWindowSize);
+
+  /// @brief 追加写入，只在窗口写满时才会有系统调用
+  /// @return 成功返回 true
+  bool Append(const char* data, size_t len);
+
+  /// @brief 切换到新的日志文件。后台线程已经准备好下一个日志段时只是交换指针，
+  /// 否则退化为同步创建。两种情况下 path 已经存在时都不覆盖，而是改用 path~N
+  /// @param path 新的日志文件名
+  /// @return 成功返回 true
+  bool Rotate(const char* path);
+
+  /// @brief 把已经写入的内容同步到磁盘
+  void Sync();
+
+  /// @brief 关闭日志段，把文件截断到实际写入的大小，并停止后台线程
+  void Close();
+
+  bool isOpen() const { return cur_.fd >= 0; }
+
+  // 当前日志段实际使用的文件名
+  const char* path() const { return cur_.path; }
+
+  /// @brief 设置后台压缩器，之后切换下来的日志段关闭后交给它压缩
+  /// 必须在 Open 之前设置，为 NULL 表示不压缩
+  void SetCompressor(LogCompressor* compressor) { compressor_ = compressor; }
+
+  static const size_t kDefaultSegmentSize = 64 << 20; // 64MB
+  static const size_t kDefaultWindowSize = 8 << 20; // 8MB
+  static const int kRetrySeconds = 1; // 预备日志段创建失败后的重试间隔
+
+ private:
+  // 一个日志段
+  struct Segment {
+    int fd; // 文件描述符，-1 表示未打开
+    char path[256]; // 文件名
+    char* window; // 映射窗口的起始地址
+    size_t window_off; // 窗口在文件中的偏移
+    size_t offset; // 下一个字节写入的位置，即实际写入的大小
+    size_t alloc; // 已经预分配的大小
+  };
+
+  // 交给后台线程的工作：关闭旧日志段，或者删掉预备日志段的临时文件名
+  struct Job {
+    Segment seg; // 需要关闭的日志段
+    bool unlink; // true 表示删除文件名 from，不关闭
+    char from[256];
+  };
+
+  // 打开（或创建）日志文件，预分配空间并映射第一个窗口
+  // no_replace 为 false 时追加到已有的文件；为 true 时与 LinkNoReplace 一样，
+  // path 已经存在就改用 path~N，实际的文件名记录在 seg->path 中
+  bool CreateSegment(Segment* seg, const char* path, bool no_replace);
+
+  // 文件中实际数据的结尾：跳过末尾预分配而没有写入的 0
+  // 读失败时停在已经确认过的位置，不会截掉没读到的内容
+  static size_t DataEnd(int fd, size_t size);
+
+  // 滑动映射窗口使其包含 seg->offset，需要时扩大预分配
+  bool SlideWindow(Segment* seg);
+
+  // 解除映射，把文件截断到实际写入的大小并关闭
+  void FinalizeSegment(Segment* seg);
+
+  // 关闭切换下来的日志段，有压缩器时交给它压缩
+  void RetireSegment(Segment* seg);
+
+  // 给 from 增加一个硬链接 to，to 已经存在时不覆盖而是改用 to~N
+  // 实际使用的名字写入 target，失败时返回 false
+  static bool LinkNoReplace(const char* from, const char* to, char* target,
+                            int size);
+
+  // 后台线程：处理关闭/删除文件名的工作，并准备下一个日志段
+  static void* Worker(void* arg);
+  void RunWorker();
+
+  Segment cur_; // 当前日志段，只有写日志的一方访问
+  Segment spare_; // 预备日志段，spare_ready_ 为 true 时可用
+  bool spare_ready_;
+  char spare_path_[256]; // 预备日志段使用的临时文件名
+  size_t segment_size_;
+  size_t window_size_;
+  LogCompressor* compressor_; // 切换下来的日志段交给它压缩，可以为 NULL
+
+  list<Job> jobs_; // 后台线程待处理的工作
+  bool stop_; // 通知后台线程退出
+  bool worker_started_;
+  pthread_t worker_tid_;
+  pthread_mutex_t lock_; // 保护 spare_, spare_ready_, jobs_, stop_
+  pthread_cond_t cond_;
+};
+
+#endif
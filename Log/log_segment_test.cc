@@ -0,0 +1,114 @@
+/*
+日志段异常退出后重新打开的测试
+子进程打开日志段、写入若干行后直接被 SIGKILL 杀掉，不调用 Close，
+文件末尾因此留着预分配而没有写入的 0。父进程随后重新打开同一个文件继续写，
+检查文件的内容正好是两次写入的日志，中间和末尾都没有 0。
+
+用法：log_segment_test [-d 目录]
+编译：g++ -O2 -o log_segment_test log_segment_test.cc log_segment.cc
+      log_compressor.cc -lpthread -lz
+*/
+
+#include "log_segment.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <string>
+
+using std::string;
+
+static const int kLines = 1000;
+
+// 第 i 行日志的内容
+static string Line(const char* tag, int i) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%s line %d\n", tag, i);
+  return buf;
+}
+
+// 写入 kLines 行，每行都是 tag 开头
+static bool WriteLines(LogSegmentWriter* w, const char* tag) {
+  for (int i = 0; i < kLines; ++i) {
+    string line = Line(tag, i);
+    if (!w->Append(line.data(), line.size())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  const char* dir = "/tmp";
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-d") == 0) {
+      dir = argv[i + 1];
+    }
+  }
+  char path[256];
+  snprintf(path, sizeof(path), "%s/log_segment_test.log", dir);
+  unlink(path);
+
+  // 子进程写完之后等着被杀掉
+  pid_t pid = fork();
+  if (pid == 0) {
+    LogSegmentWriter w;
+    if (!w.Open(path) || !WriteLines(&w, "before")) {
+      _exit(1);
+    }
+    kill(getpid(), SIGKILL);
+    pause();
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  if (!WIFSIGNALED(status)) {
+    fprintf(stderr, "child exited before being killed\n");
+    return 1;
+  }
+
+  struct stat st;
+  stat(path, &st);
+  printf("after kill: %lld bytes\n", (long long)st.st_size);
+
+  {
+    LogSegmentWriter w;
+    if (!w.Open(path) || !WriteLines(&w, "after")) {
+      fprintf(stderr, "reopen failed\n");
+      return 1;
+    }
+    w.Close();
+  }
+
+  string expect;
+  for (int i = 0; i < kLines; ++i) {
+    expect += Line("before", i);
+  }
+  for (int i = 0; i < kLines; ++i) {
+    expect += Line("after", i);
+  }
+
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) {
+    perror("open");
+    return 1;
+  }
+  string got;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    got.append(buf, n);
+  }
+  fclose(fp);
+  unlink(path);
+
+  if (got != expect) {
+    fprintf(stderr, "FAIL: expected %zu bytes, got %zu bytes\n",
+            expect.size(), got.size());
+    return 1;
+  }
+  printf("OK: %zu bytes\n", got.size());
+  return 0;
+}
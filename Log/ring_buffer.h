@@ -0,0 +1,247 @@
+/*
+有界多生产者/单消费者环形缓冲区：日志行直接格式化进预先分配好的定长字节槽位
+每个槽位带一个序号 seq，生产者通过 CAS 推进 tail_ 抢占槽位，写完后发布 seq；
+消费者只有一个，按序号检查一段连续的已提交槽位并一次性取走。
+热路径上没有锁，也没有堆内存分配。
+*/
+
+#ifndef LOG_RING_BUFFER_H
+#define LOG_RING_BUFFER_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <atomic>
+
+class LogRingBuffer {
+ public:
+  /// @brief 构造函数，预先分配所有槽位
+  /// @param capacity 槽位数量，向上取整为 2 的幂
+  /// @param slot_size 单个槽位的字节数，即单行日志的最大长度
+  LogRingBuffer(int capacity, int slot_size) {
+    if (capacity <= 0 || slot_size <= 0) {
+      exit(-1);
+    }
+
+    // 容量取 2 的幂，下标计算用 & mask_ 代替 %
+    capacity_ = 1;
+    while (capacity_ < (uint64_t)capacity) {
+      capacity_ <<= 1;
+    }
+    mask_ = capacity_ - 1;
+    slot_size_ = slot_size;
+
+    slots_ = new Slot[capacity_];
+    data_ = new char[capacity_ * slot_size_];
+    for (uint64_t i = 0; i < capacity_; ++i) {
+      // 槽位 i 在第 i 次写入时可用
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+      slots_[i].len = 0;
+    }
+    tail_.store(0, std::memory_order_relaxed);
+    head_.store(0, std::memory_order_relaxed);
+    consumer_waiting_.store(false, std::memory_order_relaxed);
+    producers_waiting_.store(0, std::memory_order_relaxed);
+
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&cond_, NULL);
+    pthread_cond_init(&not_full_, NULL);
+  }
+
+  ~LogRingBuffer() {
+    delete[] slots_;
+    delete[] data_;
+    pthread_mutex_destroy(&lock_);
+    pthread_cond_destroy(&cond_);
+    pthread_cond_destroy(&not_full_);
+  }
+
+  LogRingBuffer(const LogRingBuffer& other) = delete;
+  LogRingBuffer& operator=(const LogRingBuffer& other) = delete;
+
+  /// @brief 生产者预留一个槽位，之后直接往返回的地址里写日志
+  /// @param ticket 传出参数，提交时原样传回 Commit
+  /// @return 槽位的起始地址，队列满时返回 NULL
+  char* Reserve(uint64_t* ticket) {
+    uint64_t pos = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot* slot = &slots_[pos & mask_];
+      uint64_t seq = slot->seq.load(std::memory_order_acquire);
+      int64_t diff = (int64_t)seq - (int64_t)pos;
+      if (diff == 0) {
+        // 槽位空闲，尝试抢占
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          *ticket = pos;
+          return data_ + (pos & mask_) * slot_size_;
+        }
+      } else if (diff < 0) {
+        // 槽位还没被消费者释放，队列已满
+        return NULL;
+      } else {
+        // 被其他生产者抢先了，重新读取 tail_
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /// @brief 提交一个已经写好的槽位，使其对消费者可见
+  /// @param ticket Reserve 得到的序号
+  /// @param len 写入的字节数
+  void Commit(uint64_t ticket, int len) {
+    Slot* slot = &slots_[ticket & mask_];
+    slot->len = len;
+    slot->seq.store(ticket + 1, std::memory_order_release);
+
+    // 只有消费者正在睡眠时才去碰锁和条件变量
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (consumer_waiting_.load(std::memory_order_relaxed)) {
+      pthread_mutex_lock(&lock_);
+      pthread_cond_signal(&cond_);
+      pthread_mutex_unlock(&lock_);
+    }
+  }
+
+  /// @brief 消费者查看从读位置开始有多少个连续的已提交槽位
+  /// @param max 最多查看的槽位数
+  /// @return 可以连续读取的槽位数
+  int Readable(int max) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    int n = 0;
+    while (n < max) {
+      uint64_t pos = head + n;
+      if (slots_[pos & mask_].seq.load(std::memory_order_acquire) != pos + 1) {
+        break;
+      }
+      ++n;
+    }
+    return n;
+  }
+
+  /// @brief 取得第 i 个可读槽位的内容，i 必须小于 Readable 的返回值
+  /// @param i 相对读位置的偏移
+  /// @param len 传出参数，槽位中的字节数
+  /// @return 槽位的起始地址
+  const char* SlotAt(int i, int* len) const {
+    uint64_t pos = head_.load(std::memory_order_relaxed) + i;
+    *len = slots_[pos & mask_].len;
+    return data_ + (pos & mask_) * slot_size_;
+  }
+
+  /// @brief 消费者释放读位置开始的 n 个槽位，交还给生产者复用
+  void Release(int n) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    for (int i = 0; i < n; ++i) {
+      uint64_t pos = head + i;
+      slots_[pos & mask_].seq.store(pos + capacity_,
+                                    std::memory_order_release);
+    }
+    head_.store(head + n, std::memory_order_relaxed);
+
+    // 只有生产者在等待空槽位时才去碰锁和条件变量
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (producers_waiting_.load(std::memory_order_relaxed) > 0) {
+      pthread_mutex_lock(&lock_);
+      pthread_cond_broadcast(&not_full_);
+      pthread_mutex_unlock(&lock_);
+    }
+  }
+
+  /// @brief 消费者在没有可读槽位时等待，最多等待 ms_timeout 毫秒
+  /// @return 等待结束时有可读槽位返回 true
+  bool WaitReadable(int ms_timeout) {
+    pthread_mutex_lock(&lock_);
+    consumer_waiting_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (Readable(1) == 0) {
+      struct timespec t = Deadline(ms_timeout);
+      pthread_cond_timedwait(&cond_, &lock_, &t);
+    }
+    consumer_waiting_.store(false, std::memory_order_relaxed);
+    pthread_mutex_unlock(&lock_);
+    return Readable(1) > 0;
+  }
+
+  /// @brief 唤醒正在等待的消费者，例如通知它退出
+  void WakeConsumer() {
+    pthread_mutex_lock(&lock_);
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  /// @brief 生产者在队列满时等待消费者释放槽位，最多等待到 deadline
+  /// @param deadline 绝对时间（CLOCK_REALTIME）
+  /// @return 等待结束时有空槽位返回 true
+  bool WaitWritable(const struct timespec& deadline) {
+    pthread_mutex_lock(&lock_);
+    producers_waiting_.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (isFull()) {
+      pthread_cond_timedwait(&not_full_, &lock_, &deadline);
+    }
+    producers_waiting_.fetch_sub(1, std::memory_order_relaxed);
+    pthread_mutex_unlock(&lock_);
+    return !isFull();
+  }
+
+  /// @brief 计算 ms_timeout 毫秒之后的绝对时间
+  static struct timespec Deadline(int ms_timeout) {
+    struct timeval now = {0, 0};
+    gettimeofday(&now, NULL);
+    long long ns = (long long)now.tv_usec * 1000 +
+                   (long long)(ms_timeout % 1000) * 1000000;
+    struct timespec t = {0, 0};
+    t.tv_sec = now.tv_sec + ms_timeout / 1000 + ns / 1000000000;
+    t.tv_nsec = ns % 1000000000;
+    return t;
+  }
+
+  // 一些常用接口，结果只是一个瞬时值
+
+  bool isFull() const {
+    uint64_t pos = tail_.load(std::memory_order_relaxed);
+    return slots_[pos & mask_].seq.load(std::memory_order_acquire) != pos;
+  }
+
+  bool isEmpty() const {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    return slots_[head & mask_].seq.load(std::memory_order_acquire) !=
+           head + 1;
+  }
+
+  // 已被占用的槽位数（包括正在写入的），生产者可以用来判断水位
+  int Size() const {
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    return tail > head ? (int)(tail - head) : 0;
+  }
+
+  int capacity() const { return (int)capacity_; }
+
+  int slot_size() const { return slot_size_; }
+
+ private:
+  // 每个槽位独占一个缓存行，避免生产者之间的伪共享
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> seq; // 槽位序号，等于 pos 可写，等于 pos + 1 可读
+    int len; // 槽位中日志的字节数
+  };
+
+  Slot* slots_; // 槽位头数组
+  char* data_; // 所有槽位的数据区，capacity_ * slot_size_ 字节
+  uint64_t capacity_; // 槽位数量，2 的幂
+  uint64_t mask_; // capacity_ - 1
+  int slot_size_; // 单个槽位的字节数
+
+  alignas(64) std::atomic<uint64_t> tail_; // 生产者写位置
+  alignas(64) std::atomic<uint64_t> head_; // 消费者读位置，只有消费者线程修改
+  std::atomic<bool> consumer_waiting_; // 消费者是否正在睡眠
+  std::atomic<int> producers_waiting_; // 正在等待空槽位的生产者数量
+
+  pthread_mutex_t lock_; // 只用于睡眠/唤醒
+  pthread_cond_t cond_; // 唤醒消费者
+  pthread_cond_t not_full_; // 唤醒等待空槽位的生产者
+};
+
+#endif
@@ -0,0 +1,242 @@
+/*
+结构化（key=value）日志的编码
+LOG_INFO_KV("req", "user", uid, "lat_us", lat) 这样的调用直接编码进线程的单行缓冲区，
+输出 JSON lines 或 logfmt，整个过程没有 std::string 临时对象，也没有堆内存分配。
+每个值的编码方式在编译期由参数类型决定，整数不经过 printf。
+*/
+
+#ifndef LOG_STRUCTURED_H
+#define LOG_STRUCTURED_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <cmath>
+#include <string>
+#include <type_traits>
+
+// 结构化日志的输出格式
+enum LogKVFormat {
+  kLogKVLogfmt = 0, // 普通日志前缀 + msg=... key=value ...，日志行仍以时间戳开头
+  kLogKVJson, // 每行一个 JSON 对象 {"ts":...,"level":...,"msg":...,"key":value}
+};
+
+// 向定长缓冲区追加结构化日志的内容，空间不够时截断，不会越界
+// 截断后 full() 为 true，调用者用 Rollback 退回到上一个完整的字段，
+// 这样输出中不会出现半个值（例如缺少结尾引号的字符串）
+class LogKVWriter {
+ public:
+  /// @param buf 缓冲区
+  /// @param size 可以使用的字节数
+  /// @param format 输出格式
+  LogKVWriter(char* buf, int size, LogKVFormat format)
+      : buf_(buf), p_(buf), end_(buf + size), format_(format), full_(false) {}
+
+  LogKVFormat format() const { return format_; }
+
+  // 是否有内容因为空间不够被截断
+  bool full() const { return full_; }
+
+  // 丢弃 mark 之后写入的内容，mark 取自之前的 cursor()
+  // full() 保持为 true，之后的键值对不再写入，保证输出的字段顺序不变
+  void Rollback(char* mark) { p_ = mark; }
+
+  // 已经写入的字节数
+  int length() const { return p_ - buf_; }
+
+  // 跳过调用者直接写入缓冲区的 n 个字节
+  void Skip(int n) {
+    if (p_ + n > end_) {
+      full_ = true;
+      n = end_ - p_;
+    }
+    p_ += n;
+  }
+
+  // 剩余的空间，供调用者直接写入
+  char* cursor() const { return p_; }
+  int room() const { return end_ - p_; }
+
+  // 原样追加
+  void Raw(const char* s, size_t n) {
+    if (n > (size_t)(end_ - p_)) {
+      full_ = true;
+      n = end_ - p_;
+    }
+    memcpy(p_, s, n);
+    p_ += n;
+  }
+
+  void Raw(const char* s) { Raw(s, strlen(s)); }
+
+  void Char(char c) {
+    if (p_ < end_) {
+      *p_++ = c;
+    } else {
+      full_ = true;
+    }
+  }
+
+  // 一个键值对的键，JSON 中前面补逗号
+  void Key(const char* key) {
+    if (format_ == kLogKVJson) {
+      Char(',');
+      String(key, strlen(key));
+      Char(':');
+    } else {
+      Char(' ');
+      Raw(key);
+      Char('=');
+    }
+  }
+
+  // 字符串值：JSON 总是加引号并转义；logfmt 只在含有空格、'='、'"'
+  // 或控制字符时才加引号
+  void String(const char* s, size_t n) {
+    bool quote = format_ == kLogKVJson || n == 0;
+    for (size_t i = 0; !quote && i < n; ++i) {
+      unsigned char c = s[i];
+      quote = c <= ' ' || c == '=' || c == '"' || c == 0x7f;
+    }
+    if (!quote) {
+      Raw(s, n);
+      return;
+    }
+    Char('"');
+    for (size_t i = 0; i < n; ++i) {
+      unsigned char c = s[i];
+      if (c == '"' || c == '\\') {
+        Char('\\');
+        Char(c);
+      } else if (c == '\n') {
+        Raw("\\n", 2);
+      } else if (c == '\r') {
+        Raw("\\r", 2);
+      } else if (c == '\t') {
+        Raw("\\t", 2);
+      } else if (c < 0x20) {
+        char esc[8];
+        snprintf(esc, sizeof(esc), "\\u%04x", c);
+        Raw(esc, 6);
+      } else {
+        Char(c);
+      }
+    }
+    Char('"');
+  }
+
+  void Int(long long v) {
+    unsigned long long u = v;
+    if (v < 0) {
+      Char('-');
+      u = 0 - u;
+    }
+    UInt(u);
+  }
+
+  void UInt(unsigned long long v) {
+    char digits[20];
+    int n = 0;
+    do {
+      digits[n++] = '0' + v % 10;
+      v /= 10;
+    } while (v != 0);
+    while (n > 0) {
+      Char(digits[--n]);
+    }
+  }
+
+  void Double(double v) {
+    // JSON 不能表示 NaN 和无穷大
+    if (format_ == kLogKVJson && !std::isfinite(v)) {
+      Raw("null", 4);
+      return;
+    }
+    char tmp[32];
+    int n = snprintf(tmp, sizeof(tmp), "%.15g", v);
+    Raw(tmp, n);
+  }
+
+  void Bool(bool v) {
+    if (v) {
+      Raw("true", 4);
+    } else {
+      Raw("false", 5);
+    }
+  }
+
+ private:
+  char* buf_;
+  char* p_; // 下一个字节写入的位置
+  char* end_;
+  LogKVFormat format_;
+  bool full_; // 有内容被截断
+};
+
+// 按值的类型选择编码方式，不支持的类型在编译期报错
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value &&
+                               std::is_signed<T>::value>::type
+LogPutValue(LogKVWriter* w, T v) {
+  w->Int(v);
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value &&
+                               std::is_unsigned<T>::value>::type
+LogPutValue(LogKVWriter* w, T v) {
+  w->UInt(v);
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_enum<T>::value>::type
+LogPutValue(LogKVWriter* w, T v) {
+  w->Int((long long)v);
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_floating_point<T>::value>::type
+LogPutValue(LogKVWriter* w, T v) {
+  w->Double(v);
+}
+
+inline void LogPutValue(LogKVWriter* w, bool v) { w->Bool(v); }
+
+// char 按单个字符的字符串处理
+inline void LogPutValue(LogKVWriter* w, char v) { w->String(&v, 1); }
+
+inline void LogPutValue(LogKVWriter* w, const char* v) {
+  if (v == NULL) {
+    w->Raw(w->format() == kLogKVJson ? "null" : "(null)");
+    return;
+  }
+  w->String(v, strlen(v));
+}
+
+// 直接引用 std::string 的内容，不产生拷贝
+inline void LogPutValue(LogKVWriter* w, const std::string& v) {
+  w->String(v.data(), v.size());
+}
+
+// 依次编码所有键值对，键必须是字符串
+// 放不下的键值对整个丢弃，它和之后的键值对都不再输出
+inline void LogPutKV(LogKVWriter*) {}
+
+template <typename V, typename... Rest>
+inline void LogPutKV(LogKVWriter* w, const char* key, const V& value,
+                     const Rest&... rest) {
+  if (w->full()) {
+    return;
+  }
+  char* mark = w->cursor();
+  w->Key(key);
+  LogPutValue(w, value);
+  if (w->full()) {
+    w->Rollback(mark);
+    return;
+  }
+  LogPutKV(w, rest...);
+}
+
+#endif
@@ -0,0 +1,115 @@
+/*
+每秒刷新一次的日志时间前缀缓存
+缓存预先格式化好的 "YYYY-MM-DD HH:MM:SS"，同一秒内的所有日志行只需拷贝这 19 个字节，
+再补上微秒字段即可，不用每行都调用 localtime（会拿 glibc 的锁，还可能 stat 时区文件）
+读者通过序号 seq_ 判断读到的内容是否完整（seqlock），整个读过程不加锁
+*/
+
+#ifndef LOG_TIME_CACHE_H
+#define LOG_TIME_CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+
+// 时间前缀的长度 "YYYY-MM-DD HH:MM:SS"
+#define LOG_TIME_PREFIX_LEN 19
+
+class LogTimeCache {
+ public:
+  LogTimeCache() {
+    seq_.store(0, std::memory_order_relaxed);
+    sec_.store(-1, std::memory_order_relaxed);
+    mday_.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < kWords; ++i) {
+      words_[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  LogTimeCache(const LogTimeCache& other) = delete;
+  LogTimeCache& operator=(const LogTimeCache& other) = delete;
+
+  /// @brief 取得 sec 这一秒对应的时间前缀，缓存过期时顺便刷新缓存
+  /// @param sec 秒级时间戳
+  /// @param prefix 传出参数，至少 LOG_TIME_PREFIX_LEN 字节，不写 '\0'
+  /// @return 这一秒是当月的第几天，用于判断日期是否变化
+  int Get(time_t sec, char* prefix) {
+    uint64_t words[kWords];
+    for (;;) {
+      uint32_t seq = seq_.load(std::memory_order_acquire);
+      // 有线程正在刷新，或者缓存的不是这一秒
+      if ((seq & 1) || sec_.load(std::memory_order_relaxed) != (int64_t)sec) {
+        return Refresh(sec, prefix);
+      }
+      for (int i = 0; i < kWords; ++i) {
+        words[i] = words_[i].load(std::memory_order_relaxed);
+      }
+      int mday = mday_.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      // 读的过程中没有被刷新过，内容是完整的
+      if (seq_.load(std::memory_order_relaxed) == seq) {
+        memcpy(prefix, words, LOG_TIME_PREFIX_LEN);
+        return mday;
+      }
+    }
+  }
+
+  /// @brief 取得当前时间，使用 vDSO 实现的 clock_gettime，不陷入内核
+  static void Now(struct timespec* ts) {
+    clock_gettime(CLOCK_REALTIME, ts);
+  }
+
+  /// @brief 把时间前缀中的日期转换成日志文件名使用的 "YYYY_MM_DD_" 形式
+  /// @param prefix Get 得到的时间前缀
+  /// @param date 传出参数，至少 12 字节
+  static void FileDate(const char* prefix, char* date) {
+    memcpy(date, prefix, 10);
+    date[4] = '_';
+    date[7] = '_';
+    date[10] = '_';
+    date[11] = '\0';
+  }
+
+ private:
+  // 在本线程内用 localtime_r 计算前缀，如果 sec 比缓存新则发布到缓存
+  int Refresh(time_t sec, char* prefix) {
+    struct tm my_tm;
+    localtime_r(&sec, &my_tm);
+    // 按每个 int 字段最长 11 个字符留出空间，正常时间只用到前 kWords * 8 字节
+    char buf[kWords * 8 + 48] = {0};
+    snprintf(buf, sizeof(buf), "%04d-%02d-%02d %02d:%02d:%02d",
+             my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday,
+             my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec);
+    memcpy(prefix, buf, LOG_TIME_PREFIX_LEN);
+
+    // 只有抢到刷新权（seq_ 从偶数变为奇数）且时间前进了才更新缓存，
+    // 抢不到的线程直接使用自己算出的结果，不必等待
+    uint32_t seq = seq_.load(std::memory_order_relaxed);
+    if ((seq & 1) == 0 && sec_.load(std::memory_order_relaxed) < (int64_t)sec &&
+        seq_.compare_exchange_strong(seq, seq + 1,
+                                     std::memory_order_relaxed)) {
+      // 保证读者先看到奇数序号，再看到被修改的内容
+      std::atomic_thread_fence(std::memory_order_release);
+      uint64_t words[kWords];
+      memcpy(words, buf, sizeof(words));
+      for (int i = 0; i < kWords; ++i) {
+        words_[i].store(words[i], std::memory_order_relaxed);
+      }
+      mday_.store(my_tm.tm_mday, std::memory_order_relaxed);
+      sec_.store(sec, std::memory_order_relaxed);
+      seq_.store(seq + 2, std::memory_order_release);
+    }
+    return my_tm.tm_mday;
+  }
+
+  static const int kWords = 3; // 前缀按 8 字节一组存放
+
+  std::atomic<uint32_t> seq_; // 奇数表示正在刷新
+  std::atomic<int64_t> sec_; // 缓存对应的秒
+  std::atomic<int> mday_; // 缓存对应的当月第几天
+  std::atomic<uint64_t> words_[kWords]; // 预先格式化好的前缀
+};
+
+#endif
@@ -72,19 +72,50 @@ MYSQL* ConnectionPool::GetOneConnection() {
   return connection;
 }
 
+MYSQL* ConnectionPool::GetOneConnectionAsync(void (*cb)(MYSQL*, void*),
+                                             void* arg) {
+  MYSQL* connection = NULL;
+
+  pthread_mutex_lock(&lock_);
+  // 信号量在锁内增加，这里拿不到说明锁内看到的空闲连接都已经有人要了
+  if (sem_trywait(&sem_) == 0) {
+    connection = connection_list_.front();
+    connection_list_.pop_front();
+
+    --free_connection_;
+    ++cur_connection_;
+  } else {
+    waiter_list_.push_back(std::make_pair(cb, arg));
+  }
+
+  pthread_mutex_unlock(&lock_);
+  return connection;
+}
+
 // 将这个无线程使用的连接添加会连接池中
+// 有异步等待的回调时直接把连接交给最早的一个
 bool ConnectionPool::ReleaseOneConnection(MYSQL* connection) {
   if (NULL == connection)
     return false;
 
   pthread_mutex_lock(&lock_);
 
+  if (!waiter_list_.empty()) {
+    std::pair<void (*)(MYSQL*, void*), void*> waiter = waiter_list_.front();
+    waiter_list_.pop_front();
+    pthread_mutex_unlock(&lock_);
+    waiter.first(connection, waiter.second);
+    return true;
+  }
+
   connection_list_.push_back(connection);
   ++free_connection_;
   --cur_connection_;
 
-  pthread_mutex_unlock(&lock_);
+  // 在锁内增加信号量，保证 GetOneConnectionAsync 在锁内看到的连接数和信号量一致
   sem_post(&sem_);
+  pthread_mutex_unlock(&lock_);
+  return true;
 }
 
 void ConnectionPool::DestroyPool() {
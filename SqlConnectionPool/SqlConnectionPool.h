@@ -7,6 +7,7 @@
 #include <string.h>
 #include <iostream>
 #include <list>
+#include <utility>
 
 using  std::list;
 using  std::string;
@@ -22,6 +23,14 @@ class ConnectionPool {
   /// @return 返回一个数据库连接对象
   MYSQL* GetOneConnection();
 
+  /// @brief 不阻塞地获得一个数据库连接
+  /// 有空闲连接时直接返回；没有时登记回调并返回 NULL，之后有连接被放回时
+  /// 在放回连接的线程中调用 cb(连接, arg)，连接直接交给回调，不再放回链表
+  /// @param cb 取得连接后的回调，不能阻塞
+  /// @param arg 回调的参数
+  /// @return 立即取得的连接，需要等待时返回 NULL
+  MYSQL* GetOneConnectionAsync(void (*cb)(MYSQL*, void*), void* arg);
+
   /// @brief 将某个数据库连接重新放回连接池中并修改连接池
   /// @param connection 需要放回连接池中的数据库连接 
   /// @return 成功返回 true
@@ -65,6 +74,8 @@ class ConnectionPool {
   pthread_mutex_t lock_; // 用于保护链表的锁
   sem_t sem_; // 表示连接池中可用连接的数量
   list<MYSQL*> connection_list_; // 用于描述连接池的链表
+  // 等待连接的回调，放回连接时优先交给它们
+  list<std::pair<void (*)(MYSQL*, void*), void*> > waiter_list_;
 };
 
 /// @brief 对数据库连接池的一层封装，用于自动管理连接池对象
@@ -0,0 +1,554 @@
+/*
+建立在 ThreadPool 上的 C++20 协程：
+Task<T> 是惰性启动的协程，co_await 时在当前线程开始执行，结束时直接切换回等待者；
+co_await pool.Schedule() 切换到线程池的线程，co_await WhenAll(...) 等待多个 Task，
+co_await timer.Sleep(pool, ms) 和 co_await AcquireConnection(pool, conn_pool)
+在等待时不占用线程，到期或取得连接后放入线程池恢复。
+恢复协程只是把一个捕获协程句柄的任务放入队列，不分配内存。
+需要以 -std=c++20 编译，低版本的标准下这个头文件为空。
+*/
+
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#if __cplusplus >= 202002L
+
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <queue>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "ThreadPool.h"
+
+template<typename T = void>
+class Task;
+
+namespace coro_detail {
+
+// 在线程池中恢复协程，线程池已经关闭时在当前线程恢复
+inline void ResumeOn(ThreadPool* pool, std::coroutine_handle<> h) {
+  if (pool->Post([h]() mutable { h.resume(); }) != 0) {
+    h.resume();
+  }
+}
+
+// Task 结束时切换回等待它的协程，没有等待者时回到 resume 的调用者
+struct FinalAwaiter {
+  bool await_ready() const noexcept { return false; }
+
+  template<typename Promise>
+  std::coroutine_handle<> await_suspend(
+      std::coroutine_handle<Promise> h) noexcept {
+    std::coroutine_handle<> next = h.promise().continuation;
+    return next ? next : std::noop_coroutine();
+  }
+
+  void await_resume() const noexcept {}
+};
+
+class PromiseBase {
+ public:
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+  FinalAwaiter final_suspend() const noexcept { return {}; }
+  void unhandled_exception() { error_ = std::current_exception(); }
+
+  std::coroutine_handle<> continuation;
+
+ protected:
+  void Rethrow() const {
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+
+ private:
+  std::exception_ptr error_;
+};
+
+template<typename T>
+class Promise : public PromiseBase {
+ public:
+  Task<T> get_return_object();
+
+  template<typename U>
+  void return_value(U&& value) {
+    value_.emplace(std::forward<U>(value));
+  }
+
+  T Result() {
+    Rethrow();
+    return std::move(*value_);
+  }
+
+ private:
+  std::optional<T> value_;
+};
+
+template<>
+class Promise<void> : public PromiseBase {
+ public:
+  Task<void> get_return_object();
+  void return_void() const {}
+  void Result() const { Rethrow(); }
+};
+
+// 启动 Task 并等待它结束，不取结果
+template<typename T>
+struct JoinAwaiter {
+  bool await_ready() const noexcept { return !h || h.done(); }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiter) {
+    h.promise().continuation = waiter;
+    return h;
+  }
+
+  void await_resume() const noexcept {}
+
+  std::coroutine_handle<Promise<T> > h;
+};
+
+}  // namespace coro_detail
+
+/// @brief 返回 T 的协程，创建后不执行，co_await 时才开始
+/// 协程中抛出的异常在 co_await 处重新抛出
+template<typename T>
+class [[nodiscard]] Task {
+ public:
+  typedef coro_detail::Promise<T> promise_type;
+  typedef std::coroutine_handle<promise_type> Handle;
+
+  Task() : h_(nullptr) {}
+  explicit Task(Handle h) : h_(h) {}
+  Task(Task&& other) noexcept : h_(other.h_) { other.h_ = nullptr; }
+  Task& operator=(Task&& other) noexcept {
+    if (this != &other) {
+      if (h_) {
+        h_.destroy();
+      }
+      h_ = other.h_;
+      other.h_ = nullptr;
+    }
+    return *this;
+  }
+  Task(const Task& other) = delete;
+  Task& operator=(const Task& other) = delete;
+
+  ~Task() {
+    if (h_) {
+      h_.destroy();
+    }
+  }
+
+  bool Done() const { return !h_ || h_.done(); }
+
+  // 执行结束后取得结果，T 被移动出来，只能调用一次
+  T Result() { return h_.promise().Result(); }
+
+  // 内部使用：等待结束但不取结果
+  coro_detail::JoinAwaiter<T> Join() const {
+    return coro_detail::JoinAwaiter<T>{h_};
+  }
+
+  struct Awaiter : coro_detail::JoinAwaiter<T> {
+    T await_resume() { return this->h.promise().Result(); }
+  };
+
+  Awaiter operator co_await() const noexcept { return Awaiter{{h_}}; }
+
+ private:
+  Handle h_;
+};
+
+namespace coro_detail {
+
+template<typename T>
+Task<T> Promise<T>::get_return_object() {
+  return Task<T>(std::coroutine_handle<Promise<T> >::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+  return Task<void>(std::coroutine_handle<Promise<void> >::from_promise(*this));
+}
+
+// 执行完自行销毁的协程，用于 Spawn
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() const { return {}; }
+    std::suspend_never initial_suspend() const noexcept { return {}; }
+    std::suspend_never final_suspend() const noexcept { return {}; }
+    void return_void() const {}
+    // 与 Post 一样，脱离的任务中的异常不会被捕获
+    void unhandled_exception() const { std::terminate(); }
+  };
+};
+
+// 创建时不执行的协程，由 WhenAll 在挂起等待者之后统一启动，执行完自行销毁
+class Starter {
+ public:
+  struct promise_type {
+    Starter get_return_object() {
+      return Starter(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    std::suspend_never final_suspend() const noexcept { return {}; }
+    void return_void() const {}
+    void unhandled_exception() const { std::terminate(); }
+  };
+
+  explicit Starter(std::coroutine_handle<promise_type> h) : h_(h) {}
+  Starter(Starter&& other) noexcept : h_(other.h_) { other.h_ = nullptr; }
+  Starter(const Starter& other) = delete;
+  Starter& operator=(const Starter& other) = delete;
+
+  ~Starter() {
+    if (h_) {
+      h_.destroy();
+    }
+  }
+
+  void Start() {
+    std::coroutine_handle<promise_type> h = h_;
+    h_ = nullptr;
+    h.resume();
+  }
+
+ private:
+  std::coroutine_handle<promise_type> h_;
+};
+
+// WhenAll 的计数：每个子任务结束减一，等待者挂起之后再减一，减到 0 的一方恢复等待者
+class Latch {
+ public:
+  explicit Latch(int n) : count_(n + 1) {}
+
+  void Arrive() {
+    if (count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      waiter_.resume();
+    }
+  }
+
+  // 挂起等待者，然后启动所有子任务
+  class Awaiter {
+   public:
+    Awaiter(Latch* latch, Starter* starters, size_t n)
+        : latch_(latch), starters_(starters), n_(n) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> waiter) {
+      Latch* latch = latch_;
+      latch->waiter_ = waiter;
+      for (size_t i = 0; i < n_; ++i) {
+        starters_[i].Start();
+      }
+      return latch->count_.fetch_sub(1, std::memory_order_acq_rel) != 1;
+    }
+
+    void await_resume() const noexcept {}
+
+   private:
+    Latch* latch_;
+    Starter* starters_;
+    size_t n_;
+  };
+
+  Awaiter Start(Starter* starters, size_t n) {
+    return Awaiter(this, starters, n);
+  }
+
+ private:
+  std::atomic<int> count_;
+  std::coroutine_handle<> waiter_;
+};
+
+template<typename T>
+Starter RunChild(const Task<T>& task, Latch* latch) {
+  co_await task.Join();
+  latch->Arrive();
+}
+
+// SyncWait 的完成标志，直接使用 futex
+// 等待者看到完成后可能立即销毁 Event，所以 Set 在写入之后不再读取任何成员，
+// 总是调用一次 FUTEX_WAKE（只用到地址，地址已经失效时内核找不到等待者）
+class Event {
+ public:
+  Event() : done_(0) {}
+
+  void Set() {
+    uint32_t* word = (uint32_t*)&done_;
+    done_.store(1, std::memory_order_release);
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+  }
+
+  void Wait() {
+    while (done_.load(std::memory_order_acquire) == 0) {
+      syscall(SYS_futex, (uint32_t*)&done_, FUTEX_WAIT_PRIVATE, 0, NULL, NULL,
+              0);
+    }
+  }
+
+ private:
+  std::atomic<uint32_t> done_; // futex 的等待字
+};
+
+template<typename T>
+Detached RunAndSet(const Task<T>& task, Event* done) {
+  co_await task.Join();
+  done->Set();
+}
+
+inline Detached RunOn(ThreadPool* pool, Task<void> task) {
+  co_await pool->Schedule();
+  co_await task;
+}
+
+}  // namespace coro_detail
+
+/// @brief 在当前线程启动 task 并阻塞等待它结束，用于从普通函数进入协程
+/// 不要在线程池的工作线程中调用，否则等待期间这个线程不能执行其他任务
+/// @return task 的结果，task 抛出的异常在这里重新抛出
+template<typename T>
+T SyncWait(Task<T> task) {
+  coro_detail::Event done;
+  coro_detail::RunAndSet(task, &done);
+  done.Wait();
+  return task.Result();
+}
+
+/// @brief 把 task 放入线程池执行，不等待结果
+/// task 中没有被捕获的异常会终止进程，与 Post 一样
+inline void Spawn(ThreadPool& pool, Task<void> task) {
+  coro_detail::RunOn(&pool, std::move(task));
+}
+
+/// @brief 同时启动多个 Task，全部结束后返回各自的结果
+/// 子任务在当前线程依次启动，遇到第一个挂起点（例如 co_await pool.Schedule()）
+/// 后启动下一个；有子任务抛出异常时重新抛出第一个（按参数顺序）
+template<typename... Ts>
+Task<std::tuple<Ts...> > WhenAll(Task<Ts>... tasks) {
+  coro_detail::Latch latch(sizeof...(Ts));
+  coro_detail::Starter starters[] = {coro_detail::RunChild(tasks, &latch)...};
+  co_await latch.Start(starters, sizeof...(Ts));
+  co_return std::tuple<Ts...>{tasks.Result()...};
+}
+
+/// @brief 数量不定的 WhenAll，结果按 tasks 的顺序排列
+template<typename T>
+Task<std::vector<T> > WhenAll(std::vector<Task<T> > tasks) {
+  coro_detail::Latch latch(tasks.size());
+  std::vector<coro_detail::Starter> starters;
+  starters.reserve(tasks.size());
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    starters.push_back(coro_detail::RunChild(tasks[i], &latch));
+  }
+  co_await latch.Start(starters.data(), starters.size());
+  std::vector<T> results;
+  results.reserve(tasks.size());
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    results.push_back(tasks[i].Result());
+  }
+  co_return results;
+}
+
+inline Task<void> WhenAll(std::vector<Task<void> > tasks) {
+  coro_detail::Latch latch(tasks.size());
+  std::vector<coro_detail::Starter> starters;
+  starters.reserve(tasks.size());
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    starters.push_back(coro_detail::RunChild(tasks[i], &latch));
+  }
+  co_await latch.Start(starters.data(), starters.size());
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    tasks[i].Result();
+  }
+}
+
+// 协程的定时器：一个线程按到期时间排序等待，到期后把协程放入线程池恢复
+class SleepTimer {
+ public:
+  SleepTimer() : running_(true) {
+    pthread_mutex_init(&lock_, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond_, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&thread_, NULL, Loop, this) != 0) {
+      perror("pthread_create");
+      exit(-1);
+    }
+  }
+
+  // 还没有到期的协程提前恢复
+  ~SleepTimer() {
+    pthread_mutex_lock(&lock_);
+    running_ = false;
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&lock_);
+    pthread_join(thread_, NULL);
+    while (!sleepers_.empty()) {
+      Sleeper s = sleepers_.top();
+      sleepers_.pop();
+      coro_detail::ResumeOn(s.pool, s.h);
+    }
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&lock_);
+  }
+
+  SleepTimer(const SleepTimer& other) = delete;
+  SleepTimer& operator=(const SleepTimer& other) = delete;
+
+  class Awaiter {
+   public:
+    Awaiter(SleepTimer* timer, ThreadPool* pool, int ms)
+        : timer_(timer), pool_(pool), ms_(ms) {}
+
+    bool await_ready() const { return ms_ <= 0; }
+
+    void await_suspend(std::coroutine_handle<> h) {
+      timer_->Add(pool_, h, ms_);
+    }
+
+    void await_resume() const {}
+
+   private:
+    SleepTimer* timer_;
+    ThreadPool* pool_;
+    int ms_;
+  };
+
+  /// @brief co_await timer.Sleep(pool, ms) 挂起 ms 毫秒，之后在 pool 中继续执行
+  Awaiter Sleep(ThreadPool& pool, int ms) { return Awaiter(this, &pool, ms); }
+
+ private:
+  struct Sleeper {
+    long long deadline_ns;
+    ThreadPool* pool;
+    std::coroutine_handle<> h;
+
+    // priority_queue 是大顶堆，到期早的排在前面
+    bool operator<(const Sleeper& other) const {
+      return deadline_ns > other.deadline_ns;
+    }
+  };
+
+  static long long NowNs() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long long)t.tv_sec * 1000000000 + t.tv_nsec;
+  }
+
+  void Add(ThreadPool* pool, std::coroutine_handle<> h, int ms) {
+    Sleeper s = {NowNs() + (long long)ms * 1000000, pool, h};
+    pthread_mutex_lock(&lock_);
+    bool earliest = sleepers_.empty() ||
+                    s.deadline_ns < sleepers_.top().deadline_ns;
+    sleepers_.push(s);
+    // 只有最早到期的时间变了才需要叫醒定时器线程
+    if (earliest) {
+      pthread_cond_signal(&cond_);
+    }
+    pthread_mutex_unlock(&lock_);
+  }
+
+  static void* Loop(void* arg) {
+    SleepTimer* self = (SleepTimer*)arg;
+    std::vector<Sleeper> due;
+    pthread_mutex_lock(&self->lock_);
+    while (self->running_) {
+      if (self->sleepers_.empty()) {
+        pthread_cond_wait(&self->cond_, &self->lock_);
+        continue;
+      }
+      long long now = NowNs();
+      while (!self->sleepers_.empty() &&
+             self->sleepers_.top().deadline_ns <= now) {
+        due.push_back(self->sleepers_.top());
+        self->sleepers_.pop();
+      }
+      if (!due.empty()) {
+        // 放入线程池时可能因为队列满而等待，不持有锁
+        pthread_mutex_unlock(&self->lock_);
+        for (size_t i = 0; i < due.size(); ++i) {
+          coro_detail::ResumeOn(due[i].pool, due[i].h);
+        }
+        due.clear();
+        pthread_mutex_lock(&self->lock_);
+        continue;
+      }
+      long long deadline = self->sleepers_.top().deadline_ns;
+      struct timespec t;
+      t.tv_sec = deadline / 1000000000;
+      t.tv_nsec = deadline % 1000000000;
+      pthread_cond_timedwait(&self->cond_, &self->lock_, &t);
+    }
+    pthread_mutex_unlock(&self->lock_);
+    return NULL;
+  }
+
+  pthread_t thread_;
+  pthread_mutex_t lock_;
+  pthread_cond_t cond_;
+  bool running_;
+  std::priority_queue<Sleeper> sleepers_;
+};
+
+// 从连接池取得连接的等待对象，见 AcquireConnection
+template<typename Pool>
+class AcquireAwaiter {
+ public:
+  typedef decltype(std::declval<Pool*>()->GetOneConnection()) Connection;
+
+  AcquireAwaiter(ThreadPool* pool, Pool* conn_pool)
+      : pool_(pool), conn_pool_(conn_pool), connection_() {}
+
+  bool await_ready() const { return false; }
+
+  // 登记之后回调随时可能在其他线程恢复协程，不能再访问 this
+  bool await_suspend(std::coroutine_handle<> h) {
+    h_ = h;
+    Connection connection = conn_pool_->GetOneConnectionAsync(Wake, this);
+    if (!connection) {
+      return true;
+    }
+    connection_ = connection;
+    return false;
+  }
+
+  Connection await_resume() const { return connection_; }
+
+ private:
+  // 在放回连接的线程中调用，只把协程放入线程池
+  static void Wake(Connection connection, void* arg) {
+    AcquireAwaiter* self = (AcquireAwaiter*)arg;
+    self->connection_ = connection;
+    coro_detail::ResumeOn(self->pool_, self->h_);
+  }
+
+  ThreadPool* pool_;
+  Pool* conn_pool_;
+  Connection connection_;
+  std::coroutine_handle<> h_;
+};
+
+/// @brief co_await AcquireConnection(pool, ConnectionPool::GetInstance())
+/// 取得一个数据库连接，没有空闲连接时挂起，有连接放回时在 pool 中继续执行
+/// 用完后与 GetOneConnection 取得的连接一样调用 ReleaseOneConnection 放回
+/// @param conn_pool 提供 GetOneConnectionAsync(cb, arg) 的连接池
+template<typename Pool>
+AcquireAwaiter<Pool> AcquireConnection(ThreadPool& pool, Pool* conn_pool) {
+  return AcquireAwaiter<Pool>(&pool, conn_pool);
+}
+
+#endif  // __cplusplus >= 202002L
+
+#endif
@@ -0,0 +1,148 @@
+/*
+从 /sys/devices/system/node 读取 NUMA 拓扑：每个节点有哪些 CPU，节点之间的距离
+读取失败（没有 NUMA 的内核或容器里没有挂载 sysfs）时把所有 CPU 当作一个节点
+*/
+
+#ifndef CPU_TOPOLOGY_H
+#define CPU_TOPOLOGY_H
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// 最多支持的 NUMA 节点数
+#define _DEF_MAX_NODES 8
+
+// 解析 "0-3,8-11" 格式的 CPU 列表
+inline bool ParseCpuList(const char* str, cpu_set_t* set) {
+  CPU_ZERO(set);
+  const char* s = str;
+  while (*s != '\0' && *s != '\n') {
+    char* end = NULL;
+    long first = strtol(s, &end, 10);
+    if (end == s) {
+      return false;
+    }
+    long last = first;
+    s = end;
+    if (*s == '-') {
+      last = strtol(s + 1, &end, 10);
+      if (end == s + 1) {
+        return false;
+      }
+      s = end;
+    }
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+      CPU_SET(cpu, set);
+    }
+    if (*s == ',') {
+      ++s;
+    }
+  }
+  return true;
+}
+
+// 读取一个 sysfs 文件的第一行
+inline bool ReadSysLine(const char* path, char* buf, int len) {
+  FILE* fp = fopen(path, "r");
+  if (fp == NULL) {
+    return false;
+  }
+  bool ok = fgets(buf, len, fp) != NULL;
+  fclose(fp);
+  return ok;
+}
+
+struct CpuNode {
+  int id; // 节点编号（nodeN 中的 N）
+  cpu_set_t cpus; // 节点上的 CPU
+  int distance[_DEF_MAX_NODES]; // 到第 i 个节点（下标，不是编号）的距离
+};
+
+class CpuTopology {
+ public:
+  CpuTopology() : count_(0) {}
+
+  /// @brief 读取 NUMA 拓扑
+  /// @return 读到了节点信息返回 true，否则只有一个包含所有在线 CPU 的节点
+  bool Load() {
+    count_ = 0;
+    char path[128];
+    char line[4096];
+    for (int id = 0; id < 1024 && count_ < _DEF_MAX_NODES; ++id) {
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+               id);
+      if (!ReadSysLine(path, line, sizeof(line))) {
+        continue;
+      }
+      CpuNode* node = &nodes_[count_];
+      // 没有 CPU 的节点（只有内存）不需要线程
+      if (!ParseCpuList(line, &node->cpus) || CPU_COUNT(&node->cpus) == 0) {
+        continue;
+      }
+      node->id = id;
+      ++count_;
+    }
+
+    if (count_ == 0) {
+      nodes_[0].id = 0;
+      CPU_ZERO(&nodes_[0].cpus);
+      long n = sysconf(_SC_NPROCESSORS_CONF);
+      for (long cpu = 0; cpu < n && cpu < CPU_SETSIZE; ++cpu) {
+        CPU_SET(cpu, &nodes_[0].cpus);
+      }
+      nodes_[0].distance[0] = 10;
+      count_ = 1;
+      return false;
+    }
+
+    // distance 文件按节点编号列出到所有节点的距离
+    for (int i = 0; i < count_; ++i) {
+      for (int j = 0; j < count_; ++j) {
+        nodes_[i].distance[j] = i == j ? 10 : 20;
+      }
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/distance",
+               nodes_[i].id);
+      if (!ReadSysLine(path, line, sizeof(line))) {
+        continue;
+      }
+      int dist[1024];
+      int m = 0;
+      char* s = line;
+      char* end = NULL;
+      for (long d = strtol(s, &end, 10); end != s && m < 1024;
+           d = strtol(s, &end, 10)) {
+        dist[m++] = (int)d;
+        s = end;
+      }
+      for (int j = 0; j < count_; ++j) {
+        if (nodes_[j].id < m) {
+          nodes_[i].distance[j] = dist[nodes_[j].id];
+        }
+      }
+    }
+    return true;
+  }
+
+  int NodeCount() const { return count_; }
+
+  const CpuNode& Node(int i) const { return nodes_[i]; }
+
+  // CPU 所在节点的下标，不属于任何节点返回 -1
+  int NodeOfCpu(int cpu) const {
+    for (int i = 0; i < count_; ++i) {
+      if (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &nodes_[i].cpus)) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+ private:
+  CpuNode nodes_[_DEF_MAX_NODES];
+  int count_;
+};
+
+#endif
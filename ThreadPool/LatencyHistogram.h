@@ -0,0 +1,131 @@
+/*
+对数线性直方图，用于统计任务的排队时间和执行时间（纳秒）
+按 2 的幂分组，每组再等分成 kSubBuckets 个桶，相对误差不超过 1 / kSubBuckets，
+64 位的取值范围只需要几百个桶。
+每个直方图只由一个线程写入（所属的工作线程），写入只是普通的原子读写，
+不需要 CAS 或加锁；其他线程随时可以读取合并，读到的是接近当前的一个瞬时值。
+*/
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+// 合并后的直方图，可以随意拷贝
+struct HistogramSnapshot {
+  static const int kSubBits = 3;
+  static const int kSubBuckets = 1 << kSubBits;
+  static const int kBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+  HistogramSnapshot() { Clear(); }
+
+  void Clear() {
+    memset(counts, 0, sizeof(counts));
+    count = 0;
+    sum_ns = 0;
+    max_ns = 0;
+  }
+
+  // 取值 v 所在的桶
+  static int Index(uint64_t v) {
+    if (v < (uint64_t)kSubBuckets) {
+      return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int sub = (int)(v >> (msb - kSubBits)) & (kSubBuckets - 1);
+    return (msb - kSubBits + 1) * kSubBuckets + sub;
+  }
+
+  // 桶 i 的下界
+  static uint64_t Lower(int i) {
+    int group = i / kSubBuckets;
+    uint64_t sub = i % kSubBuckets;
+    if (group == 0) {
+      return sub;
+    }
+    return ((uint64_t)kSubBuckets + sub) << (group - 1);
+  }
+
+  /// @brief 分位数，返回所在桶的中点
+  /// @param q 0 ~ 1，例如 0.99
+  uint64_t Percentile(double q) const {
+    if (count == 0) {
+      return 0;
+    }
+    uint64_t rank = (uint64_t)(q * count);
+    if (rank >= count) {
+      rank = count - 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      seen += counts[i];
+      if (seen > rank) {
+        uint64_t lo = Lower(i);
+        uint64_t hi = i + 1 < kBuckets ? Lower(i + 1) : lo;
+        uint64_t mid = lo + (hi - lo) / 2;
+        return mid < max_ns ? mid : max_ns;
+      }
+    }
+    return max_ns;
+  }
+
+  double Mean() const { return count > 0 ? (double)sum_ns / count : 0; }
+
+  uint64_t counts[kBuckets];
+  uint64_t count; // 样本数
+  uint64_t sum_ns; // 样本之和
+  uint64_t max_ns; // 最大值
+};
+
+// 单线程写入、多线程读取的直方图
+class LatencyHistogram {
+ public:
+  LatencyHistogram() : count_(0), sum_ns_(0), max_ns_(0) {
+    for (int i = 0; i < HistogramSnapshot::kBuckets; ++i) {
+      counts_[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  LatencyHistogram(const LatencyHistogram& other) = delete;
+  LatencyHistogram& operator=(const LatencyHistogram& other) = delete;
+
+  // 记录一个样本，只能由所属的线程调用
+  void Record(long long ns) {
+    uint64_t v = ns > 0 ? (uint64_t)ns : 0;
+    Bump(&counts_[HistogramSnapshot::Index(v)], 1);
+    Bump(&count_, 1);
+    Bump(&sum_ns_, v);
+    if (v > max_ns_.load(std::memory_order_relaxed)) {
+      max_ns_.store(v, std::memory_order_relaxed);
+    }
+  }
+
+  // 累加到 out，可以在任何线程调用，不影响写入的线程
+  void MergeInto(HistogramSnapshot* out) const {
+    for (int i = 0; i < HistogramSnapshot::kBuckets; ++i) {
+      out->counts[i] += counts_[i].load(std::memory_order_relaxed);
+    }
+    out->count += count_.load(std::memory_order_relaxed);
+    out->sum_ns += sum_ns_.load(std::memory_order_relaxed);
+    uint64_t max_ns = max_ns_.load(std::memory_order_relaxed);
+    if (max_ns > out->max_ns) {
+      out->max_ns = max_ns;
+    }
+  }
+
+ private:
+  // 只有一个写入者，读出来加上再写回即可，比 fetch_add 少一次总线锁
+  static void Bump(std::atomic<uint64_t>* c, uint64_t n) {
+    c->store(c->load(std::memory_order_relaxed) + n,
+             std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> counts_[HistogramSnapshot::kBuckets];
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_ns_;
+  std::atomic<uint64_t> max_ns_;
+};
+
+#endif
@@ -0,0 +1,457 @@
+/*
+建立在 ThreadPool 上的数据并行算法：ParallelFor / ParallelReduce / ParallelTransform / ParallelSort
+区间按懒惰二分（lazy binary splitting）切分：执行者每做完一块 grain 大小的工作，
+只有在上一次分出去的一半已经被其他线程取走（说明有空闲线程）时才再分出剩下的一半，
+线程都忙的时候不会产生多余的任务。
+调用线程自己执行第一部分；等待时还没有被取走的子任务由等待者自己执行，
+因此在工作线程中嵌套调用也不会因为等待而死锁。
+放入线程池时不等待：队列满了或者还没有被取走的子任务已经够所有线程分的时候，
+子任务不进入队列，直接留给等待者执行。
+*/
+
+#ifndef PARALLEL_ALGORITHM_H
+#define PARALLEL_ALGORITHM_H
+
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "ThreadPool.h"
+
+// 取消并行算法的标志，可以在任何线程调用 Cancel
+// 已经开始执行的块会执行完，之后不再开始新的块
+class CancelToken {
+ public:
+  CancelToken() : cancelled_(false) {}
+
+  void Cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+
+  bool IsCancelled() const {
+    return cancelled_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<bool> cancelled_;
+};
+
+namespace parallel_detail {
+
+// 一次并行调用共享的状态：取消标志、第一个异常和还没有被取走的子任务数
+class Context {
+ public:
+  Context(ThreadPool* pool, CancelToken* token)
+      : pool_(pool), token_(token), stop_(false), failed_(false), pending_(0) {
+    max_pending_ = 2 * pool->GetScaleStats().threads_alive;
+    if (max_pending_ < 2) {
+      max_pending_ = 2;
+    }
+  }
+
+  ThreadPool* pool() const { return pool_; }
+
+  bool Stopped() const {
+    return stop_.load(std::memory_order_relaxed) ||
+           (token_ != NULL && token_->IsCancelled());
+  }
+
+  // 记录第一个异常，其他线程不再开始新的块
+  void Fail(std::exception_ptr e) {
+    if (!failed_.exchange(true, std::memory_order_acq_rel)) {
+      error_ = e;
+    }
+    stop_.store(true, std::memory_order_relaxed);
+  }
+
+  // 所有子任务都结束之后调用
+  void Rethrow() {
+    if (failed_.load(std::memory_order_acquire)) {
+      std::rethrow_exception(error_);
+    }
+  }
+
+  // 还没有被取走的子任务够多时不再放入线程池，避免队列里堆满没有线程执行的任务
+  bool BeginSpawn() {
+    if (pending_.load(std::memory_order_relaxed) >= max_pending_) {
+      return false;
+    }
+    pending_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // 放入线程池的子任务被取走或者没有放进去
+  void EndSpawn() { pending_.fetch_sub(1, std::memory_order_relaxed); }
+
+ private:
+  ThreadPool* pool_;
+  CancelToken* token_;
+  std::atomic<bool> stop_;
+  std::atomic<bool> failed_;
+  std::exception_ptr error_;
+  std::atomic<int> pending_;
+  int max_pending_;
+};
+
+// 可以被线程池执行、也可以被等待者取回自己执行的子任务
+// 一个引用属于放入线程池的 Runner，一个属于等待者
+class ForkTask {
+ public:
+  explicit ForkTask(Context* ctx)
+      : ctx_(ctx), refs_(2), spawned_(false), claimed_(false), done_(0),
+        waiters_(0) {}
+  virtual ~ForkTask() {}
+
+  // 不等待地放入线程池，放不进去（队列满或线程池已经关闭）时留给 Join 执行
+  // Runner 没有放进去时已经被销毁，引用随之释放；不放入线程池时没有 Runner，
+  // 直接释放属于它的引用
+  void Spawn() {
+    if (!ctx_->BeginSpawn()) {
+      Release();
+      return;
+    }
+    spawned_ = true;
+    if (ctx_->pool()->TryPost(Runner(this)) != kSubmitOk) {
+      spawned_ = false;
+      ctx_->EndSpawn();
+    }
+  }
+
+  // 是否已经被某个线程取走
+  bool Claimed() const { return claimed_.load(std::memory_order_relaxed); }
+
+  // 还没有被取走就自己执行，否则等待执行完成
+  void Join() {
+    if (TryClaim()) {
+      Execute();
+    } else {
+      Wait();
+    }
+  }
+
+  void Release() {
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+
+ protected:
+  virtual void Run() = 0;
+
+  Context* ctx_;
+
+ private:
+  // 线程池中的任务，被取走之后什么也不做
+  class Runner {
+   public:
+    explicit Runner(ForkTask* task) : task_(task) {}
+    Runner(Runner&& other) : task_(other.task_) { other.task_ = NULL; }
+    ~Runner() {
+      if (task_ != NULL) {
+        task_->Release();
+      }
+    }
+
+    void operator()() {
+      if (task_->TryClaim()) {
+        task_->Execute();
+      }
+    }
+
+   private:
+    ForkTask* task_;
+  };
+
+  bool TryClaim() {
+    if (claimed_.load(std::memory_order_relaxed) ||
+        claimed_.exchange(true, std::memory_order_acq_rel)) {
+      return false;
+    }
+    if (spawned_) {
+      ctx_->EndSpawn();
+    }
+    return true;
+  }
+
+  void Execute() {
+    Run();
+    done_.store(1, std::memory_order_seq_cst);
+    if (waiters_.load(std::memory_order_seq_cst) > 0) {
+      syscall(SYS_futex, (uint32_t*)&done_, FUTEX_WAKE_PRIVATE, INT_MAX, NULL,
+              NULL, 0);
+    }
+  }
+
+  // 与 Execute 的 "发布完成 -> 检查等待者" 配对
+  void Wait() {
+    while (done_.load(std::memory_order_acquire) == 0) {
+      waiters_.fetch_add(1, std::memory_order_seq_cst);
+      if (done_.load(std::memory_order_seq_cst) == 0) {
+        syscall(SYS_futex, (uint32_t*)&done_, FUTEX_WAIT_PRIVATE, 0, NULL,
+                NULL, 0);
+      }
+      waiters_.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+
+  std::atomic<int> refs_;
+  bool spawned_; // 在线程池的队列中，Spawn 之后只读
+  std::atomic<bool> claimed_;
+  std::atomic<uint32_t> done_; // futex 的等待字
+  std::atomic<int> waiters_;
+};
+
+// 执行任意可调用对象的子任务，异常记录到 Context
+template<typename F>
+class FnTask : public ForkTask {
+ public:
+  FnTask(Context* ctx, F&& f) : ForkTask(ctx), f_(std::move(f)) {}
+
+ protected:
+  void Run() {
+    try {
+      f_();
+    } catch (...) {
+      ctx_->Fail(std::current_exception());
+    }
+  }
+
+ private:
+  F f_;
+};
+
+// 并行执行 left 和 right：right 放入线程池，当前线程执行 left，然后取回或等待 right
+template<typename L, typename R>
+void ForkJoin(Context* ctx, L&& left, R&& right) {
+  typedef typename std::decay<R>::type Fn;
+  FnTask<Fn>* task = new FnTask<Fn>(ctx, Fn(std::forward<R>(right)));
+  task->Spawn();
+  try {
+    left();
+  } catch (...) {
+    ctx->Fail(std::current_exception());
+  }
+  task->Join();
+  task->Release();
+}
+
+template<typename Index, typename T, typename Body, typename Combine>
+T RunRange(Context* ctx, const Body& body, const Combine& combine,
+           Index grain, Index begin, Index end, const T& identity);
+
+// 分出去的后一半区间
+template<typename Index, typename T, typename Body, typename Combine>
+class RangeTask : public ForkTask {
+ public:
+  RangeTask(Context* ctx, const Body* body, const Combine* combine,
+            Index grain, Index begin, Index end, const T& identity)
+      : ForkTask(ctx), body_(body), combine_(combine), grain_(grain),
+        begin_(begin), end_(end), result_(identity) {}
+
+  const T& result() const { return result_; }
+
+ protected:
+  void Run() {
+    result_ = RunRange(ctx_, *body_, *combine_, grain_, begin_, end_, result_);
+  }
+
+ private:
+  const Body* body_;
+  const Combine* combine_;
+  Index grain_;
+  Index begin_;
+  Index end_;
+  T result_;
+};
+
+// 懒惰二分执行 [begin, end)：body(b, e, acc) 处理一块并返回新的累计值
+template<typename Index, typename T, typename Body, typename Combine>
+T RunRange(Context* ctx, const Body& body, const Combine& combine,
+           Index grain, Index begin, Index end, const T& identity) {
+  typedef RangeTask<Index, T, Body, Combine> Task;
+  T acc = identity;
+  std::vector<Task*> children;
+  while (begin < end && !ctx->Stopped()) {
+    Index n = end - begin;
+    // 上一次分出去的一半已经被取走，说明有空闲的线程，再分出去一半
+    if (n > grain && (children.empty() || children.back()->Claimed())) {
+      Index mid = begin + n / 2;
+      Task* child = new Task(ctx, &body, &combine, grain, mid, end, identity);
+      children.push_back(child);
+      child->Spawn();
+      end = mid;
+      continue;
+    }
+    Index stop = n > grain ? begin + grain : end;
+    try {
+      acc = body(begin, stop, acc);
+    } catch (...) {
+      ctx->Fail(std::current_exception());
+    }
+    begin = stop;
+  }
+
+  // 后分出去的区间在前面，倒着合并保持区间的顺序，combine 只需要满足结合律
+  for (size_t i = children.size(); i-- > 0;) {
+    children[i]->Join();
+    try {
+      acc = combine(acc, children[i]->result());
+    } catch (...) {
+      ctx->Fail(std::current_exception());
+    }
+    children[i]->Release();
+  }
+  return acc;
+}
+
+struct Empty {};
+
+struct EmptyCombine {
+  Empty operator()(Empty a, Empty) const { return a; }
+};
+
+// 归并 [f1, l1) 和 [f2, l2) 到 out，元素被移动。较长的一段从中间切开，
+// 另一段二分查找切点，两半并行归并
+template<typename It, typename Out, typename Compare>
+void ParallelMerge(Context* ctx, It f1, It l1, It f2, It l2, Out out,
+                   const Compare& comp, std::ptrdiff_t grain) {
+  std::ptrdiff_t n1 = l1 - f1;
+  std::ptrdiff_t n2 = l2 - f2;
+  if (n1 + n2 <= grain) {
+    std::merge(std::make_move_iterator(f1), std::make_move_iterator(l1),
+               std::make_move_iterator(f2), std::make_move_iterator(l2), out,
+               comp);
+    return;
+  }
+  if (n1 < n2) {
+    std::swap(f1, f2);
+    std::swap(l1, l2);
+    std::swap(n1, n2);
+  }
+  It m1 = f1 + n1 / 2;
+  It m2 = std::lower_bound(f2, l2, *m1, comp);
+  Out mo = out + (m1 - f1) + (m2 - f2);
+  ForkJoin(ctx, [&] { ParallelMerge(ctx, f1, m1, f2, m2, out, comp, grain); },
+           [=] { ParallelMerge(ctx, m1, l1, m2, l2, mo, comp, grain); });
+}
+
+// 排序 [a, a + n)，to_buf 为真时结果放到 [b, b + n)，否则留在原处
+// 两个子区间的结果放在另一边，再归并回来，每层只移动一次
+template<typename It, typename BufIt, typename Compare>
+void SortRange(Context* ctx, It a, BufIt b, std::ptrdiff_t n, bool to_buf,
+               const Compare& comp, std::ptrdiff_t grain) {
+  if (n <= grain) {
+    // 取消之后不再排序，但仍然移动元素，保证一个元素都不丢
+    if (!ctx->Stopped()) {
+      std::sort(a, a + n, comp);
+    }
+    if (to_buf) {
+      std::move(a, a + n, b);
+    }
+    return;
+  }
+  std::ptrdiff_t h = n / 2;
+  ForkJoin(ctx, [&] { SortRange(ctx, a, b, h, !to_buf, comp, grain); },
+           [=, &comp] {
+             SortRange(ctx, a + h, b + h, n - h, !to_buf, comp, grain);
+           });
+  if (to_buf) {
+    ParallelMerge(ctx, a, a + h, a + h, a + n, b, comp, grain);
+  } else {
+    ParallelMerge(ctx, b, b + h, b + h, b + n, a, comp, grain);
+  }
+}
+
+}  // namespace parallel_detail
+
+/// @brief 并行执行 fn(i)，i 取 [begin, end)
+/// @param grain 每块至少包含的下标数，小于 1 时按 1
+/// @param cancel 取消标志，可以为 NULL
+/// @return 全部执行完返回 true，被取消返回 false（只执行了一部分）
+/// fn 抛出的第一个异常在所有已经开始的块结束后重新抛出
+template<typename Index, typename Fn>
+bool ParallelFor(ThreadPool& pool, Index begin, Index end, Index grain, Fn fn,
+                 CancelToken* cancel = NULL) {
+  using parallel_detail::Empty;
+  parallel_detail::Context ctx(&pool, cancel);
+  auto body = [&fn](Index b, Index e, Empty acc) {
+    for (Index i = b; i < e; ++i) {
+      fn(i);
+    }
+    return acc;
+  };
+  parallel_detail::RunRange(&ctx, body, parallel_detail::EmptyCombine(),
+                            grain < 1 ? Index(1) : grain, begin, end, Empty());
+  ctx.Rethrow();
+  return !ctx.Stopped();
+}
+
+/// @brief 并行计算 combine(identity, fn(begin), ..., fn(end - 1))
+/// combine 需要满足结合律，各部分按下标顺序合并，不要求交换律
+/// @return 归约的结果，被取消时是已经处理的部分的结果
+template<typename Index, typename T, typename Fn, typename Combine>
+T ParallelReduce(ThreadPool& pool, Index begin, Index end, Index grain,
+                 T identity, Fn fn, Combine combine,
+                 CancelToken* cancel = NULL) {
+  parallel_detail::Context ctx(&pool, cancel);
+  auto body = [&fn, &combine](Index b, Index e, T acc) {
+    for (Index i = b; i < e; ++i) {
+      acc = combine(acc, fn(i));
+    }
+    return acc;
+  };
+  T result = parallel_detail::RunRange(&ctx, body, combine,
+                                       grain < 1 ? Index(1) : grain, begin,
+                                       end, identity);
+  ctx.Rethrow();
+  return result;
+}
+
+/// @brief 并行执行 out[i] = fn(first[i])，first 和 out 都是随机访问迭代器
+/// @return 全部执行完返回 true，被取消返回 false
+template<typename InIt, typename OutIt, typename Fn>
+bool ParallelTransform(ThreadPool& pool, InIt first, InIt last, OutIt out,
+                       Fn fn, std::ptrdiff_t grain = 1024,
+                       CancelToken* cancel = NULL) {
+  return ParallelFor(pool, std::ptrdiff_t(0), last - first, grain,
+                     [&](std::ptrdiff_t i) { out[i] = fn(first[i]); },
+                     cancel);
+}
+
+/// @brief 并行归并排序，不稳定，需要 n 个元素的临时空间，元素类型需要可以默认构造
+/// @param grain 不超过 grain 个元素的区间用 std::sort 排序 / std::merge 归并
+/// @return 排好序返回 true；被取消返回 false，此时元素都还在区间里，但顺序不确定
+template<typename RandomIt, typename Compare>
+bool ParallelSort(ThreadPool& pool, RandomIt first, RandomIt last,
+                  Compare comp, std::ptrdiff_t grain = 4096,
+                  CancelToken* cancel = NULL) {
+  typedef typename std::iterator_traits<RandomIt>::value_type T;
+  std::ptrdiff_t n = last - first;
+  if (grain < 2) {
+    grain = 2;
+  }
+  if (n <= grain) {
+    std::sort(first, last, comp);
+    return true;
+  }
+  parallel_detail::Context ctx(&pool, cancel);
+  std::vector<T> buf(n);
+  parallel_detail::SortRange(&ctx, first, buf.begin(), n, false, comp, grain);
+  ctx.Rethrow();
+  return !ctx.Stopped();
+}
+
+template<typename RandomIt>
+bool ParallelSort(ThreadPool& pool, RandomIt first, RandomIt last) {
+  typedef typename std::iterator_traits<RandomIt>::value_type T;
+  return ParallelSort(pool, first, last, std::less<T>());
+}
+
+#endif
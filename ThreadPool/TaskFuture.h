@@ -0,0 +1,245 @@
+/*
+ThreadPool::Submit 返回的结果句柄
+可调用对象、参数和结果放在同一个 TaskState 里，一次堆分配，
+工作线程执行完成后写入结果（或异常）并唤醒等待的线程。
+等待直接使用 futex，没有线程在等待时完成任务不进入内核。
+*/
+
+#ifndef TASK_FUTURE_H
+#define TASK_FUTURE_H
+
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+#include <exception>
+#include <new>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// 保存任务的返回值，void 特化为空
+template<typename R>
+class TaskValue {
+ public:
+  TaskValue() : has_(false) {}
+  ~TaskValue() {
+    if (has_) {
+      Ptr()->~R();
+    }
+  }
+
+  template<typename Fn>
+  void Run(Fn& fn) {
+    new (buf_) R(fn());
+    has_ = true;
+  }
+
+  R Take() {
+    R r(std::move(*Ptr()));
+    Ptr()->~R();
+    has_ = false;
+    return r;
+  }
+
+ private:
+  R* Ptr() { return reinterpret_cast<R*>(buf_); }
+
+  alignas(R) unsigned char buf_[sizeof(R)];
+  bool has_;
+};
+
+template<>
+class TaskValue<void> {
+ public:
+  template<typename Fn>
+  void Run(Fn& fn) {
+    fn();
+  }
+
+  void Take() {}
+};
+
+// 任务的共享状态：一个引用属于 TaskFuture，一个属于还没有执行的任务
+template<typename R>
+class TaskStateBase {
+ public:
+  TaskStateBase() : refs_(2), ready_(0), waiters_(0) {}
+  virtual ~TaskStateBase() {}
+
+  // 执行任务并发布结果
+  virtual void Run() = 0;
+
+  // 任务被丢弃（线程池已经关闭），让等待者得到异常
+  void Discard(const char* why) {
+    error_ = std::make_exception_ptr(std::runtime_error(why));
+    SetReady();
+  }
+
+  void Release() {
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+
+  bool Ready() const { return ready_.load(std::memory_order_acquire) != 0; }
+
+  /// @brief 等待任务完成
+  /// @param ms_timeout 超时时间，-1 一直等待
+  /// @return 任务完成返回 true
+  bool Wait(int ms_timeout) {
+    if (Ready()) {
+      return true;
+    }
+    struct timespec deadline = {0, 0};
+    if (ms_timeout >= 0) {
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      long long ns = deadline.tv_nsec + (long long)ms_timeout * 1000000;
+      deadline.tv_sec += ns / 1000000000;
+      deadline.tv_nsec = ns % 1000000000;
+    }
+    while (!Ready()) {
+      struct timespec rel = {0, 0};
+      if (ms_timeout >= 0) {
+        struct timespec now = {0, 0};
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long left = (deadline.tv_sec - now.tv_sec) * 1000000000LL +
+                         deadline.tv_nsec - now.tv_nsec;
+        if (left <= 0) {
+          return Ready();
+        }
+        rel.tv_sec = left / 1000000000;
+        rel.tv_nsec = left % 1000000000;
+      }
+      // 先登记再检查，与 SetReady 的 "发布结果 -> 检查等待者" 配对
+      waiters_.fetch_add(1, std::memory_order_seq_cst);
+      if (ready_.load(std::memory_order_seq_cst) == 0) {
+        syscall(SYS_futex, (uint32_t*)&ready_, FUTEX_WAIT_PRIVATE, 0,
+                ms_timeout >= 0 ? &rel : NULL, NULL, 0);
+      }
+      waiters_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  // 取出结果，任务抛出的异常在这里重新抛出
+  R Get() {
+    Wait(-1);
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+    return value_.Take();
+  }
+
+ protected:
+  void SetReady() {
+    ready_.store(1, std::memory_order_seq_cst);
+    if (waiters_.load(std::memory_order_seq_cst) > 0) {
+      syscall(SYS_futex, (uint32_t*)&ready_, FUTEX_WAKE_PRIVATE, INT_MAX,
+              NULL, NULL, 0);
+    }
+  }
+
+  TaskValue<R> value_;
+  std::exception_ptr error_;
+
+ private:
+  std::atomic<int> refs_;
+  std::atomic<uint32_t> ready_; // futex 的等待字，0 未完成，1 完成
+  std::atomic<int> waiters_; // 正在等待结果的线程数量
+};
+
+// 保存可调用对象和参数的共享状态
+template<typename R, typename Fn, typename... Args>
+class TaskState : public TaskStateBase<R> {
+ public:
+  template<typename F, typename... A>
+  explicit TaskState(F&& f, A&&... args)
+      : fn_(std::forward<F>(f)), args_(std::forward<A>(args)...) {}
+
+  void Run() {
+    try {
+      this->value_.Run(*this);
+    } catch (...) {
+      this->error_ = std::current_exception();
+    }
+    this->SetReady();
+  }
+
+  // 参数以右值传给可调用对象，任务只执行一次，参数可以是只能移动的类型
+  R operator()() {
+    return Apply(std::index_sequence_for<Args...>());
+  }
+
+ private:
+  template<size_t... I>
+  R Apply(std::index_sequence<I...>) {
+    return std::move(fn_)(std::move(std::get<I>(args_))...);
+  }
+
+  Fn fn_;
+  std::tuple<Args...> args_;
+};
+
+// Submit 返回的结果句柄，只能移动
+template<typename R>
+class TaskFuture {
+ public:
+  TaskFuture() : state_(NULL) {}
+  explicit TaskFuture(TaskStateBase<R>* state) : state_(state) {}
+  ~TaskFuture() {
+    if (state_ != NULL) {
+      state_->Release();
+    }
+  }
+
+  TaskFuture(TaskFuture&& other) : state_(other.state_) {
+    other.state_ = NULL;
+  }
+
+  TaskFuture& operator=(TaskFuture&& other) {
+    if (this != &other) {
+      if (state_ != NULL) {
+        state_->Release();
+      }
+      state_ = other.state_;
+      other.state_ = NULL;
+    }
+    return *this;
+  }
+
+  TaskFuture(const TaskFuture& other) = delete;
+  TaskFuture& operator=(const TaskFuture& other) = delete;
+
+  // 是否关联了一个任务，Get 之后不再关联
+  bool Valid() const { return state_ != NULL; }
+
+  // 任务是否已经完成，不等待
+  bool Ready() const { return state_ != NULL && state_->Ready(); }
+
+  // 等待任务完成
+  void Wait() const { state_->Wait(-1); }
+
+  /// @brief 最多等待 ms_timeout 毫秒
+  /// @return 任务完成返回 true
+  bool WaitFor(int ms_timeout) const { return state_->Wait(ms_timeout); }
+
+  /// @brief 等待并取出结果，任务抛出的异常在这里重新抛出，只能调用一次
+  R Get() {
+    TaskStateBase<R>* state = state_;
+    state_ = NULL;
+    struct Releaser {
+      TaskStateBase<R>* s;
+      ~Releaser() { s->Release(); }
+    } releaser = {state};
+    return state->Get();
+  }
+
+ private:
+  TaskStateBase<R>* state_;
+};
+
+#endif
@@ -1,234 +1,1326 @@
 #include "ThreadPool.h"
 
-STR_POOL_T::STR_POOL_T(int max_num, int min_num, int que_max) {
+// 当前线程所在的工作线程槽位，不是工作线程时为 NULL
+static thread_local worker_t* tls_worker = NULL;
+
+// CLOCK_MONOTONIC 的纳秒数
+static long long NowNs() {
+  struct timespec ts = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 自旋等待时提示 CPU 降低功耗、让出流水线给同一物理核上的另一个超线程
+static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield" ::: "memory");
+#endif
+}
+
+// ms 毫秒之后的绝对时间，条件变量都使用 CLOCK_MONOTONIC，不受修改系统时间影响
+static struct timespec Deadline(int ms) {
+  struct timespec t = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  long long ns = t.tv_nsec + (long long)(ms % 1000) * 1000000;
+  t.tv_sec += ms / 1000 + ns / 1000000000;
+  t.tv_nsec = ns % 1000000000;
+  return t;
+}
+
+// 没有被唤醒（检查到任务或者超时）的线程自己从 parked 中移除，调用者需持有 lock
+static void RemoveParked(pool_t* p, worker_t* w) {
+  for (int i = 0; i < p->parked_count; ++i) {
+    if (p->parked[i] == w) {
+      p->parked[i] = p->parked[--(p->parked_count)];
+      p->thread_sleeping.fetch_sub(1, std::memory_order_relaxed);
+      return;
+    }
+  }
+}
+
+STR_POOL_T::STR_POOL_T(int max_num, int min_num, int que_max, PoolMode mode,
+                       const PoolScalePolicy& scale,
+                       const PoolLanePolicy& lane,
+                       const PoolIdlePolicy& idle,
+                       const PoolRejectPolicy& reject) {
   this->thread_max = max_num;
   this->thread_min = min_num;
   this->thread_busy = 0;
   this->thread_alive = 0;
-  this->thread_wait = 0;
   this->thread_shutdown = TRUE;
 
   this->queue_max = que_max;
   this->queue_cur_size = 0;
-  this->queue_rear = 0;
-  this->queue_front = 0;
+
+  this->mode = mode;
+  this->node = 0;
+  this->pinned = false;
+  CPU_ZERO(&this->cpus);
+
+  // 只有一个 CPU 时自旋只会占住提交任务的线程需要的 CPU
+  this->idle = idle;
+  if (sysconf(_SC_NPROCESSORS_ONLN) <= 1) {
+    this->idle.spin_us = 0;
+  }
+  this->thread_spinning = 0;
+  this->thread_sleeping = 0;
+  this->parked_count = 0;
+
+  this->scale = scale;
+  this->grow_requested = false;
+  this->wait_ewma_ns = 0;
+  this->depth_ewma = 0;
+  this->threads_spawned = 0;
+  this->threads_retired = 0;
 
   // 初始化互斥锁和条件变量
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
   if (pthread_mutex_init(&this->lock, NULL) != 0 ||
-      pthread_cond_init(&this->not_empty, NULL) != 0 ||
-      pthread_cond_init(&this->not_full, NULL) != 0) {
+      pthread_cond_init(&this->manager_wake, &attr) != 0) {
     err_str("init cond or mutex error", -1);
   }
 
-  // 申请线程数组空间 
+  // 初始化优先级通道，每条通道一个环形队列
+  this->lane_policy = lane;
+  this->lane_count = lane.lanes;
+  if (lane_count < 1) {
+    lane_count = 1;
+  } else if (lane_count > _DEF_MAX_LANES) {
+    lane_count = _DEF_MAX_LANES;
+  }
+  if (lane_policy.default_lane < 0 || lane_policy.default_lane >= lane_count) {
+    lane_policy.default_lane = lane_count - 1;
+  }
+  for (int i = 0; i < lane_count; ++i) {
+    lane_t* l = &this->lanes[i];
+    l->cap = lane.depth_limits[i] > 0 ? lane.depth_limits[i] : que_max;
+    l->weight = lane.weights[i] > 0 ? lane.weights[i] : 1;
+    l->size = 0;
+    l->front = 0;
+    l->rear = 0;
+    l->overflow_head = NULL;
+    l->overflow_tail = NULL;
+    if ((l->ring = (task_t*)malloc(sizeof(task_t) * l->cap)) == NULL) {
+      err_str("malloc taks queue error:", -1);
+    }
+    if (pthread_cond_init(&l->not_full, &attr) != 0) {
+      err_str("init cond or mutex error", -1);
+    }
+  }
+  this->lane_cursor = 0;
+  this->lane_credit = lanes[0].weight;
+  this->tasks_expired = 0;
+  this->tasks_submitted = 0;
+  this->tasks_rejected = 0;
+  this->tasks_inline = 0;
+  this->reject = reject;
+  this->overflow_size = 0;
+  pthread_condattr_destroy(&attr);
+
+  // 申请线程数组空间
   if ((this->tids = (pthread_t*)malloc(sizeof(pthread_t) * max_num)) == NULL) {
     err_str("malloc tids error:", -1);
   }
   // 初始化数组值为0
   memset(tids, 0, sizeof(pthread_t) * max_num);
+  this->parked = new STR_WORKER_T*[max_num];
 
-  // 申请任务队列的空间
-  if ((this->queue_task = (task_t*)malloc(sizeof(task_t) * que_max)) == NULL) {
-    err_str("malloc taks queue error:", -1);
+  // 初始化工作线程槽位，工作窃取模式下每个槽位一个本地队列
+  this->workers = new worker_t[max_num];
+  for (int i = 0; i < max_num; ++i) {
+    workers[i].pool = this;
+    workers[i].index = i;
+    workers[i].started = false;
+    workers[i].exited = false;
+    workers[i].deque = NULL;
+    if (mode == kPoolWorkStealing) {
+      workers[i].deque = new WorkStealDeque<task_t>(que_max);
+    }
+    workers[i].seed = i * 2654435761u + 1;
+    workers[i].wait_ewma_ns = 0;
+    workers[i].park_word = 0;
+    workers[i].tasks_submitted = 0;
+    workers[i].tasks_stolen = 0;
   }
 }
 
 // 创建线程池：
+// 按 CPU 亲和性决定子线程池的数量和各自的 CPU，每个子线程池：
 // 创建线程池对象，通过线程池对像构造函数为线程池初始化
 // 创建 num_min 个线程，分配到线程池中
 // 创建管理者线程
-bool ThreadPool::CreatePool(int num_max, int num_min, int que_max) {
-  // 创建线程池对象
-  pool_ = new STR_POOL_T(num_max, num_min, que_max);
-
-  int err = 0;
-  for (int i = 0; i < num_min; ++i) {
-    if ((err = pthread_create(&(pool_->tids[i]), NULL, Custom, 
-        (void*)pool_)) > 0) {
-      printf("create custom error:%s\n", strerror(err));
-      return false;
+bool ThreadPool::CreatePool(int num_max, int num_min, int que_max,
+                            PoolMode mode, const PoolScalePolicy& scale,
+                            const PoolLanePolicy& lanes,
+                            const PoolIdlePolicy& idle,
+                            const PoolAffinityPolicy& affinity,
+                            const PoolRejectPolicy& reject) {
+  cpu_set_t allowed = affinity.cpus;
+  if (CPU_COUNT(&allowed) == 0 &&
+      sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    CPU_ZERO(&allowed);
+  }
+
+  // 每个有可用 CPU 的节点一个子线程池
+  CpuTopology topo;
+  topo.Load();
+  int node_of_pool[_DEF_MAX_NODES];
+  cpu_set_t pool_cpus[_DEF_MAX_NODES];
+  int count = 0;
+  if (affinity.numa && topo.NodeCount() > 1) {
+    for (int i = 0; i < topo.NodeCount(); ++i) {
+      CPU_AND(&pool_cpus[count], &topo.Node(i).cpus, &allowed);
+      if (CPU_COUNT(&pool_cpus[count]) > 0) {
+        node_of_pool[count++] = i;
+      }
     }
-    // 存活的线程数加1
-    ++(pool_->thread_alive);
+  }
+  if (count == 0) {
+    node_of_pool[0] = -1;
+    pool_cpus[0] = allowed;
+    count = 1;
   }
 
-  if ((err = pthread_create(&(pool_->mamger_tid), NULL, Manager, 
-      (void*)pool_)) > 0) {
-      printf("create manger error:%s\n", strerror(err));
-      return false;
+  // CPU 映射到所在节点的子线程池，不在任何子线程池里的 CPU 用第一个
+  memset(cpu_pool_, 0, sizeof(cpu_pool_));
+  for (int i = 0; i < count; ++i) {
+    if (node_of_pool[i] < 0) {
+      continue;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &topo.Node(node_of_pool[i]).cpus)) {
+        cpu_pool_[cpu] = i;
+      }
+    }
+  }
+  // 溢出顺序：自己，然后按节点距离由近到远
+  for (int i = 0; i < count; ++i) {
+    for (int j = 0; j < count; ++j) {
+      spill_order_[i][j] = j;
+    }
+    std::swap(spill_order_[i][0], spill_order_[i][i]);
+    for (int j = 1; j < count; ++j) {
+      for (int k = j; k > 1; --k) {
+        int a = spill_order_[i][k - 1];
+        int b = spill_order_[i][k];
+        if (topo.Node(node_of_pool[i]).distance[node_of_pool[a]] <=
+            topo.Node(node_of_pool[i]).distance[node_of_pool[b]]) {
+          break;
+        }
+        std::swap(spill_order_[i][k - 1], spill_order_[i][k]);
+      }
+    }
+  }
+
+  int per_max = (num_max + count - 1) / count;
+  int per_min = (num_min + count - 1) / count;
+  if (per_min > per_max) {
+    per_min = per_max;
+  }
+  for (int i = 0; i < count; ++i) {
+    // 创建线程池对象
+    pool_t* p = new STR_POOL_T(per_max, per_min, que_max, mode, scale, lanes,
+                               idle, reject);
+    p->node = i;
+    p->pinned = (affinity.pin || count > 1) && CPU_COUNT(&pool_cpus[i]) > 0;
+    p->cpus = pool_cpus[i];
+    pools_[pool_count_++] = p;
+
+    pthread_mutex_lock(&p->lock);
+    for (int k = 0; k < per_min; ++k) {
+      if (!SpawnWorker(p, k)) {
+        pthread_mutex_unlock(&p->lock);
+        return false;
+      }
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    int err = 0;
+    if ((err = pthread_create(&(p->mamger_tid), NULL, Manager,
+        (void*)p)) > 0) {
+        printf("create manger error:%s\n", strerror(err));
+        return false;
+    }
   }
+  return true;
+}
+
+// 销毁线程池：依次关闭每个子线程池
+void ThreadPool::DestroyPool() {
+  for (int i = 0; i < pool_count_; ++i) {
+    DestroySubPool(pools_[i]);
+    pools_[i] = NULL;
+  }
+  pool_count_ = 0;
+}
+
+// 设置关闭状态并唤醒所有等待中的线程，等待管理者线程和所有工作线程退出后释放资源
+void ThreadPool::DestroySubPool(pool_t* p) {
+  pthread_mutex_lock(&p->lock);
+  p->thread_shutdown = FALSE;
+  UnparkLocked(p, p->parked_count);
+  for (int i = 0; i < p->lane_count; ++i) {
+    pthread_cond_broadcast(&p->lanes[i].not_full);
+  }
+  pthread_cond_signal(&p->manager_wake);
+  pthread_mutex_unlock(&p->lock);
+
+  // 管理者线程退出后不会再创建新的工作线程
+  pthread_join(p->mamger_tid, NULL);
+  for (int i = 0; i < p->thread_max; ++i) {
+    if (p->workers[i].started) {
+      pthread_join(p->tids[i], NULL);
+    }
+  }
+
+  // 释放没有执行的 Submit / Post 任务，等待结果的线程得到异常
+  DiscardTasks(p);
+  for (int i = 0; i < p->thread_max; ++i) {
+    delete p->workers[i].deque;
+  }
+  delete[] p->workers;
+  delete[] p->parked;
+  free(p->tids);
+  for (int i = 0; i < p->lane_count; ++i) {
+    free(p->lanes[i].ring);
+    pthread_cond_destroy(&p->lanes[i].not_full);
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->manager_wake);
+  delete p;
+}
+
+int ThreadPool::HomePool() const {
+  if (tls_worker != NULL) {
+    int node = tls_worker->pool->node;
+    if (node < pool_count_ && pools_[node] == tls_worker->pool) {
+      return node;
+    }
+  }
+  if (pool_count_ == 1) {
+    return 0;
+  }
+  int cpu = sched_getcpu();
+  return cpu >= 0 && cpu < CPU_SETSIZE ? cpu_pool_[cpu] : 0;
+}
+
+bool ThreadPool::InStealWorker(pool_t* p) {
+  return p->mode == kPoolWorkStealing && tls_worker != NULL &&
+         tls_worker->pool == p;
+}
+
+int ThreadPool::SpillTask(int home, const task_t& t) {
+  for (int k = 1; k < pool_count_; ++k) {
+    pool_t* q = pools_[spill_order_[home][k]];
+    pthread_mutex_lock(&q->lock);
+    if (!q->thread_shutdown) {
+      pthread_mutex_unlock(&q->lock);
+      return -1;
+    }
+    if (PutLocked(q, t.lane, &t, 1, t.enqueue_ns) == 1) {
+      SignalLocked(q, 1);
+      CheckBacklogLocked(q);
+      pthread_mutex_unlock(&q->lock);
+      return 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+  }
+  return 0;
+}
+
+int ThreadPool::SpillBatch(int home, const task_t* tasks, int n,
+                           long long now) {
+  int done = 0;
+  for (int k = 1; k < pool_count_ && done < n; ++k) {
+    pool_t* q = pools_[spill_order_[home][k]];
+    pthread_mutex_lock(&q->lock);
+    if (q->thread_shutdown) {
+      int put = PutBatchLocked(q, tasks + done, n - done, now);
+      SignalLocked(q, put);
+      CheckBacklogLocked(q);
+      done += put;
+    }
+    pthread_mutex_unlock(&q->lock);
+  }
+  return done;
 }
 
 // 生产者往任务队列中添加任务
 // 对任务队列的修改操作都上锁，添加任务完成后通知消费者
+// 工作窃取模式下，工作线程提交的任务放入自己的本地队列，不需要加锁
 int ThreadPool::ProducerAdd( void*(*task)(void*arg), void* arg) {
+  return ProducerAdd(task, arg, TaskOptions());
+}
+
+int ThreadPool::ProducerAdd(void*(*task)(void*arg), void* arg,
+                            const TaskOptions& opts) {
+  task_t t;
+  MakeTask(&t, opts);
+  t.task = task;
+  t.arg = arg;
+  return AddTask(t, opts.wait_ms);
+}
+
+void ThreadPool::MakeTask(task_t* t, const TaskOptions& opts) {
+  t->task = NULL;
+  t->arg = NULL;
+  t->call = NULL;
+  t->enqueue_ns = 0;
+  t->lane = opts.lane;
+  long long us = (long long)opts.timeout_ms * 1000;
+  if (us <= 0) {
+    us = 0;
+  } else if (us > UINT_MAX) {
+    us = UINT_MAX;
+  }
+  t->timeout_us = (unsigned int)us;
+}
+
+int ThreadPool::LaneOf(pool_t* p, int lane) {
+  if (lane < 0) {
+    return p->lane_policy.default_lane;
+  }
+  return lane < p->lane_count ? lane : p->lane_count - 1;
+}
+
+// ProducerAdd / Submit / Post 共用的入队逻辑
+int ThreadPool::AddTask(const task_t& task, int wait_ms) {
+  // 线程池还没有创建或者已经销毁
+  if (pool_count_ == 0) {
+    return kSubmitClosed;
+  }
+  int home = HomePool();
+  // 先计数再放入：任务放入后可能立即执行完，调用者随即销毁线程池，
+  // 之后不能再访问线程池。放入失败时线程池还在，改为计入拒绝数
+  CountSubmit(pools_[home], 1, true);
+  int ret = PutTask(home, task, wait_ms);
+  if (ret != 0) {
+    CountSubmit(pools_[home], -1, true);
+    CountSubmit(pools_[home], 1, false);
+  }
+  return ret;
+}
+
+// 工作线程提交的任务计入自己的槽位，不与其他线程争用计数器
+void ThreadPool::CountSubmit(pool_t* p, int n, bool ok) {
+  if (!ok) {
+    p->tasks_rejected.fetch_add(n, std::memory_order_relaxed);
+  } else if (tls_worker != NULL && tls_worker->pool == p) {
+    std::atomic<unsigned long long>& c = tls_worker->tasks_submitted;
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  } else {
+    p->tasks_submitted.fetch_add(n, std::memory_order_relaxed);
+  }
+}
+
+int ThreadPool::PutTask(int home, const task_t& task, int wait_ms) {
+  pool_t* p = pools_[home];
+  task_t t = task;
+  t.enqueue_ns = NowNs();
+  t.lane = LaneOf(p, t.lane);
+  bool in_worker = InStealWorker(p);
+  if (in_worker && t.lane == p->lane_policy.default_lane &&
+      p->thread_shutdown && tls_worker->deque->Push(t)) {
+    WakeSome(p, 1);
+    return kSubmitOk;
+  }
+
   // 上锁
-  pthread_mutex_lock(&pool_->lock);
-  // 当任务队列已经满了，且线程池未关闭时，等待消费者的条件变量通知
-  while (pool_->queue_cur_size == pool_->queue_max && pool_->thread_shutdown) {
-    // 等待消费者的条件变量
-    pthread_cond_wait(&pool_->not_full, &pool_->lock);
+  pthread_mutex_lock(&p->lock);
+  lane_t* lane = &p->lanes[t.lane];
+  // 本节点的通道满了，先放入其他节点的子线程池，都满了才在本节点执行或等待
+  if (lane->size == lane->cap && p->thread_shutdown && pool_count_ > 1) {
+    pthread_mutex_unlock(&p->lock);
+    int spilled = SpillTask(home, t);
+    if (spilled != 0) {
+      return spilled > 0 ? kSubmitOk : kSubmitClosed;
+    }
+    pthread_mutex_lock(&p->lock);
+  }
+  // 本地队列和共享队列都满了，直接在当前工作线程中执行
+  // 工作线程不能阻塞等待其他工作线程取任务，否则可能全部互相等待；
+  // 不等待或限时等待的提交不会一直阻塞，交给拒绝策略
+  if (in_worker && wait_ms < 0 && lane->size == lane->cap &&
+      p->thread_shutdown) {
+    pthread_mutex_unlock(&p->lock);
+    RunInline(p, t);
+    return kSubmitOk;
+  }
+  // 当任务所在的通道已经满了，且线程池未关闭时，等待消费者的条件变量通知
+  // wait_ms >= 0 时最多等待 wait_ms 毫秒，超时仍然满则按拒绝策略处理
+  struct timespec deadline = {0, 0};
+  if (wait_ms > 0) {
+    deadline = Deadline(wait_ms);
+  }
+  while (lane->size == lane->cap && p->thread_shutdown) {
+    if (wait_ms < 0) {
+      // 等待消费者的条件变量
+      pthread_cond_wait(&lane->not_full, &p->lock);
+    } else if (wait_ms == 0 ||
+               pthread_cond_timedwait(&lane->not_full, &p->lock, &deadline) ==
+                   ETIMEDOUT) {
+      break;
+    }
   }
   // 如果线程池是关闭的,则释放互斥锁资源并退出
-  if (!pool_->thread_shutdown) {
-    pthread_mutex_unlock(&pool_->lock);
-    return -1;
+  if (!p->thread_shutdown) {
+    pthread_mutex_unlock(&p->lock);
+    return kSubmitClosed;
+  }
+  // 等待超时仍然满，按拒绝策略处理
+  if (lane->size == lane->cap) {
+    return RejectLocked(p, t);
   }
 
   // 任务队列不满且线程池未关闭,执行添加任务工作
-  pool_->queue_task[pool_->queue_front].task = task;
-  pool_->queue_task[pool_->queue_front].arg = arg;
-
-  // 更新队头指针
-  pool_->queue_front = (pool_->queue_front + 1) % pool_->queue_max;
-  // 当前任务队列中的任务数加1
-  ++(pool_->queue_cur_size);
-
+  PutLocked(p, t.lane, &t, 1, t.enqueue_ns);
   // 通知消费者线程有新的任务可取
-  pthread_cond_signal(&pool_->not_empty);
+  SignalLocked(p, 1);
+  // 任务开始积压时立即请求扩容
+  CheckBacklogLocked(p);
   // 解锁
-  pthread_mutex_unlock(&pool_->lock);
-  return 0;
+  pthread_mutex_unlock(&p->lock);
+  return kSubmitOk;
+}
+
+// 计数放在执行之后：执行完调用者可能立即读取统计
+void ThreadPool::RunInline(pool_t* p, const task_t& t) {
+  task_t copy = t;
+  RunTask(&copy);
+  p->tasks_inline.fetch_add(1, std::memory_order_relaxed);
+}
+
+int ThreadPool::RejectLocked(pool_t* p, const task_t& t) {
+  const PoolRejectPolicy& policy = p->reject;
+  lane_t* l = &p->lanes[t.lane];
+  switch (policy.mode) {
+    case kRejectCallerRuns: {
+      pthread_mutex_unlock(&p->lock);
+      RunInline(p, t);
+      return kSubmitOk;
+    }
+    case kRejectDiscardOldest: {
+      // 取出通道中最早的任务，新任务放入腾出的位置，任务总数不变
+      task_t oldest = l->ring[l->rear];
+      l->rear = (l->rear + 1) % l->cap;
+      --(l->size);
+      --(p->queue_cur_size);
+      PutLocked(p, t.lane, &t, 1, t.enqueue_ns);
+      pthread_mutex_unlock(&p->lock);
+      p->tasks_rejected.fetch_add(1, std::memory_order_relaxed);
+      if (policy.on_discard != NULL) {
+        policy.on_discard(&oldest, policy.arg);
+      }
+      DiscardTask(&oldest);
+      return kSubmitOk;
+    }
+    case kRejectOverflow: {
+      overflow_t* node = (overflow_t*)malloc(sizeof(overflow_t));
+      if (node == NULL) {
+        break;
+      }
+      node->task = t;
+      node->next = NULL;
+      if (l->overflow_tail != NULL) {
+        l->overflow_tail->next = node;
+      } else {
+        l->overflow_head = node;
+      }
+      l->overflow_tail = node;
+      int depth = ++(p->overflow_size);
+      CheckBacklogLocked(p);
+      pthread_mutex_unlock(&p->lock);
+      if (depth == policy.high_watermark && policy.on_high_watermark != NULL) {
+        policy.on_high_watermark(depth, policy.arg);
+      }
+      return kSubmitOk;
+    }
+    default:
+      break;
+  }
+  pthread_mutex_unlock(&p->lock);
+  return kSubmitRejected;
+}
+
+// 批量添加任务：整批只加一次锁，放得下多少放多少，按放入的数量唤醒睡眠的线程
+int ThreadPool::ProducerAddBatch(const task_t* tasks, int n) {
+  if (n <= 0) {
+    return 0;
+  }
+  if (pool_count_ == 0) {
+    return -1;
+  }
+  int home = HomePool();
+  int done = PutBatch(home, tasks, n);
+  CountSubmit(pools_[home], done > 0 ? done : n, done > 0);
+  return done;
+}
+
+int ThreadPool::PutBatch(int home, const task_t* tasks, int n) {
+  int done = 0;
+  long long now = NowNs();
+  pool_t* p = pools_[home];
+  bool in_worker = InStealWorker(p);
+  if (in_worker && p->thread_shutdown) {
+    // 开头的默认通道的任务先放入本地队列，不需要加锁
+    while (done < n &&
+           LaneOf(p, tasks[done].lane) == p->lane_policy.default_lane) {
+      task_t t = tasks[done];
+      t.enqueue_ns = now;
+      t.lane = p->lane_policy.default_lane;
+      if (!tls_worker->deque->Push(t)) {
+        break;
+      }
+      ++done;
+    }
+    WakeSome(p, done);
+    if (done == n) {
+      return n;
+    }
+  }
+
+  pthread_mutex_lock(&p->lock);
+  if (!p->thread_shutdown) {
+    pthread_mutex_unlock(&p->lock);
+    return done > 0 ? done : -1;
+  }
+
+  if (in_worker) {
+    // 本地队列放不下的放入共享队列和其他节点，仍然放不下的在当前工作线程中执行，
+    // 与 AddTask 一样，工作线程不阻塞等待
+    int put = PutBatchLocked(p, tasks + done, n - done, now);
+    SignalLocked(p, put);
+    CheckBacklogLocked(p);
+    pthread_mutex_unlock(&p->lock);
+    done += put;
+    done += SpillBatch(home, tasks + done, n - done, now);
+    for (; done < n; ++done) {
+      RunInline(p, tasks[done]);
+    }
+    return n;
+  }
+
+  // 有多个子线程池时先不等待地放入本节点和其他节点
+  if (pool_count_ > 1) {
+    done = PutBatchLocked(p, tasks, n, now);
+    SignalLocked(p, done);
+    CheckBacklogLocked(p);
+    pthread_mutex_unlock(&p->lock);
+    done += SpillBatch(home, tasks + done, n - done, now);
+    if (done > 0) {
+      return done;
+    }
+    pthread_mutex_lock(&p->lock);
+  }
+
+  // 与 ProducerAdd 一样，第一个任务的通道满时等待，直到至少可以放入一个任务
+  lane_t* first = &p->lanes[LaneOf(p, tasks[0].lane)];
+  while (first->size == first->cap && p->thread_shutdown) {
+    pthread_cond_wait(&first->not_full, &p->lock);
+  }
+  if (!p->thread_shutdown) {
+    pthread_mutex_unlock(&p->lock);
+    return -1;
+  }
+  done = PutBatchLocked(p, tasks, n, now);
+  SignalLocked(p, done);
+  CheckBacklogLocked(p);
+  pthread_mutex_unlock(&p->lock);
+  return done;
+}
+
+// 连续的同一通道的任务一起拷贝
+int ThreadPool::PutBatchLocked(pool_t* p, const task_t* tasks, int n,
+                               long long now) {
+  int done = 0;
+  while (done < n) {
+    int lane = LaneOf(p, tasks[done].lane);
+    int run = 1;
+    while (done + run < n && LaneOf(p, tasks[done + run].lane) == lane) {
+      ++run;
+    }
+    int put = PutLocked(p, lane, tasks + done, run, now);
+    done += put;
+    if (put < run) {
+      break;
+    }
+  }
+  return done;
+}
+
+// 把最多 n 个任务拷贝到通道的环形队列，环绕时分两段拷贝，调用者需持有 lock
+int ThreadPool::PutLocked(pool_t* p, int lane, const task_t* tasks, int n,
+                          long long now) {
+  lane_t* l = &p->lanes[lane];
+  int room = l->cap - l->size;
+  if (n > room) {
+    n = room;
+  }
+  int first = l->cap - l->front;
+  if (first > n) {
+    first = n;
+  }
+  memcpy(&l->ring[l->front], tasks, sizeof(task_t) * first);
+  memcpy(&l->ring[0], tasks + first, sizeof(task_t) * (n - first));
+  for (int i = 0; i < n; ++i) {
+    task_t* t = &l->ring[(l->front + i) % l->cap];
+    t->enqueue_ns = now;
+    t->lane = lane;
+  }
+  // 更新队头指针，通道和共享队列中的任务数加n
+  l->front = (l->front + n) % l->cap;
+  l->size += n;
+  p->queue_cur_size += n;
+  return n;
+}
+
+// 严格优先级时取优先级最高的非空通道；否则按权重轮流，每条通道一轮最多取
+// weight 个任务，低优先级的通道不会被饿死
+void ThreadPool::TakeLocked(pool_t* p, task_t* task) {
+  int i = 0;
+  if (p->lane_policy.strict) {
+    while (p->lanes[i].size == 0) {
+      ++i;
+    }
+  } else {
+    // 当前通道这一轮的额度用完或者没有任务时轮到下一条通道
+    while (p->lane_credit == 0 || p->lanes[p->lane_cursor].size == 0) {
+      p->lane_cursor = (p->lane_cursor + 1) % p->lane_count;
+      p->lane_credit = p->lanes[p->lane_cursor].weight;
+    }
+    i = p->lane_cursor;
+    --(p->lane_credit);
+  }
+
+  lane_t* l = &p->lanes[i];
+  *task = l->ring[l->rear];
+  // 更新队列尾指针
+  l->rear = (l->rear + 1) % l->cap;
+  // 任务队列中任务的数量减1
+  --(l->size);
+  --(p->queue_cur_size);
+  // 溢出链表中最早的任务补进腾出的位置，溢出的任务比等待的生产者先提交，
+  // 通道仍然是满的，不通知生产者
+  if (l->overflow_head != NULL) {
+    overflow_t* node = l->overflow_head;
+    l->overflow_head = node->next;
+    if (l->overflow_head == NULL) {
+      l->overflow_tail = NULL;
+    }
+    --(p->overflow_size);
+    l->ring[l->front] = node->task;
+    l->front = (l->front + 1) % l->cap;
+    ++(l->size);
+    ++(p->queue_cur_size);
+    free(node);
+    return;
+  }
+  // 通知往这条通道提交的生产者可以添加新的任务
+  pthread_cond_signal(&l->not_full);
+}
+
+void ThreadPool::Execute(worker_t* w, task_t* task) {
+  pool_t* p = w->pool;
+  long long start = NowNs();
+  if (!Admit(w, task, start)) {
+    return;
+  }
+  // 繁忙线程数只用于统计，原子加减即可，不必再加两次锁
+  p->thread_busy.fetch_add(1, std::memory_order_relaxed);
+  RunTask(task);
+  p->thread_busy.fetch_sub(1, std::memory_order_relaxed);
+  w->run_time.Record(NowNs() - start);
+}
+
+// 过期的任务交给 on_expire 后丢弃，不执行
+bool ThreadPool::Admit(worker_t* w, task_t* task, long long now) {
+  pool_t* p = w->pool;
+  NoteWait(w, *task, now);
+  if (task->timeout_us == 0 ||
+      now - task->enqueue_ns <= task->timeout_us * 1000LL) {
+    return true;
+  }
+  p->tasks_expired.fetch_add(1, std::memory_order_relaxed);
+  if (p->lane_policy.on_expire != NULL) {
+    p->lane_policy.on_expire(task, p->lane_policy.on_expire_arg);
+  }
+  DiscardTask(task);
+  return false;
+}
+
+// 放入了 n 个任务，自旋的线程会自己取到任务，只唤醒不够的部分，
+// 没有线程睡眠时不必通知，忙碌的线程做完手头的任务会来取。调用者需持有 lock
+void ThreadPool::SignalLocked(pool_t* p, int n) {
+  n -= p->thread_spinning.load(std::memory_order_relaxed);
+  if (n <= 0 || p->parked_count == 0) {
+    return;
+  }
+  UnparkLocked(p, n);
+}
+
+// 唤醒的线程由唤醒者从 parked 中移除，同一个线程不会被唤醒两次
+void ThreadPool::UnparkLocked(pool_t* p, int n) {
+  while (n-- > 0 && p->parked_count > 0) {
+    worker_t* w = p->parked[--(p->parked_count)];
+    p->thread_sleeping.fetch_sub(1, std::memory_order_relaxed);
+    w->park_word.store(1, std::memory_order_release);
+    syscall(SYS_futex, (uint32_t*)&w->park_word, FUTEX_WAKE_PRIVATE, 1, NULL,
+            NULL, 0);
+  }
+}
+
+bool ThreadPool::HasWork(pool_t* p) {
+  if (p->queue_cur_size.load(std::memory_order_relaxed) > 0) {
+    return true;
+  }
+  return p->mode == kPoolWorkStealing && !DequesEmpty(p);
+}
+
+// 先 pause 自旋，再 sched_yield，同时自旋的线程不超过 max_spinners，
+// 超过的直接去睡眠。任务在自旋期间到达时提交者不需要唤醒任何线程
+bool ThreadPool::SpinForWork(worker_t* w) {
+  pool_t* p = w->pool;
+  const PoolIdlePolicy& idle = p->idle;
+  if (idle.spin_us <= 0 && idle.yield_us <= 0) {
+    return false;
+  }
+  int spinning = p->thread_spinning.load(std::memory_order_relaxed);
+  do {
+    if (spinning >= idle.max_spinners) {
+      return false;
+    }
+  } while (!p->thread_spinning.compare_exchange_weak(
+      spinning, spinning + 1, std::memory_order_seq_cst));
+
+  long long now = NowNs();
+  long long spin_end = now + idle.spin_us * 1000LL;
+  long long yield_end = spin_end + idle.yield_us * 1000LL;
+  bool found = false;
+  for (unsigned i = 1;; ++i) {
+    if (HasWork(p) || !p->thread_shutdown) {
+      found = true;
+      break;
+    }
+    // 自旋时每隔一段时间才看一次时钟
+    if (now < spin_end) {
+      CpuRelax();
+      if (i % 64 == 0) {
+        now = NowNs();
+      }
+      continue;
+    }
+    now = NowNs();
+    if (now >= yield_end) {
+      break;
+    }
+    sched_yield();
+  }
+  // 停止自旋之后还要在 lock 内再检查一次才睡眠，这期间提交的任务不会丢失
+  p->thread_spinning.fetch_sub(1, std::memory_order_seq_cst);
+  return found;
+}
+
+// 先登记为睡眠线程再检查一次所有队列：提交任务的线程要么看到登记并唤醒，
+// 要么在此之前已经放入了任务（这里的检查能看到）
+bool ThreadPool::ParkLocked(worker_t* w) {
+  pool_t* p = w->pool;
+  w->park_word.store(0, std::memory_order_relaxed);
+  p->parked[p->parked_count++] = w;
+  p->thread_sleeping.fetch_add(1, std::memory_order_seq_cst);
+  if (HasWork(p) || !p->thread_shutdown) {
+    RemoveParked(p, w);
+    return true;
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  int idle_ms = p->scale.idle_timeout_ms;
+  long long deadline = idle_ms > 0 ? NowNs() + idle_ms * 1000000LL : -1;
+  while (w->park_word.load(std::memory_order_acquire) == 0) {
+    struct timespec rel = {0, 0};
+    struct timespec* wait = NULL;
+    if (deadline >= 0) {
+      long long left = deadline - NowNs();
+      if (left <= 0) {
+        break;
+      }
+      rel.tv_sec = left / 1000000000;
+      rel.tv_nsec = left % 1000000000;
+      wait = &rel;
+    }
+    syscall(SYS_futex, (uint32_t*)&w->park_word, FUTEX_WAIT_PRIVATE, 0, wait,
+            NULL, 0);
+  }
+
+  pthread_mutex_lock(&p->lock);
+  // 超时之后、加锁之前可能刚好被唤醒，以 park_word 为准
+  if (w->park_word.load(std::memory_order_relaxed) != 0) {
+    return true;
+  }
+  RemoveParked(p, w);
+  return false;
 }
 
 // 工作线程（消费者）函数，从任务队列中取出任务并执行
 void* ThreadPool::Custom(void* arg) {
-  // 获取线程池对象指针
-  pool_t* p = (pool_t*)arg;
+  // 获取工作线程槽位和线程池对象指针
+  worker_t* w = (worker_t*)arg;
+  pool_t* p = w->pool;
+  tls_worker = w;
+  if (p->mode == kPoolWorkStealing) {
+    return StealLoop(w);
+  }
+
   task_t task;
   while (p->thread_shutdown) {
     // 上锁
     pthread_mutex_lock(&p->lock);
 
-    // 如果任务队列为空且称线程池未关闭, 等待生产者通知
-    // 再次判断线程池未关闭是为了防止在上锁完毕后线程池异常关闭
-    while (p->queue_cur_size == 0 && p->thread_shutdown) {
-      pthread_cond_wait(&p->not_empty, &p->lock);
+    // 如果任务队列为空，先按空闲策略自旋，仍然没有任务再睡眠等待生产者唤醒
+    // 空闲超过 idle_timeout_ms 时醒来，多于最小线程数时退出
+    bool timeout = false;
+    if (p->queue_cur_size == 0) {
+      pthread_mutex_unlock(&p->lock);
+      w->wait_ewma_ns.store(0, std::memory_order_relaxed);
+      if (SpinForWork(w)) {
+        continue;
+      }
+      pthread_mutex_lock(&p->lock);
+      timeout = !ParkLocked(w);
     }
 
     // 如果线程池关闭了
     if (!p->thread_shutdown) {
       pthread_mutex_unlock(&p->lock);
       // 结束此线程
+      w->exited = true;
       pthread_exit(NULL);
     }
 
-    // 等待关闭的线程数大于0，且当前存活的线程数大于最小线程数则结束此线程
-    if (p->thread_wait > 0 && p->thread_alive > p->thread_min) {
-      //等待关闭的线程数减1
-      --(p->thread_wait);
-      // 存活的线程数减1
-      --(p->thread_alive);
-      // 解锁
+    // 空闲超时仍然没有任务，当前存活的线程数大于最小线程数则结束此线程
+    // 被唤醒后任务已经被自旋的线程取走时不退出
+    if (p->queue_cur_size == 0) {
+      if (timeout && p->thread_alive > p->thread_min) {
+        RetireWorker(w);
+      }
       pthread_mutex_unlock(&p->lock);
-      // 结束此线程
-      pthread_exit(NULL);
+      continue;
     }
 
-    // 取出任务
-    task.task = p->queue_task[p->queue_rear].task;
-    task.arg = p->queue_task[p->queue_rear].arg;
-    // 更新队列尾指针
-    (p->queue_rear) = (p->queue_rear + 1) % p->queue_cur_size;
-    // 任务队列中任务的数量减1 
-    --(p->queue_cur_size);
-    // 通知生产者线程可以添加新的任务
-    pthread_cond_signal(&p->not_full); 
-    // 繁忙线程数加1
-    ++(p->thread_busy);
+    // 按通道策略取出任务
+    TakeLocked(p, &task);
+    // 唤醒时没有算上的任务由取到任务的线程接着唤醒下一个
+    if (p->queue_cur_size > 0) {
+      SignalLocked(p, 1);
+    }
     // 解锁
     pthread_mutex_unlock(&p->lock);
-    
+
     // 执行任务
-    (*task.task)(task.arg);
-    // 上锁
+    Execute(w, &task);
+  }
+  w->exited = true;
+  return 0;
+}
+
+// 工作窃取模式下的工作线程：
+// 依次从本地队列、共享队列、其他线程的本地队列取任务，都没有任务时睡眠
+void* ThreadPool::StealLoop(worker_t* w) {
+  pool_t* p = w->pool;
+  task_t task;
+  while (p->thread_shutdown) {
+    if (w->deque->Pop(&task) || TakeInjected(w, &task) ||
+        StealOther(w, &task)) {
+      Execute(w, &task);
+      continue;
+    }
+
+    if (SpinForWork(w)) {
+      continue;
+    }
+
     pthread_mutex_lock(&p->lock);
-    // 繁忙线程的数量减1
-    --(p->thread_busy);
-    // 解锁
+    w->wait_ewma_ns.store(0, std::memory_order_relaxed);
+    bool timeout = !ParkLocked(w);
+
+    if (!p->thread_shutdown) {
+      pthread_mutex_unlock(&p->lock);
+      w->exited = true;
+      pthread_exit(NULL);
+    }
+    // 只有自己会往本地队列放任务，走到这里本地队列一定是空的，可以直接退出
+    if (timeout && !HasWork(p) && p->thread_alive > p->thread_min) {
+      RetireWorker(w);
+    }
     pthread_mutex_unlock(&p->lock);
   }
+  w->exited = true;
   return 0;
 }
 
+// 空闲超时的线程退出：先在锁内减少存活线程数，保证同时超时的线程不会
+// 退出到最小线程数以下，再在锁外通知观察者
+void ThreadPool::RetireWorker(worker_t* w) {
+  pool_t* p = w->pool;
+  int before = p->thread_alive;
+  --(p->thread_alive);
+  p->threads_retired.fetch_add(1, std::memory_order_relaxed);
+  int depth = p->queue_cur_size;
+  pthread_mutex_unlock(&p->lock);
+  EmitScale(p, kPoolScaleIdle, before, before - 1, depth);
+  w->exited = true;
+  pthread_exit(NULL);
+}
+
+// 用本线程取到的任务的排队时间更新 EWMA
+// 每个线程只写自己的 EWMA，不与其他线程争用缓存行，由管理者线程汇总
+void ThreadPool::NoteWait(worker_t* w, const task_t& task, long long now) {
+  pool_t* p = w->pool;
+  long long wait = now - task.enqueue_ns;
+  if (wait < 0) {
+    wait = 0;
+  }
+  w->queue_wait.Record(wait);
+  long long ewma = w->wait_ewma_ns.load(std::memory_order_relaxed);
+  ewma += (long long)((wait - ewma) * p->scale.ewma_alpha);
+  w->wait_ewma_ns.store(ewma, std::memory_order_relaxed);
+
+  // 排队时间过长，不必等到管理者线程的下一次检查
+  if (ewma > p->scale.grow_wait_us * 1000LL &&
+      p->thread_alive < p->thread_max &&
+      !p->grow_requested.load(std::memory_order_relaxed)) {
+    pthread_mutex_lock(&p->lock);
+    RequestGrowLocked(p);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+void ThreadPool::RequestGrowLocked(pool_t* p) {
+  if (!p->grow_requested.exchange(true, std::memory_order_relaxed)) {
+    pthread_cond_signal(&p->manager_wake);
+  }
+}
+
+// 没有空闲线程且队列长度超过 grow_depth * 存活线程数，或者排队时间过长
+void ThreadPool::CheckBacklogLocked(pool_t* p) {
+  int alive = p->thread_alive;
+  if (alive >= p->thread_max || p->thread_sleeping > 0 ||
+      p->thread_spinning > 0) {
+    return;
+  }
+  if (p->queue_cur_size > p->scale.grow_depth * (alive > 0 ? alive : 1) ||
+      p->wait_ewma_ns.load(std::memory_order_relaxed) >
+          p->scale.grow_wait_us * 1000LL) {
+    RequestGrowLocked(p);
+  }
+}
+
+void ThreadPool::EmitScale(pool_t* p, PoolScaleReason reason, int before,
+                           int after, int depth) {
+  if (p->scale.on_scale == NULL) {
+    return;
+  }
+  PoolScaleEvent event;
+  event.reason = reason;
+  event.threads_before = before;
+  event.threads_after = after;
+  event.wait_ewma_ns = p->wait_ewma_ns.load(std::memory_order_relaxed);
+  event.depth_ewma = p->depth_ewma.load(std::memory_order_relaxed);
+  event.depth = depth;
+  p->scale.on_scale(&event, p->scale.on_scale_arg);
+}
+
+PoolScaleStats ThreadPool::GetScaleStats() const {
+  PoolScaleStats stats;
+  memset(&stats, 0, sizeof(stats));
+  for (int i = 0; i < pool_count_; ++i) {
+    pool_t* p = pools_[i];
+    stats.threads_alive += p->thread_alive;
+    stats.threads_sleeping += p->thread_sleeping;
+    stats.threads_spinning += p->thread_spinning;
+    stats.queue_depth += p->queue_cur_size;
+    stats.wait_ewma_ns += p->wait_ewma_ns.load(std::memory_order_relaxed);
+    stats.depth_ewma += p->depth_ewma.load(std::memory_order_relaxed);
+    stats.threads_spawned += p->threads_spawned;
+    stats.threads_retired += p->threads_retired;
+  }
+  if (pool_count_ > 0) {
+    stats.wait_ewma_ns /= pool_count_;
+  }
+  return stats;
+}
+
+void ThreadPool::GetStatsSnapshot(PoolStatsSnapshot* out) const {
+  out->tasks_submitted = 0;
+  out->tasks_rejected = 0;
+  out->tasks_completed = 0;
+  out->tasks_inline = 0;
+  out->tasks_stolen = 0;
+  out->tasks_expired = 0;
+  out->threads_spawned = 0;
+  out->threads_retired = 0;
+  out->threads_alive = 0;
+  out->threads_busy = 0;
+  out->queue_depth = 0;
+  out->overflow_depth = 0;
+  out->queue_wait.Clear();
+  out->run_time.Clear();
+  for (int i = 0; i < pool_count_; ++i) {
+    pool_t* p = pools_[i];
+    out->tasks_submitted += p->tasks_submitted.load(std::memory_order_relaxed);
+    out->tasks_rejected += p->tasks_rejected.load(std::memory_order_relaxed);
+    out->tasks_inline += p->tasks_inline.load(std::memory_order_relaxed);
+    out->tasks_expired += p->tasks_expired.load(std::memory_order_relaxed);
+    out->threads_spawned += p->threads_spawned;
+    out->threads_retired += p->threads_retired;
+    out->threads_alive += p->thread_alive;
+    out->threads_busy += p->thread_busy;
+    out->queue_depth += p->queue_cur_size;
+    out->overflow_depth += p->overflow_size;
+    // 槽位不会被释放，已经退出的线程的统计也在里面
+    for (int k = 0; k < p->thread_max; ++k) {
+      worker_t* w = &p->workers[k];
+      out->tasks_submitted +=
+          w->tasks_submitted.load(std::memory_order_relaxed);
+      out->tasks_stolen += w->tasks_stolen.load(std::memory_order_relaxed);
+      w->queue_wait.MergeInto(&out->queue_wait);
+      w->run_time.MergeInto(&out->run_time);
+    }
+  }
+  out->tasks_completed = out->run_time.count + out->tasks_inline;
+}
+
+// 从共享队列取出一个任务，按存活线程数平分，顺带搬一批到本地队列，
+// 减少对共享队列锁的争用，搬来的任务其他线程可以再窃取
+bool ThreadPool::TakeInjected(worker_t* w, task_t* task) {
+  pool_t* p = w->pool;
+  if (p->queue_cur_size.load(std::memory_order_relaxed) == 0) {
+    return false;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  int n = p->queue_cur_size;
+  if (n == 0) {
+    pthread_mutex_unlock(&p->lock);
+    return false;
+  }
+  // 本地队列此时是空的，容量不小于 queue_max，搬来的任务一定放得下
+  int batch = n / (p->thread_alive + 1) + 1;
+  if (batch > _DEF_INJECT_BATCH) {
+    batch = _DEF_INJECT_BATCH;
+  }
+  if (batch > p->queue_max) {
+    batch = p->queue_max;
+  }
+
+  TakeLocked(p, task);
+  task_t moved[_DEF_INJECT_BATCH];
+  int taken = 1;
+  while (taken < batch && p->queue_cur_size > 0) {
+    TakeLocked(p, &moved[taken - 1]);
+    ++taken;
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  // 本地队列后进先出，倒着放入才能按通道策略取出的顺序执行
+  for (int i = taken - 2; i >= 0; --i) {
+    w->deque->Push(moved[i]);
+  }
+  // 搬到本地队列的任务可以被其他空闲线程窃取
+  WakeSome(p, taken - 1);
+  return true;
+}
+
+// 从随机的位置开始依次尝试其他线程的本地队列
+bool ThreadPool::StealOther(worker_t* w, task_t* task) {
+  pool_t* p = w->pool;
+  int n = p->thread_max;
+  int start = rand_r(&w->seed) % n;
+  for (int k = 0; k < n; ++k) {
+    worker_t* victim = &p->workers[(start + k) % n];
+    if (victim == w) {
+      continue;
+    }
+    // Steal 失败也可能只是与其他线程竞争，队列还有任务就继续尝试
+    while (!victim->deque->isEmpty()) {
+      if (victim->deque->Steal(task)) {
+        w->tasks_stolen.store(
+            w->tasks_stolen.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// 线程都已经退出，依次丢弃各通道和本地队列中剩下的任务
+void ThreadPool::DiscardTasks(pool_t* p) {
+  task_t task;
+  while (p->queue_cur_size > 0) {
+    TakeLocked(p, &task);
+    DiscardTask(&task);
+  }
+  for (int i = 0; i < p->thread_max; ++i) {
+    while (p->workers[i].deque != NULL && p->workers[i].deque->Pop(&task)) {
+      DiscardTask(&task);
+    }
+  }
+}
+
+bool ThreadPool::DequesEmpty(pool_t* p) {
+  for (int i = 0; i < p->thread_max; ++i) {
+    if (!p->workers[i].deque->isEmpty()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// 与 ParkLocked 中 "登记睡眠 -> 检查所有队列" 配对，保证不会丢失唤醒
+// 没有线程睡眠时只多一次原子读，不加锁
+void ThreadPool::WakeSome(pool_t* p, int n) {
+  if (n <= 0) {
+    return;
+  }
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (p->thread_sleeping.load(std::memory_order_relaxed) > 0) {
+    pthread_mutex_lock(&p->lock);
+    SignalLocked(p, n);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+// 在槽位 i 上创建工作线程，槽位上之前的线程已经退出时先回收它
+bool ThreadPool::SpawnWorker(pool_t* p, int i) {
+  worker_t* w = &p->workers[i];
+  if (w->started) {
+    pthread_join(p->tids[i], NULL);
+    w->started = false;
+  }
+  w->exited = false;
+
+  // 绑定 CPU 的线程在创建时就设置亲和性，线程栈从一开始就在本节点上分配
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (p->pinned) {
+    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &p->cpus);
+  }
+  int err = pthread_create(&p->tids[i], &attr, Custom, (void*)w);
+  pthread_attr_destroy(&attr);
+  if (err != 0) {
+    printf("create custom error:%s\n", strerror(err));
+    return false;
+  }
+  w->started = true;
+  w->wait_ewma_ns = 0;
+  // 存活的线程数加1
+  ++(p->thread_alive);
+  p->threads_spawned.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
 // 线程池管理线程函数
-// 检测线程池中存活线程的数量，并根据存活数量，空闲数量，忙碌线程数量之间的关系
-// 来动态调整线程池中的线程的数量
-// 管理线程每执行一次就会 sleep 一定时间，节省 cpu 资源，而不是一直占用cpu
+// 平时睡眠，任务积压时被提交任务的线程或工作线程立即唤醒，否则每隔 tick_ms
+// 采样一次：汇总各线程的排队时间 EWMA，更新队列长度的 EWMA，没有空闲线程且
+// 排队时间或队列长度超过阈值时扩容。缩容由空闲超时的工作线程自己完成
 void* ThreadPool::Manager(void* arg) {
   // 获取线程池对象指针
   pool_t* p = (pool_t*)arg;
-  
-  // 存储线程池中相关属性的副本
-  int alive = 0;
-  int cur_size = 0;
-  int busy = 0;
-  int add = 0;
-  
+  const PoolScalePolicy& s = p->scale;
+  long long last_grow_ns = 0;
+
   while (p->thread_shutdown) {
-    // 上锁
+    // 等待扩容请求或下一次检查，销毁线程池时被提前唤醒
+    struct timespec deadline = Deadline(s.tick_ms);
     pthread_mutex_lock(&p->lock);
-    // 存活线程的数量
-    alive = p->thread_alive;
-    // 繁忙线程的线程数
-    busy = p->thread_busy;
-    // 当前任务队列汇中的任务数
-    cur_size = p->queue_cur_size;
-    // 解锁
+    while (p->thread_shutdown && !p->grow_requested) {
+      if (pthread_cond_timedwait(&p->manager_wake, &p->lock, &deadline) ==
+          ETIMEDOUT) {
+        break;
+      }
+    }
+    bool requested = p->grow_requested.exchange(false);
+    // 存储线程池中相关属性的副本
+    int alive = p->thread_alive;
+    int sleeping = p->thread_sleeping + p->thread_spinning;
+    int depth = p->queue_cur_size;
     pthread_mutex_unlock(&p->lock);
+    if (!p->thread_shutdown) {
+      break;
+    }
 
-    // 当前任务队列中的任务数大于存活线程的空闲数量，或繁忙线程的占比大于等于80%
-    // 且存活的线程数小于最大线程数 增加新的工作线程。
-    if ((cur_size > alive - busy) || (float)busy / alive * 100 >= (float)80 &&
-        p->thread_max > alive) {
-
-      // 一次性添加 thread_min 个新线程
-      for (int j = 0; j < p->thread_min; ++j) {
-        for (int i = 0; i < p->thread_max; ++i) {
-          // 该线程不存在或已经结束
-          if (p->tids[i] == 0 || !IfThreadAlive(p->tids[i])) {
-            // 上锁
-            pthread_mutex_lock(&p->lock);
-            // 创建新的工作线程
-            pthread_create(&p->tids[i], NULL, Custom, (void*)p);
-            // 存活的线程数加1
-            ++(p->thread_alive);
-            // 解锁
-            pthread_mutex_unlock(&p->lock);
-            break;
-          }
-        }
+    // 汇总存活线程的排队时间 EWMA
+    long long wait_sum = 0;
+    int n = 0;
+    for (int i = 0; i < p->thread_max; ++i) {
+      worker_t* w = &p->workers[i];
+      if (w->started && !w->exited) {
+        wait_sum += w->wait_ewma_ns.load(std::memory_order_relaxed);
+        ++n;
       }
     }
+    long long wait_ewma = n > 0 ? wait_sum / n : 0;
+    double depth_ewma = p->depth_ewma.load(std::memory_order_relaxed);
+    depth_ewma += (depth - depth_ewma) * s.ewma_alpha;
+    p->wait_ewma_ns.store(wait_ewma, std::memory_order_relaxed);
+    p->depth_ewma.store(depth_ewma, std::memory_order_relaxed);
 
-    // 繁忙的线程数小于存活线程数的 1/3 ，且存活的线程数大于最小线程数
-    // 用busy * 2 < alive - busy 来表示 < 1/3alive，秒啊
-    if (busy * 2 < alive - busy && alive > p->thread_min) {
-      // 上锁
-      pthread_mutex_lock(&p->lock);
-      // 设置需要等待关闭的线程数的默认值
-      p->thread_wait = _DEF_COUNT;
-      // 解锁
-      pthread_mutex_unlock(&p->lock);
-      // 通知工作线程有新的任务可以执行, 让其它们立即去执行多出来的任务
-      for (int i = 0; i < _DEF_COUNT; ++i) {
-        pthread_cond_signal(&p->not_empty);
+    // 决定是否扩容，有空闲线程时增加线程没有意义
+    int target = alive;
+    PoolScaleReason reason = kPoolScaleMin;
+    int depth_limit = s.grow_depth * (alive > 0 ? alive : 1);
+    if (alive < p->thread_min) {
+      target = p->thread_min;
+    } else if (sleeping == 0 && alive < p->thread_max &&
+               NowNs() - last_grow_ns >= s.grow_cooldown_ms * 1000000LL) {
+      if (wait_ewma > s.grow_wait_us * 1000LL) {
+        reason = kPoolScaleWait;
+      } else if (depth_ewma > depth_limit ||
+                 (requested && depth > depth_limit)) {
+        reason = kPoolScaleDepth;
+      }
+      if (reason != kPoolScaleMin) {
+        target = alive + (s.grow_step > 0 ? s.grow_step : p->thread_min);
+      }
+    }
+    if (target > p->thread_max) {
+      target = p->thread_max;
+    }
+    if (target <= alive) {
+      continue;
+    }
+
+    // 在空闲的槽位上创建新线程
+    pthread_mutex_lock(&p->lock);
+    int before = p->thread_alive;
+    for (int i = 0; i < p->thread_max && p->thread_alive < target; ++i) {
+      // 该槽位没有线程或线程已经结束
+      if (!p->workers[i].started || p->workers[i].exited) {
+        if (!SpawnWorker(p, i)) {
+          break;
+        }
       }
     }
-    // 线程挂起一段时间，节省 cpu 资源
-    sleep(_DEF_TIMEOUT);
+    int after = p->thread_alive;
+    pthread_mutex_unlock(&p->lock);
+    last_grow_ns = NowNs();
+    if (after > before) {
+      EmitScale(p, reason, before, after, depth);
+    }
   }
   return 0;
 }
 
 // 检查线程是否存活
 // 通过将pthread_kill()函数的第二参数设为0，检查这个线程是否存活
-// 如果线程不存在设置错误码，通常是 ESRCH
+// 如果线程不存在返回错误码，通常是 ESRCH（pthread_kill 不设置 errno）
 bool ThreadPool::IfThreadAlive(pthread_t tid) {
-  if ((pthread_kill(tid, 0)) == -1) {
-    if (errno == ESRCH) {
-      return FALSE;
-    }
+  if (pthread_kill(tid, 0) == ESRCH) {
+    return FALSE;
   }
   return TRUE;
-}
\ No newline at end of file
+}
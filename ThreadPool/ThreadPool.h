@@ -1,84 +1,501 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
 #include <pthread.h>
 #include <unistd.h>
 #include <malloc.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sched.h>
 #include <iostream>
+#include <atomic>
+
+#include "WorkStealDeque.h"
+#include "TaskFuture.h"
+#include "CpuTopology.h"
+#include "LatencyHistogram.h"
 
 #define TRUE  true
 #define FALSE false
-#define _DEF_COUNT 10
-#define _DEF_TIMEOUT 10
 
-void err_str(const char* str,int err)
+inline void err_str(const char* str,int err)
 {
     perror(str);
     exit(err);
 }
 
 
-typedef  struct {
-  void* (*task)(void*);
-  void* arg;
+// 内联存储在任务中的可调用对象的最大字节数（3 个指针），使 task_t 正好占一个
+// 64 字节的缓存行
+#define _DEF_TASK_INLINE 24
+
+// 任务队列中的一个任务，必须是可平凡拷贝的，可以直接在队列之间拷贝
+typedef struct STR_TASK_T {
+  void* (*task)(void*); // C 风格的任务函数
+  void* arg; // C 风格任务的参数，Submit / Post 提交的任务用来指向堆上的对象
+  // Submit / Post 提交的任务不为 NULL：run 为真时执行，为假时只释放资源
+  void (*call)(STR_TASK_T*, bool run);
+  long long enqueue_ns; // 入队时间（CLOCK_MONOTONIC），用于统计排队时间，入队时填写
+  int lane; // 优先级通道，0 优先级最高，-1 使用默认通道
+  unsigned int timeout_us; // 入队后超过多少微秒仍未开始执行则过期，0 不过期
+  alignas(uintptr_t) unsigned char storage[_DEF_TASK_INLINE]; // 内联的可调用对象
 } task_t;
 
+static_assert(sizeof(task_t) <= 64, "task_t should fit in one cache line");
+
+// 执行一个任务
+inline void RunTask(task_t* t) {
+  if (t->call != NULL) {
+    t->call(t, true);
+  } else {
+    (*t->task)(t->arg);
+  }
+}
+
+// 丢弃一个没有执行的任务，释放 Submit / Post 任务持有的资源
+inline void DiscardTask(task_t* t) {
+  if (t->call != NULL) {
+    t->call(t, false);
+  }
+}
+
+// 线程池的调度方式
+enum PoolMode {
+  // 所有工作线程和生产者共用一个加锁的任务队列
+  kPoolShared = 0,
+  // 每个工作线程有一个本地的双端队列，工作线程内提交的任务放入本地队列，
+  // 外部提交的任务放入共享队列（注入队列），空闲的线程随机选择其他线程窃取任务
+  kPoolWorkStealing,
+};
+
+// 工作窃取模式下，空闲线程从共享队列一次最多搬到本地队列的任务数量
+#define _DEF_INJECT_BATCH 32
+
+// 优先级通道的最大数量
+#define _DEF_MAX_LANES 4
+
+// 优先级通道策略
+// 共享队列按优先级分成几条通道，每条通道是一个独立的环形队列，有自己的容量，
+// 一条通道满了只阻塞往这条通道提交的生产者
+// 工作窃取模式下工作线程提交到默认通道的任务仍然放入自己的本地队列，不参与优先级调度
+struct PoolLanePolicy {
+  PoolLanePolicy() : lanes(1), strict(false), default_lane(0),
+                     on_expire(NULL), on_expire_arg(NULL) {
+    for (int i = 0; i < _DEF_MAX_LANES; ++i) {
+      weights[i] = 1 << (_DEF_MAX_LANES - 1 - i);
+      depth_limits[i] = 0;
+    }
+  }
+
+  int lanes; // 通道数量，1 ~ _DEF_MAX_LANES，通道 0 优先级最高
+  bool strict; // 严格优先级：只要高优先级通道有任务就不取低优先级通道的任务
+  int default_lane; // ProducerAdd / Submit / Post 默认使用的通道
+  int weights[_DEF_MAX_LANES]; // 非严格模式下轮流取任务时每条通道每轮取几个，默认 8:4:2:1
+  int depth_limits[_DEF_MAX_LANES]; // 每条通道的容量，0 表示与任务队列大小相同
+  // 过期的任务不执行，先调用 on_expire（可以为 NULL），然后释放 Submit / Post
+  // 任务的资源（TaskFuture::Get 抛出异常）。在工作线程中执行，不持有锁
+  void (*on_expire)(task_t* task, void* arg);
+  void* on_expire_arg;
+};
+
+// 提交单个任务时的选项
+struct TaskOptions {
+  TaskOptions(int lane = -1, int timeout_ms = 0, int wait_ms = -1)
+      : lane(lane), timeout_ms(timeout_ms), wait_ms(wait_ms) {}
+
+  int lane; // 优先级通道，-1 使用默认通道
+  int timeout_ms; // 提交后超过多少毫秒仍未开始执行则过期，0 不过期
+  int wait_ms; // 通道满时最多等待多少毫秒，-1 一直等待，>= 0 等待之后按拒绝策略处理
+};
+
+// 提交任务的结果
+enum PoolSubmitResult {
+  kSubmitOk = 0, // 已经放入队列（或按拒绝策略在提交的线程中执行、放入溢出链表）
+  kSubmitClosed = -1, // 线程池没有创建或已经关闭
+  kSubmitRejected = -2, // 通道满，被拒绝策略拒绝
+};
+
+// 通道满且等待 wait_ms 之后仍然满时的处理方式
+enum PoolRejectMode {
+  kRejectAbort = 0, // 返回 kSubmitRejected，任务被释放
+  kRejectCallerRuns, // 在提交的线程中直接执行
+  kRejectDiscardOldest, // 丢弃同一通道中最早的任务，放入新任务
+  kRejectOverflow, // 放入通道的溢出链表（不限长度），通道有空位时按顺序补进通道
+};
+
+// 拒绝策略，只作用于不等待或限时等待的提交（TrySubmit / SubmitFor / TryPost /
+// PostFor，或 TaskOptions::wait_ms >= 0），一直等待的提交仍然阻塞在 not_full 上
+struct PoolRejectPolicy {
+  PoolRejectPolicy() : mode(kRejectAbort), high_watermark(0),
+                       on_high_watermark(NULL), on_discard(NULL), arg(NULL) {}
+
+  PoolRejectMode mode;
+  // 溢出链表的任务数每次涨到 high_watermark 时调用 on_high_watermark，0 不调用，
+  // 在提交任务的线程中执行，不持有锁
+  int high_watermark;
+  void (*on_high_watermark)(int depth, void* arg);
+  // kRejectDiscardOldest 丢弃任务时先调用 on_discard（可以为 NULL），然后释放
+  // Submit / Post 任务的资源，在提交任务的线程中执行，不持有锁
+  void (*on_discard)(task_t* task, void* arg);
+  void* arg;
+};
+
+// 溢出链表的节点
+typedef struct STR_OVERFLOW_T {
+  task_t task;
+  STR_OVERFLOW_T* next;
+} overflow_t;
+
+// 一条优先级通道
+typedef struct STR_LANE_T {
+  task_t* ring; // 环形队列
+  int cap; // 容量
+  int size; // 当前任务数量
+  int front; // 队头，下一个任务放入的位置
+  int rear; // 队尾，下一个取出的任务
+  int weight; // 每轮取几个任务
+  pthread_cond_t not_full; // 通道未满，唤醒往这条通道提交的生产者
+  overflow_t* overflow_head; // 溢出链表，只在 kRejectOverflow 时使用
+  overflow_t* overflow_tail;
+} lane_t;
+
+// 工作线程空闲时的等待策略
+// 队列空了之后先自旋（pause）spin_us 微秒，再 sched_yield 到 yield_us 微秒，
+// 期间来了任务不需要任何唤醒；之后在自己的 futex 上睡眠。提交任务时只有在没有
+// 线程自旋时才唤醒一个睡眠的线程
+struct PoolIdlePolicy {
+  PoolIdlePolicy() : spin_us(20), yield_us(50), max_spinners(1) {}
+
+  int spin_us; // 自旋多少微秒，0 不自旋，只有一个 CPU 时不自旋
+  int yield_us; // 自旋之后 sched_yield 多少微秒，0 不让出直接睡眠
+  int max_spinners; // 最多同时有几个线程自旋或让出，限制空转消耗的 CPU
+};
+
+// 工作线程的 CPU 亲和性
+// numa 为真时按 NUMA 节点把线程池拆成几个子线程池，每个子线程池有自己的任务队列、
+// 工作线程和管理者线程，最大 / 最小线程数按节点平分（向上取整），任务队列大小不变。
+// 提交任务时放入当前 CPU 所在节点的子线程池，满了再按距离由近到远放入其他节点
+struct PoolAffinityPolicy {
+  PoolAffinityPolicy() : pin(false), numa(false) { CPU_ZERO(&cpus); }
+
+  bool pin; // 把工作线程绑定到 cpus（numa 为真时总是绑定到本节点的 CPU）
+  bool numa; // 按 NUMA 节点拆成子线程池
+  cpu_set_t cpus; // 可以使用的 CPU，为空时使用进程当前的亲和性
+};
+
+// 线程数量变化的原因
+enum PoolScaleReason {
+  kPoolScaleMin = 0, // 存活线程少于最小线程数（例如创建线程失败后），补足
+  kPoolScaleWait, // 任务排队时间的 EWMA 超过 grow_wait_us，扩容
+  kPoolScaleDepth, // 平均每个线程的排队任务数超过 grow_depth，扩容
+  kPoolScaleIdle, // 线程空闲超过 idle_timeout_ms，退出
+};
+
+// 一次扩容或线程退出
+struct PoolScaleEvent {
+  PoolScaleReason reason;
+  int threads_before; // 变化前的存活线程数
+  int threads_after; // 变化后的存活线程数
+  long long wait_ewma_ns; // 做出决定时任务排队时间的 EWMA
+  double depth_ewma; // 做出决定时共享队列长度的 EWMA
+  int depth; // 做出决定时共享队列中的任务数
+};
+
+// 弹性伸缩策略
+// 扩容由管理者线程执行：提交任务时发现积压、或工作线程发现排队时间过长时立即
+// 唤醒管理者线程，否则每隔 tick_ms 检查一次；缩容由空闲超时的线程自己退出
+struct PoolScalePolicy {
+  PoolScalePolicy() : tick_ms(100), grow_wait_us(2000), grow_depth(4),
+                      grow_step(0), grow_cooldown_ms(50),
+                      idle_timeout_ms(30000), ewma_alpha(0.2),
+                      on_scale(NULL), on_scale_arg(NULL) {}
+
+  int tick_ms; // 管理者线程没有被唤醒时的检查间隔
+  int grow_wait_us; // 任务排队时间的 EWMA 超过多少微秒时扩容
+  int grow_depth; // 平均每个存活线程的排队任务数超过多少时扩容
+  int grow_step; // 每次扩容的线程数，0 表示 thread_min 个
+  int grow_cooldown_ms; // 两次扩容之间至少间隔多少毫秒，等新线程消化积压
+  int idle_timeout_ms; // 线程空闲超过多少毫秒退出（保留最小线程数），0 不退出
+  double ewma_alpha; // EWMA 中新样本的权重
+  // 每次扩容或线程退出时调用，在管理者线程或退出的工作线程中执行，不持有锁
+  void (*on_scale)(const PoolScaleEvent* event, void* arg);
+  void* on_scale_arg;
+};
+
+// 伸缩相关的统计
+struct PoolScaleStats {
+  int threads_alive; // 存活的线程数
+  int threads_sleeping; // 在 futex 上睡眠的线程数
+  int threads_spinning; // 正在自旋等待任务的线程数
+  int queue_depth; // 共享队列中的任务数
+  long long wait_ewma_ns; // 任务排队时间的 EWMA
+  double depth_ewma; // 共享队列长度的 EWMA
+  unsigned long long threads_spawned; // 累计创建的工作线程数
+  unsigned long long threads_retired; // 累计因空闲退出的工作线程数
+};
+
+// 线程池运行统计的快照，由 GetStatsSnapshot 合并各工作线程的统计得到
+struct PoolStatsSnapshot {
+  unsigned long long tasks_submitted; // 成功提交的任务数
+  unsigned long long tasks_rejected; // 被拒绝或被 kRejectDiscardOldest 丢弃的任务数
+  unsigned long long tasks_completed; // 执行完的任务数，包括 tasks_inline
+  // 没有入队、直接在提交的线程中执行的任务数（kRejectCallerRuns，或者工作窃取模式下
+  // 队列满时工作线程自己执行），这些任务不计入 queue_wait 和 run_time
+  unsigned long long tasks_inline;
+  unsigned long long tasks_stolen; // 从其他线程的本地队列窃取的任务数
+  unsigned long long tasks_expired; // 过期没有执行的任务数
+  unsigned long long threads_spawned; // 累计创建的工作线程数
+  unsigned long long threads_retired; // 累计因空闲退出的工作线程数
+  int threads_alive; // 存活的线程数
+  int threads_busy; // 正在执行任务的线程数
+  int queue_depth; // 共享队列中的任务数
+  int overflow_depth; // 溢出链表中的任务数
+  HistogramSnapshot queue_wait; // 从入队到开始执行的时间
+  HistogramSnapshot run_time; // 执行时间
+};
+
+struct STR_WORKER_T;
+
 typedef struct STR_POOL_T {
   /// @brief 构造函数
-  /// @param max_num 最大线程数量 
+  /// @param max_num 最大线程数量
   /// @param min_num 最小线程数量
   /// @param que_max 任务队列的大小
-  STR_POOL_T(int max_num, int min_num, int que_max);
+  /// @param mode 调度方式
+  /// @param scale 弹性伸缩策略
+  /// @param lane 优先级通道策略
+  /// @param idle 空闲等待策略
+  /// @param reject 拒绝策略
+  STR_POOL_T(int max_num, int min_num, int que_max, PoolMode mode,
+             const PoolScalePolicy& scale, const PoolLanePolicy& lane,
+             const PoolIdlePolicy& idle, const PoolRejectPolicy& reject);
 
   // 线程池相关参数
   int thread_max; // 最大线程数量
   int thread_min; // 最小线程数量
-  int thread_busy; // 繁忙线程数量
-  int thread_alive; // 存活的线程的数量
-  int thread_wait; // 需要关闭的线程数量
-  bool thread_shutdown; // 线程池关闭状态（初始化为TRUE, 表示开启）
+  std::atomic<int> thread_busy; // 繁忙线程数量，只用于统计，不需要加锁
+  std::atomic<int> thread_alive; // 存活的线程的数量，在 lock 内修改，可以不加锁读取
+  std::atomic<bool> thread_shutdown; // 线程池关闭状态（初始化为TRUE, 表示开启）
   pthread_t* tids; // 用于描述线程池的线程数组
   pthread_t mamger_tid; // 管理者线程的线程id
-  pthread_cond_t not_full; // 用于通知生产者可以继续生产的条件变量
-  pthread_cond_t not_empty; // 用于通知消费者可以取任务的条件变量
-
-  // 任务队列相关参数
-  task_t* queue_task; // 任务队列
-  int queue_max; // 最大任务数量
-  int queue_cur_size; // 当前任务队列的任务数量
-  int queue_front; // 任务队列对头
-  int queue_rear; // 任务队列队尾
+  pthread_cond_t manager_wake; // 销毁线程池时提前唤醒管理者线程
+
+  // 空闲等待相关参数
+  PoolIdlePolicy idle; // 空闲等待策略
+  std::atomic<int> thread_spinning; // 正在自旋等待任务的工作线程数量
+  std::atomic<int> thread_sleeping; // 在 futex 上睡眠的工作线程数量，在 lock 内修改
+  STR_WORKER_T** parked; // 睡眠的工作线程，后睡的先唤醒（缓存更热），在 lock 内修改
+  int parked_count; // parked 中的线程数量
+
+  // 任务队列相关参数（工作窃取模式下为注入队列）
+  int queue_max; // 每条通道默认的最大任务数量
+  std::atomic<int> queue_cur_size; // 所有通道的任务数量之和，在 lock 内修改
   pthread_mutex_t lock; // 用于锁住任务队列互斥锁
+
+  // 优先级通道相关参数
+  PoolLanePolicy lane_policy; // 通道策略
+  lane_t lanes[_DEF_MAX_LANES]; // 优先级通道，生产者在各自通道的 not_full 上等待
+  int lane_count; // 通道数量
+  int lane_cursor; // 非严格模式下当前轮到的通道
+  int lane_credit; // 当前通道这一轮还可以取几个任务
+  std::atomic<unsigned long long> tasks_expired; // 累计过期未执行的任务数
+  std::atomic<unsigned long long> tasks_submitted; // 不是工作线程提交的任务数
+  std::atomic<unsigned long long> tasks_rejected; // 被拒绝或丢弃的任务数
+  std::atomic<unsigned long long> tasks_inline; // 在提交的线程中直接执行的任务数
+
+  // 拒绝策略相关参数
+  PoolRejectPolicy reject; // 拒绝策略
+  std::atomic<int> overflow_size; // 所有通道的溢出链表中的任务数，在 lock 内修改
+
+  // 工作窃取相关参数
+  PoolMode mode; // 调度方式
+  STR_WORKER_T* workers; // 与 tids 一一对应的工作线程槽位
+
+  // CPU 亲和性相关参数
+  int node; // 在所属 ThreadPool 的子线程池中的下标
+  bool pinned; // 工作线程是否绑定到 cpus
+  cpu_set_t cpus; // 工作线程可以运行的 CPU
+
+  // 弹性伸缩相关参数
+  PoolScalePolicy scale; // 伸缩策略
+  std::atomic<bool> grow_requested; // 已经请求管理者线程扩容，在 lock 内设置
+  std::atomic<long long> wait_ewma_ns; // 各线程排队时间 EWMA 的平均值，管理者线程更新
+  std::atomic<double> depth_ewma; // 共享队列长度的 EWMA，管理者线程更新
+  std::atomic<unsigned long long> threads_spawned; // 累计创建的工作线程数
+  std::atomic<unsigned long long> threads_retired; // 累计因空闲退出的工作线程数
 } pool_t;
 
+// 一个工作线程槽位
+typedef struct STR_WORKER_T {
+  pool_t* pool; // 所属的线程池
+  int index; // 在 tids 中的下标
+  bool started; // 槽位上创建过线程且还没有被 join，在 lock 内修改
+  std::atomic<bool> exited; // 线程已经退出，槽位可以复用
+  WorkStealDeque<task_t>* deque; // 本地任务队列，只在工作窃取模式下创建
+  unsigned int seed; // 选择窃取对象的随机数种子
+  std::atomic<long long> wait_ewma_ns; // 本线程取到的任务排队时间的 EWMA
+  std::atomic<uint32_t> park_word; // futex 的等待字，睡眠前置 0，唤醒时置 1
+
+  // 以下统计只由本槽位的线程写入，槽位上的线程退出后保留，累计所有线程
+  std::atomic<unsigned long long> tasks_submitted; // 本线程提交的任务数
+  std::atomic<unsigned long long> tasks_stolen; // 本线程窃取的任务数
+  LatencyHistogram queue_wait; // 本线程取到的任务的排队时间
+  LatencyHistogram run_time; // 本线程执行任务的时间
+} worker_t;
+
 
 // 线程池管理类
 class ThreadPool {
  public:
+  ThreadPool() : pool_count_(0) {}
+
   /// @brief 创建一个线程池
   /// @param  线程池的最大线程数
   /// @param  最小线程数
-  /// @param  任务队列的最大任务数量
+  /// @param  任务队列的最大任务数量（工作窃取模式下也是每个本地队列的大小）
+  /// @param  调度方式
+  /// @param  弹性伸缩策略
+  /// @param  优先级通道策略
+  /// @param  空闲等待策略
+  /// @param  CPU 亲和性
+  /// @param  拒绝策略
   /// @return 成功返回真
-  bool CreatePool(int, int, int);
-  
-  /// @brief 销毁一个线程池
+  bool CreatePool(int, int, int, PoolMode mode = kPoolShared,
+                  const PoolScalePolicy& scale = PoolScalePolicy(),
+                  const PoolLanePolicy& lanes = PoolLanePolicy(),
+                  const PoolIdlePolicy& idle = PoolIdlePolicy(),
+                  const PoolAffinityPolicy& affinity = PoolAffinityPolicy(),
+                  const PoolRejectPolicy& reject = PoolRejectPolicy());
+
+  /// @brief 销毁一个线程池，等待所有线程退出，还没有执行的任务被丢弃
   void DestroyPool();
-  
+
   /// @brief 生产者往任务队列中添加任务
+  /// 工作窃取模式下，在本线程池的工作线程中调用时放入该线程的本地队列
   /// @param  任务的函数指针
   /// @param  任务的参数
   /// @return 成功返回0，失败返回-1
   int ProducerAdd(void*(*)(void*), void*);
-  
+
+  /// @brief 指定优先级通道和过期时间添加任务，通道满时只等待这条通道，
+  /// 最多等待 opts.wait_ms 毫秒，之后按拒绝策略处理
+  /// @return PoolSubmitResult
+  int ProducerAdd(void*(*)(void*), void*, const TaskOptions& opts);
+
+  /// @brief 批量添加任务，整批只加一次锁，最多唤醒 min(n, 睡眠线程数) 个线程
+  /// 队列满时与 ProducerAdd 一样等待，直到至少可以放入一个任务；
+  /// 队列只放得下一部分时只放入前面的一部分，调用者可以稍后提交剩下的任务
+  /// @param tasks 任务数组，C 风格的任务可以写成 task_t t = {func, arg};
+  ///        lane 和 timeout_us 分别指定通道和过期时间，只等待第一个任务的通道
+  /// @param n 任务数量
+  /// @return 实际放入的任务数量（tasks 的前若干个），线程池已经关闭返回-1
+  int ProducerAddBatch(const task_t* tasks, int n);
+
+  /// @brief 提交一个任务并取得结果句柄
+  /// 可调用对象和参数被移动到与结果共享的状态中，整个任务只有一次堆分配；
+  /// 可调用对象抛出的异常在 TaskFuture::Get 中重新抛出
+  /// @param f 可调用对象，可以是只能移动的类型
+  /// @param args 参数，以右值传给 f
+  /// @return 结果句柄，线程池已经关闭时 Get 抛出异常
+  template<typename F, typename... Args>
+  TaskFuture<decltype(std::declval<typename std::decay<F>::type>()(
+      std::declval<typename std::decay<Args>::type>()...))>
+  Submit(F&& f, Args&&... args);
+
+  /// @brief 提交一个不需要结果的任务
+  /// 可平凡拷贝且不超过 _DEF_TASK_INLINE（24）字节的可调用对象（例如只捕获
+  /// 指针和整数的 lambda）直接存储在任务队列的格子里，不分配内存。
+  /// task_t 在队列之间逐字节拷贝，所以只能移动的对象以及捕获了 std::string、
+  /// std::shared_ptr 等非平凡成员的对象不能内联，会移动到堆上，每个任务一次分配。
+  /// 异常不会被捕获
+  /// @return 成功返回0，线程池已经关闭返回-1
+  template<typename F>
+  int Post(F&& f);
+
+  /// @brief 指定优先级通道和过期时间的 Submit，过期的任务 Get 抛出异常
+  template<typename F, typename... Args>
+  TaskFuture<decltype(std::declval<typename std::decay<F>::type>()(
+      std::declval<typename std::decay<Args>::type>()...))>
+  SubmitWith(const TaskOptions& opts, F&& f, Args&&... args);
+
+  /// @brief 指定优先级通道和过期时间的 Post，通道满且等待 opts.wait_ms 毫秒后
+  /// 仍然满时按拒绝策略处理
+  /// @return PoolSubmitResult，没有放入时可调用对象被销毁
+  template<typename F>
+  int PostWith(const TaskOptions& opts, F&& f);
+
+  /// @brief 不等待的 Submit，通道满时按拒绝策略处理，不会阻塞调用者
+  /// @return 结果句柄，被拒绝时 Get 抛出 "task rejected"
+  template<typename F, typename... Args>
+  TaskFuture<decltype(std::declval<typename std::decay<F>::type>()(
+      std::declval<typename std::decay<Args>::type>()...))>
+  TrySubmit(F&& f, Args&&... args);
+
+  /// @brief 通道满时最多等待 wait_ms 毫秒的 Submit，之后按拒绝策略处理
+  template<typename F, typename... Args>
+  TaskFuture<decltype(std::declval<typename std::decay<F>::type>()(
+      std::declval<typename std::decay<Args>::type>()...))>
+  SubmitFor(int wait_ms, F&& f, Args&&... args);
+
+  /// @brief 不等待的 Post
+  /// @return PoolSubmitResult
+  template<typename F>
+  int TryPost(F&& f);
+
+  /// @brief 通道满时最多等待 wait_ms 毫秒的 Post
+  /// @return PoolSubmitResult
+  template<typename F>
+  int PostFor(int wait_ms, F&& f);
+
+  // co_await pool.Schedule() 的等待对象，协程在线程池的线程中继续执行
+  class ScheduleAwaiter {
+   public:
+    explicit ScheduleAwaiter(ThreadPool* pool) : pool_(pool) {}
+
+    bool await_ready() const { return false; }
+
+    // 恢复协程的任务只捕获协程句柄，直接存储在队列的格子里，不分配内存
+    // 线程池已经关闭时不挂起，在当前线程继续执行
+    template<typename Handle>
+    bool await_suspend(Handle h) {
+      return pool_->Post([h]() mutable { h.resume(); }) == 0;
+    }
+
+    void await_resume() const {}
+
+   private:
+    ThreadPool* pool_;
+  };
+
+  /// @brief C++20 协程中 co_await pool.Schedule() 切换到线程池中执行，
+  /// 其余的协程工具见 Coroutine.h
+  ScheduleAwaiter Schedule() { return ScheduleAwaiter(this); }
+
+  /// @brief 取得伸缩相关的统计，不加锁，各项是同一时刻附近的瞬时值
+  /// 有多个子线程池时是所有子线程池的合计（排队时间是平均值）
+  PoolScaleStats GetScaleStats() const;
+
+  /// @brief 合并各工作线程的直方图和计数器，不加锁，不影响正在运行的线程
+  /// 各项是同一时刻附近的瞬时值，相互之间不保证严格一致
+  void GetStatsSnapshot(PoolStatsSnapshot* out) const;
+
+  /// @brief 子线程池（NUMA 节点）的数量
+  int GetNodeCount() const { return pool_count_; }
+
   /// @brief 消费者从任务队列中取任务
-  /// @param 线程工作函数的参数
+  /// @param 线程工作函数的参数（工作线程槽位 worker_t）
   /// @return 一般没有返回值，因为线程的工作是一个死循环
   // 线程函数的类型为：void* (*cb_func)(void*)
   // 使用 static 的作用：1.让其不属于类对象，从而不会隐式加上 this 参数
   //                    2.让其具有与全局函数相同的行为，使之与线程工作函数的类型相同
   static void* Custom(void*);
 
-  /// @brief 管理者线程，用于动态的管理线程池中线程的数量
+  /// @brief 管理者线程，根据任务排队时间和队列长度扩容，平时睡眠，
+  ///        积压时被提交任务的线程或工作线程立即唤醒
   /// @param  线程工作函数的参数
   /// @return 一般没有返回值，因为线程的工作是一个死循环
   static void* Manager(void*);
@@ -86,9 +503,250 @@ class ThreadPool {
   /// @brief 由静态的 Manager 函数调用，因此必须是静态的。用于判断
   ///        一个线程是否还存活
   /// @param  需要判断的线程的线程id
-  /// @return 存活返回 TRUE 
+  /// @return 存活返回 TRUE
   static bool IfThreadAlive(pthread_t);
 
  private:
-  pool_t* pool_; // 线程池对象指针
+  // 在槽位 i 上创建一个工作线程，调用者需持有 lock
+  static bool SpawnWorker(pool_t* p, int i);
+
+  // 关闭一个子线程池，等待线程退出后释放
+  static void DestroySubPool(pool_t* p);
+
+  // 当前线程应该提交到的子线程池：工作线程是自己所在的，其他线程是当前 CPU 所在节点的
+  int HomePool() const;
+
+  // 当前线程是否是子线程池 p 的工作窃取模式的工作线程
+  static bool InStealWorker(pool_t* p);
+
+  // 本节点满了之后按距离依次尝试其他子线程池，不等待
+  // 放入返回 1，都满了返回 0，线程池已经关闭返回 -1
+  int SpillTask(int home, const task_t& t);
+
+  // 批量版本，返回放入其他子线程池的任务数量
+  int SpillBatch(int home, const task_t* tasks, int n, long long now);
+
+  // 工作窃取模式下工作线程的主循环
+  static void* StealLoop(worker_t* w);
+
+  // 从共享队列取出一个任务，并顺带搬一批到本地队列
+  static bool TakeInjected(worker_t* w, task_t* task);
+
+  // 随机选择其他线程的本地队列窃取一个任务
+  static bool StealOther(worker_t* w, task_t* task);
+
+  // 所有本地队列是否都为空
+  static bool DequesEmpty(pool_t* p);
+
+  // 有工作线程在睡眠时最多唤醒 n 个
+  static void WakeSome(pool_t* p, int n);
+
+  // 共享队列或（工作窃取模式下）任意本地队列中有任务
+  static bool HasWork(pool_t* p);
+
+  // 按空闲策略自旋等待任务，等到任务或线程池关闭返回 true
+  static bool SpinForWork(worker_t* w);
+
+  // 在自己的 futex 上睡眠，直到被唤醒或空闲超时，调用前后都持有 lock
+  // 超时返回 false
+  static bool ParkLocked(worker_t* w);
+
+  // 最多唤醒 n 个睡眠的线程，调用者需持有 lock
+  static void UnparkLocked(pool_t* p, int n);
+
+  // 把最多 n 个任务放入通道 lane，入队时间记为 now，返回放入的数量，调用者需持有 lock
+  static int PutLocked(pool_t* p, int lane, const task_t* tasks, int n,
+                       long long now);
+
+  // 放入 n 个任务后唤醒睡眠的线程，调用者需持有 lock
+  static void SignalLocked(pool_t* p, int n);
+
+  // 把任务放入任务队列，返回 PoolSubmitResult，没有放入时任务没有被释放
+  int AddTask(const task_t& task, int wait_ms = -1);
+
+  // AddTask 的实现，home 为 HomePool() 的结果
+  int PutTask(int home, const task_t& task, int wait_ms);
+
+  // ProducerAddBatch 的实现
+  int PutBatch(int home, const task_t* tasks, int n);
+
+  // 在提交的线程中直接执行一个没有入队的任务
+  static void RunInline(pool_t* p, const task_t& t);
+
+  // 通道满且等待超时的任务按拒绝策略处理，调用时持有 lock，返回前释放
+  static int RejectLocked(pool_t* p, const task_t& t);
+
+  // 记录提交成功（ok 为真）或被拒绝的任务数
+  static void CountSubmit(pool_t* p, int n, bool ok);
+
+  // 执行一个取到的任务，统计排队时间和执行时间，过期的任务不执行
+  static void Execute(worker_t* w, task_t* task);
+
+  // 丢弃所有队列中没有执行的任务
+  static void DiscardTasks(pool_t* p);
+
+  // 按选项初始化一个任务的公共字段
+  static void MakeTask(task_t* t, const TaskOptions& opts);
+
+  // 任务实际使用的通道
+  static int LaneOf(pool_t* p, int lane);
+
+  // 按任务各自的通道依次放入共享队列，遇到放不下的通道就停止，返回放入的数量，
+  // 调用者需持有 lock
+  static int PutBatchLocked(pool_t* p, const task_t* tasks, int n,
+                            long long now);
+
+  // 按通道策略从共享队列取出一个任务，调用者需持有 lock 且队列非空
+  static void TakeLocked(pool_t* p, task_t* task);
+
+  // 取到任务之后、执行之前调用：统计排队时间，任务过期时丢弃并返回 false
+  static bool Admit(worker_t* w, task_t* task, long long now);
+
+  // 记录取到的任务的排队时间，排队过长时请求扩容
+  static void NoteWait(worker_t* w, const task_t& task, long long now);
+
+  // 请求管理者线程立即检查是否扩容，调用者需持有 lock
+  static void RequestGrowLocked(pool_t* p);
+
+  // 提交任务后检查是否积压，调用者需持有 lock
+  static void CheckBacklogLocked(pool_t* p);
+
+  // 空闲超时的线程退出，调用者需持有 lock，返回前释放
+  static void RetireWorker(worker_t* w);
+
+  // 调用 on_scale 回调
+  static void EmitScale(pool_t* p, PoolScaleReason reason, int before,
+                        int after, int depth);
+
+  // 内联存储的可调用对象
+  template<typename Fn>
+  static void InlineCall(task_t* t, bool run) {
+    if (run) {
+      (*reinterpret_cast<Fn*>(t->storage))();
+    }
+  }
+
+  // 堆上的可调用对象
+  template<typename Fn>
+  static void BoxedCall(task_t* t, bool run) {
+    Fn* fn = static_cast<Fn*>(t->arg);
+    if (run) {
+      (*fn)();
+    }
+    delete fn;
+  }
+
+  template<typename Fn, typename F>
+  static void StoreCallable(task_t* t, F&& f, std::true_type) {
+    new (t->storage) Fn(std::forward<F>(f));
+    t->call = &InlineCall<Fn>;
+  }
+
+  template<typename Fn, typename F>
+  static void StoreCallable(task_t* t, F&& f, std::false_type) {
+    t->arg = new Fn(std::forward<F>(f));
+    t->call = &BoxedCall<Fn>;
+  }
+
+  // Submit 的共享状态
+  template<typename R>
+  static void StateCall(task_t* t, bool run) {
+    TaskStateBase<R>* state = static_cast<TaskStateBase<R>*>(t->arg);
+    if (run) {
+      state->Run();
+    } else {
+      state->Discard("task discarded before running");
+    }
+    state->Release();
+  }
+
+  pool_t* pools_[_DEF_MAX_NODES]; // 子线程池，没有启用 NUMA 时只有一个
+  int pool_count_; // 子线程池的数量
+  int spill_order_[_DEF_MAX_NODES][_DEF_MAX_NODES]; // 每个节点溢出时依次尝试的子线程池
+  unsigned char cpu_pool_[CPU_SETSIZE]; // CPU 所在节点的子线程池下标
 };
+
+template<typename F, typename... Args>
+TaskFuture<decltype(std::declval<typename std::decay<F>::type>()(
+    std::declval<typename std::decay<Args>::type>()...))>
+ThreadPool::Submit(F&& f, Args&&... args) {
+  return SubmitWith(TaskOptions(), std::forward<F>(f),
+                    std::forward<Args>(args)...);
+}
+
+template<typename F>
+int ThreadPool::Post(F&& f) {
+  return PostWith(TaskOptions(), std::forward<F>(f));
+}
+
+template<typename F, typename... Args>
+TaskFuture<decltype(std::declval<typename std::decay<F>::type>()(
+    std::declval<typename std::decay<Args>::type>()...))>
+ThreadPool::TrySubmit(F&& f, Args&&... args) {
+  return SubmitWith(TaskOptions(-1, 0, 0), std::forward<F>(f),
+                    std::forward<Args>(args)...);
+}
+
+template<typename F, typename... Args>
+TaskFuture<decltype(std::declval<typename std::decay<F>::type>()(
+    std::declval<typename std::decay<Args>::type>()...))>
+ThreadPool::SubmitFor(int wait_ms, F&& f, Args&&... args) {
+  return SubmitWith(TaskOptions(-1, 0, wait_ms < 0 ? 0 : wait_ms),
+                    std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+template<typename F>
+int ThreadPool::TryPost(F&& f) {
+  return PostWith(TaskOptions(-1, 0, 0), std::forward<F>(f));
+}
+
+template<typename F>
+int ThreadPool::PostFor(int wait_ms, F&& f) {
+  return PostWith(TaskOptions(-1, 0, wait_ms < 0 ? 0 : wait_ms),
+                  std::forward<F>(f));
+}
+
+template<typename F, typename... Args>
+TaskFuture<decltype(std::declval<typename std::decay<F>::type>()(
+    std::declval<typename std::decay<Args>::type>()...))>
+ThreadPool::SubmitWith(const TaskOptions& opts, F&& f, Args&&... args) {
+  typedef typename std::decay<F>::type Fn;
+  typedef decltype(std::declval<Fn>()(
+      std::declval<typename std::decay<Args>::type>()...)) R;
+  TaskStateBase<R>* state =
+      new TaskState<R, Fn, typename std::decay<Args>::type...>(
+          std::forward<F>(f), std::forward<Args>(args)...);
+
+  task_t t;
+  MakeTask(&t, opts);
+  t.arg = state;
+  t.call = &StateCall<R>;
+  int ret = AddTask(t, opts.wait_ms);
+  if (ret == kSubmitRejected) {
+    state->Discard("task rejected");
+    state->Release();
+  } else if (ret != kSubmitOk) {
+    StateCall<R>(&t, false);
+  }
+  return TaskFuture<R>(state);
+}
+
+template<typename F>
+int ThreadPool::PostWith(const TaskOptions& opts, F&& f) {
+  typedef typename std::decay<F>::type Fn;
+  // 可平凡拷贝的对象可以随 task_t 逐字节拷贝，也不需要析构
+  typedef std::integral_constant<
+      bool, std::is_trivially_copyable<Fn>::value &&
+                sizeof(Fn) <= sizeof(((task_t*)0)->storage) &&
+                alignof(Fn) <= alignof(uintptr_t)> Inline;
+  task_t t;
+  MakeTask(&t, opts);
+  StoreCallable<Fn>(&t, std::forward<F>(f), Inline());
+  int ret = AddTask(t, opts.wait_ms);
+  if (ret != kSubmitOk) {
+    DiscardTask(&t);
+  }
+  return ret;
+}
+
+#endif
@@ -0,0 +1,141 @@
+/*
+工作窃取模式下每个工作线程的本地任务队列（Chase-Lev 双端队列）
+只有所属的工作线程在底部 Push / Pop（后进先出，缓存更热），
+其他空闲的线程从顶部 Steal（先进先出），只有队列里只剩一个任务时
+所属线程和窃取者之间才需要一次 CAS。
+容量固定，满了 Push 返回 false，由调用者放到线程池的共享队列中。
+格子按机器字用原子变量读写，窃取者读到被覆盖的旧值时 CAS 必然失败，
+不存在数据竞争，因此元素类型必须是可平凡拷贝的。
+*/
+
+#ifndef WORK_STEAL_DEQUE_H
+#define WORK_STEAL_DEQUE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <type_traits>
+
+template<typename T>
+class WorkStealDeque {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "WorkStealDeque element must be trivially copyable");
+
+ public:
+  /// @param capacity 容量，向上取整为 2 的幂
+  explicit WorkStealDeque(int capacity) {
+    capacity_ = 1;
+    while (capacity_ < (long)capacity) {
+      capacity_ <<= 1;
+    }
+    mask_ = capacity_ - 1;
+    slots_ = new Slot[capacity_];
+    top_.store(0, std::memory_order_relaxed);
+    bottom_.store(0, std::memory_order_relaxed);
+  }
+
+  ~WorkStealDeque() {
+    delete[] slots_;
+  }
+
+  WorkStealDeque(const WorkStealDeque& other) = delete;
+  WorkStealDeque& operator=(const WorkStealDeque& other) = delete;
+
+  /// @brief 所属线程在底部放入一个任务
+  /// @return 队列满时返回 false
+  bool Push(const T& item) {
+    long b = bottom_.load(std::memory_order_relaxed);
+    long t = top_.load(std::memory_order_acquire);
+    if (b - t >= capacity_) {
+      return false;
+    }
+    Store(&slots_[b & mask_], item);
+    // 先写好格子再发布新的 bottom_
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /// @brief 所属线程从底部取出一个任务
+  /// @return 队列为空（或最后一个任务被窃取）时返回 false
+  bool Pop(T* item) {
+    long b = bottom_.load(std::memory_order_relaxed) - 1;
+    bottom_.store(b, std::memory_order_relaxed);
+    // bottom_ 的修改必须先于读取 top_ 对窃取者可见
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long t = top_.load(std::memory_order_relaxed);
+    if (t > b) {
+      // 队列为空
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return false;
+    }
+    Load(&slots_[b & mask_], item);
+    if (t == b) {
+      // 只剩最后一个任务，与窃取者竞争
+      bool won = top_.compare_exchange_strong(t, t + 1,
+                                              std::memory_order_seq_cst,
+                                              std::memory_order_relaxed);
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  /// @brief 其他线程从顶部窃取一个任务
+  /// @return 队列为空或与其他线程竞争失败时返回 false
+  bool Steal(T* item) {
+    long t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) {
+      return false;
+    }
+    Load(&slots_[t & mask_], item);
+    return top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed);
+  }
+
+  // 任务数量的瞬时值，可以在任何线程调用
+  long Size() const {
+    long b = bottom_.load(std::memory_order_seq_cst);
+    long t = top_.load(std::memory_order_seq_cst);
+    return b > t ? b - t : 0;
+  }
+
+  bool isEmpty() const { return Size() == 0; }
+
+ private:
+  static const int kWords = (sizeof(T) + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
+
+  struct Slot {
+    std::atomic<uintptr_t> words[kWords];
+  };
+
+  static void Store(Slot* slot, const T& item) {
+    uintptr_t words[kWords] = {0};
+    memcpy(words, &item, sizeof(T));
+    for (int i = 0; i < kWords; ++i) {
+      slot->words[i].store(words[i], std::memory_order_relaxed);
+    }
+  }
+
+  static void Load(const Slot* slot, T* item) {
+    uintptr_t words[kWords];
+    for (int i = 0; i < kWords; ++i) {
+      words[i] = slot->words[i].load(std::memory_order_relaxed);
+    }
+    memcpy(item, words, sizeof(T));
+  }
+
+  // top_ 被窃取者修改，bottom_ 只被所属线程修改，分开放在两个缓存行
+  char pad0_[64];
+  std::atomic<long> top_;
+  char pad1_[64 - sizeof(std::atomic<long>)];
+  std::atomic<long> bottom_;
+  char pad2_[64 - sizeof(std::atomic<long>)];
+  Slot* slots_;
+  long capacity_;
+  long mask_;
+};
+
+#endif